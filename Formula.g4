@@ -9,8 +9,12 @@ expr
     | (ADD | SUB) expr  # UnaryOp
     | expr (MUL | DIV) expr  # BinaryOp
     | expr (ADD | SUB) expr  # BinaryOp
+    | expr (EQ | NE | LT | LE | GT | GE) expr  # Comparison
+    | NAME '(' (expr (',' expr)*)? ')'  # Call
+    | CELL ':' CELL  # Range
     | CELL  # Cell
     | NUMBER  # Literal
+    | STRING  # String
     ;
 
 // number literals cannot be signed, or else 1-2 would be lexed as [1] [-2]
@@ -26,5 +30,14 @@ ADD: '+' ;
 SUB: '-' ;
 MUL: '*' ;
 DIV: '/' ;
+EQ: '=' ;
+NE: '<>' ;
+LT: '<' ;
+LE: '<=' ;
+GT: '>' ;
+GE: '>=' ;
 CELL: [A-Z]+[0-9]+ ;
+NAME: [A-Z]+ ;
+// a quote inside a string is written twice
+STRING: '"' (~'"' | '""')* '"' ;
 WS: [ \t\n\r]+ -> skip ;
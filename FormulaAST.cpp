@@ -3,17 +3,26 @@
 #include "FormulaBaseListener.h"
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
+#include "exprpool.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cfloat>
+#include <charconv>
 #include <cmath>
+#include <cstring>
+#include <iterator>
 #include <memory>
 #include <optional>
 #include <sstream>
+#include <type_traits>
 
 namespace ASTImpl 
 {
     enum ExprPrecedence 
     {
+        EP_CMP,
         EP_ADD,
         EP_SUB,
         EP_MUL,
@@ -34,12 +43,13 @@ namespace ASTImpl
     
     constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = 
     {
-        /* EP_ADD */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-        /* EP_SUB */ {PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-        /* EP_MUL */ {PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-        /* EP_DIV */ {PR_BOTH, PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE},
-        /* EP_UNARY */ {PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-        /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+        /* EP_CMP */ {PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+        /* EP_ADD */ {PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+        /* EP_SUB */ {PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+        /* EP_MUL */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+        /* EP_DIV */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE},
+        /* EP_UNARY */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+        /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
     };
 
     class Expr 
@@ -53,8 +63,75 @@ namespace ASTImpl
 
         virtual double Evaluate(const SheetArgs& args_) const = 0;
 
+        // Value of the node as the key of a lookup. Cells and strings can be text;
+        // everything else is its number.
+        virtual LookupKey EvaluateKey(const SheetArgs& args_) const
+        {
+            return Evaluate(args_);
+        }
+
+        // The cells a range argument names; nullptr for every other node.
+        virtual const Range* GetRange() const
+        {
+            return nullptr;
+        }
+
+        // Shape of the node's value: 1x1 for a single value, and the shape of the ranges
+        // for arithmetic over them, which is done element by element.
+        virtual Size GetArraySize() const
+        {
+            return Size{ 1, 1 };
+        }
+
+        // Fills out_ with the elements of a node whose shape is not 1x1; only such nodes are asked.
+        virtual void EvaluateArray(const SheetArgs& /* args */, ArrayValue& /* out */) const {}
+
         virtual ExprPrecedence GetPrecedence() const = 0;
 
+        // Bytes held by this node and its subtree.
+        virtual size_t GetMemoryUsage() const = 0;
+
+        // Shallow hash and equality for the pool: children compare by identity, since
+        // pooled children are equal exactly when they are the same node.
+        virtual size_t Hash() const = 0;
+        virtual bool SameAs(const Expr& other_) const = 0;
+        virtual void ForEachChild(const std::function<void(const Expr&)>& /* action */) const {}
+
+        // Leaves are cheaper to read again than to look up, so only inner nodes are shared.
+        virtual bool IsLeaf() const
+        {
+            return false;
+        }
+
+        // Set by the pool that interned the node: a key no other node of any pool gets, and
+        // whether more than one parent was handed the node. Unpooled nodes have neither.
+        uint64_t GetPoolId() const
+        {
+            return pool_id;
+        }
+
+        bool IsShared() const
+        {
+            return shared.load(std::memory_order_relaxed);
+        }
+
+        void SetPoolId(uint64_t pool_id_) const
+        {
+            pool_id = pool_id_;
+        }
+
+        void MarkShared() const
+        {
+            shared.store(true, std::memory_order_relaxed);
+        }
+
+        // Appends the node to the kernel of the formula in cell origin_; false unless the
+        // subtree is plain arithmetic over numbers and cells outside origin_'s column.
+        virtual bool Compile(ColumnKernel& /* kernel */, Position /* origin */) const
+        {
+            return false;
+        }
+
         void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence_,
             bool right_child_ = false) const 
         {
@@ -73,10 +150,140 @@ namespace ASTImpl
                 out << ')';
             }
         }
+
+    private:
+
+        mutable uint64_t pool_id = 0;
+        mutable std::atomic<bool> shared = false;
     };
 
+    using ExprPtr = std::shared_ptr<const Expr>;
+
     namespace 
     {
+        size_t HashCombine(size_t seed_, size_t value_)
+        {
+            return seed_ ^ (value_ + 0x9e3779b97f4a7c15ull + (seed_ << 6) + (seed_ >> 2));
+        }
+
+        // Leaves are not pooled, so they are told apart by value; every other child by identity.
+        size_t HashNode(const ExprPtr& node_)
+        {
+            return node_->IsLeaf() ? node_->Hash() : std::hash<const Expr*>()(node_.get());
+        }
+
+        bool SameNode(const ExprPtr& lhs_, const ExprPtr& rhs_)
+        {
+            return lhs_ == rhs_ || (lhs_->IsLeaf() && rhs_->IsLeaf() && lhs_->SameAs(*rhs_));
+        }
+
+        // A node the pool handed to more than one parent is evaluated through the sheet,
+        // which can keep one value for every formula sharing it.
+        double EvaluateNode(const ExprPtr& node_, const SheetArgs& args_)
+        {
+            if (node_->IsShared())
+            {
+                return args_.EvaluateShared(node_->GetPoolId(), [&node_, &args_]
+                    {
+                        return node_->Evaluate(args_);
+                    });
+            }
+            return node_->Evaluate(args_);
+        }
+
+        bool IsArray(const ExprPtr& node_)
+        {
+            return !(node_->GetArraySize() == Size{ 1, 1 });
+        }
+
+        // Operand of an element-wise operation that is a single value, or its error, for every element.
+        struct SingleOperand
+        {
+            double number = 0;
+            uint8_t error = 0;
+        };
+
+        SingleOperand EvaluateSingle(const ExprPtr& node_, const SheetArgs& args_)
+        {
+            SingleOperand result;
+            try
+            {
+                result.number = EvaluateNode(node_, args_);
+            }
+            catch (const FormulaError& error_)
+            {
+                result.error = ArrayValue::ToCode(error_);
+            }
+            return result;
+        }
+
+        // Applies op_ to the elements of out_ and those of an array or a single value on
+        // its other side, in place. The numbers go through a loop doing nothing else, so it
+        // vectorizes; then each element takes the error of its left operand, else that of
+        // its right one, else #ARITHM! when the result is not finite, as a formula would.
+        template <typename Op, typename Other>
+        void CombineElements(ArrayValue& out_, const Other& other_, bool out_is_lhs_, Op op_)
+        {
+            const size_t count = out_.numbers.size();
+            double* numbers = out_.numbers.data();
+            uint8_t* errors = out_.errors.data();
+
+            if constexpr (std::is_same_v<Other, SingleOperand>)
+            {
+                const double other = other_.number;
+                if (out_is_lhs_)
+                {
+                    for (size_t i = 0; i < count; ++i)
+                    {
+                        numbers[i] = op_(numbers[i], other);
+                    }
+                }
+                else
+                {
+                    for (size_t i = 0; i < count; ++i)
+                    {
+                        numbers[i] = op_(other, numbers[i]);
+                    }
+                }
+            }
+            else
+            {
+                const double* other = other_.numbers.data();
+                if (out_is_lhs_)
+                {
+                    for (size_t i = 0; i < count; ++i)
+                    {
+                        numbers[i] = op_(numbers[i], other[i]);
+                    }
+                }
+                else
+                {
+                    for (size_t i = 0; i < count; ++i)
+                    {
+                        numbers[i] = op_(other[i], numbers[i]);
+                    }
+                }
+            }
+
+            const uint8_t div0 = ArrayValue::ToCode(FormulaError::Category::Div0);
+            for (size_t i = 0; i < count; ++i)
+            {
+                uint8_t other_error = 0;
+                if constexpr (std::is_same_v<Other, SingleOperand>)
+                {
+                    other_error = other_.error;
+                }
+                else
+                {
+                    other_error = other_.errors[i];
+                }
+                const uint8_t lhs_error = out_is_lhs_ ? errors[i] : other_error;
+                const uint8_t rhs_error = out_is_lhs_ ? other_error : errors[i];
+                const uint8_t error = lhs_error ? lhs_error : rhs_error;
+                errors[i] = error ? error : (std::abs(numbers[i]) <= DBL_MAX ? 0 : div0);
+            }
+        }
+
         class BinaryOpExpr final : public Expr 
         {
         public:
@@ -88,7 +295,8 @@ namespace ASTImpl
                 Divide = '/',
             };
 
-            explicit BinaryOpExpr(Type type_, std::unique_ptr<Expr> lhs_, std::unique_ptr<Expr> rhs_) : type(type_), lhs(std::move(lhs_)), rhs(std::move(rhs_)) {}
+            // Operands are arrays of one shape or single values, as checked when parsing.
+            explicit BinaryOpExpr(Type type_, ExprPtr lhs_, ExprPtr rhs_) : type(type_), size(IsArray(lhs_) ? lhs_->GetArraySize() : rhs_->GetArraySize()), lhs(std::move(lhs_)), rhs(std::move(rhs_)) {}
 
             void Print(std::ostream& out_) const override 
             {
@@ -101,132 +309,839 @@ namespace ASTImpl
 
             void DoPrintFormula(std::ostream& out_, ExprPrecedence precedence_) const override 
             {
-                lhs->PrintFormula(out_, precedence_);
-                out_ << static_cast<char>(type);
-                rhs->PrintFormula(out_, precedence_, /* right_child = */ true);
+                lhs->PrintFormula(out_, precedence_);
+                out_ << static_cast<char>(type);
+                rhs->PrintFormula(out_, precedence_, /* right_child = */ true);
+            }
+
+            ExprPrecedence GetPrecedence() const override 
+            {
+                switch (type) 
+                {
+                case Add:
+                    return EP_ADD;
+
+                case Subtract:
+                    return EP_SUB;
+
+                case Multiply:
+                    return EP_MUL;
+
+                case Divide:
+                    return EP_DIV;
+
+                default:
+                    assert(false);
+                    return static_cast<ExprPrecedence>(INT_MAX);
+                }
+            }
+
+            double Evaluate(const SheetArgs& args_) const override 
+            {
+                double lhsValue = EvaluateNode(lhs, args_);
+                double rhsValue = EvaluateNode(rhs, args_);
+                double result = 0.0;
+
+                switch (type)
+                {
+                case Add:
+                    result = lhsValue + rhsValue;
+                    break;
+
+                case Subtract:
+                    result = lhsValue - rhsValue;
+                    break;
+
+                case Multiply:
+                    result = lhsValue * rhsValue;
+                    break;
+
+                case Divide:
+                    result = lhsValue / rhsValue;
+                    break;
+                }
+                if (!std::isfinite(result))
+                {
+                    throw FormulaError{ FormulaError::Category::Div0 };
+                }
+
+                return result;
+            }
+
+            size_t GetMemoryUsage() const override
+            {
+                return sizeof(*this) + lhs->GetMemoryUsage() + rhs->GetMemoryUsage();
+            }
+
+            size_t Hash() const override
+            {
+                return HashCombine(HashCombine(HashCombine('B', type), HashNode(lhs)), HashNode(rhs));
+            }
+
+            bool SameAs(const Expr& other_) const override
+            {
+                const auto* other = dynamic_cast<const BinaryOpExpr*>(&other_);
+                return other && other->type == type && SameNode(other->lhs, lhs) && SameNode(other->rhs, rhs);
+            }
+
+            void ForEachChild(const std::function<void(const Expr&)>& action_) const override
+            {
+                action_(*lhs);
+                action_(*rhs);
+            }
+
+            bool Compile(ColumnKernel& kernel_, Position origin_) const override
+            {
+                if (!lhs->Compile(kernel_, origin_) || !rhs->Compile(kernel_, origin_))
+                {
+                    return false;
+                }
+                kernel_.PushBinary(type);
+                return true;
+            }
+
+            Size GetArraySize() const override
+            {
+                return size;
+            }
+
+            void EvaluateArray(const SheetArgs& args_, ArrayValue& out_) const override
+            {
+                switch (type)
+                {
+                case Add:
+                    EvaluateElements(args_, out_, std::plus<double>());
+                    break;
+
+                case Subtract:
+                    EvaluateElements(args_, out_, std::minus<double>());
+                    break;
+
+                case Multiply:
+                    EvaluateElements(args_, out_, std::multiplies<double>());
+                    break;
+
+                case Divide:
+                    EvaluateElements(args_, out_, std::divides<double>());
+                    break;
+                }
+            }
+
+        private:
+
+            // The left array, or the right one when the left side is a single value, is
+            // evaluated straight into out_ and combined there with the other side.
+            template <typename Op>
+            void EvaluateElements(const SheetArgs& args_, ArrayValue& out_, Op op_) const
+            {
+                const bool lhs_is_array = IsArray(lhs);
+                (lhs_is_array ? lhs : rhs)->EvaluateArray(args_, out_);
+
+                const ExprPtr& other = lhs_is_array ? rhs : lhs;
+                if (IsArray(other))
+                {
+                    ArrayValue values;
+                    other->EvaluateArray(args_, values);
+                    CombineElements(out_, values, lhs_is_array, op_);
+                }
+                else
+                {
+                    CombineElements(out_, EvaluateSingle(other, args_), lhs_is_array, op_);
+                }
+            }
+
+            Type type;
+            // Kept rather than asked of the operands, which would walk the whole subtree.
+            Size size;
+            ExprPtr lhs;
+            ExprPtr rhs;
+        };
+
+        // Comparisons yield 1 for true and 0 for false, which is what IF, AND and OR test.
+        class ComparisonExpr final : public Expr 
+        {
+        public:
+            enum Type 
+            {
+                Equal,
+                NotEqual,
+                Less,
+                LessOrEqual,
+                Greater,
+                GreaterOrEqual,
+            };
+
+            explicit ComparisonExpr(Type type_, ExprPtr lhs_, ExprPtr rhs_) : type(type_), lhs(std::move(lhs_)), rhs(std::move(rhs_)) {}
+
+            void Print(std::ostream& out_) const override 
+            {
+                out_ << '(' << GetSymbol() << ' ';
+                lhs->Print(out_);
+                out_ << ' ';
+                rhs->Print(out_);
+                out_ << ')';
+            }
+
+            void DoPrintFormula(std::ostream& out_, ExprPrecedence precedence_) const override 
+            {
+                lhs->PrintFormula(out_, precedence_);
+                out_ << GetSymbol();
+                rhs->PrintFormula(out_, precedence_, /* right_child = */ true);
+            }
+
+            ExprPrecedence GetPrecedence() const override 
+            {
+                return EP_CMP;
+            }
+
+            double Evaluate(const SheetArgs& args_) const override 
+            {
+                const double lhsValue = EvaluateNode(lhs, args_);
+                const double rhsValue = EvaluateNode(rhs, args_);
+
+                switch (type)
+                {
+                case Equal:
+                    return lhsValue == rhsValue;
+
+                case NotEqual:
+                    return lhsValue != rhsValue;
+
+                case Less:
+                    return lhsValue < rhsValue;
+
+                case LessOrEqual:
+                    return lhsValue <= rhsValue;
+
+                case Greater:
+                    return lhsValue > rhsValue;
+
+                case GreaterOrEqual:
+                    return lhsValue >= rhsValue;
+                }
+                return 0;
+            }
+
+            size_t GetMemoryUsage() const override
+            {
+                return sizeof(*this) + lhs->GetMemoryUsage() + rhs->GetMemoryUsage();
+            }
+
+            size_t Hash() const override
+            {
+                return HashCombine(HashCombine(HashCombine('C', type), HashNode(lhs)), HashNode(rhs));
+            }
+
+            bool SameAs(const Expr& other_) const override
+            {
+                const auto* other = dynamic_cast<const ComparisonExpr*>(&other_);
+                return other && other->type == type && SameNode(other->lhs, lhs) && SameNode(other->rhs, rhs);
+            }
+
+            void ForEachChild(const std::function<void(const Expr&)>& action_) const override
+            {
+                action_(*lhs);
+                action_(*rhs);
+            }
+
+        private:
+
+            std::string_view GetSymbol() const
+            {
+                static constexpr std::string_view SYMBOLS[] = { "=", "<>", "<", "<=", ">", ">=" };
+                return SYMBOLS[type];
+            }
+
+            Type type;
+            ExprPtr lhs;
+            ExprPtr rhs;
+        };
+
+        // Criterion of COUNTIF: a number is matched as is, text may start with a comparison
+        // and is compared as a number when the rest spells one.
+        LookupCriterion ParseCriterion(LookupKey key_)
+        {
+            using Comparison = LookupCriterion::Comparison;
+
+            LookupCriterion criterion;
+            if (std::holds_alternative<double>(key_))
+            {
+                criterion.key = key_;
+                return criterion;
+            }
+
+            static constexpr std::pair<std::string_view, Comparison> PREFIXES[] =
+            {
+                { "<>", Comparison::NotEqual },
+                { "<=", Comparison::LessOrEqual },
+                { ">=", Comparison::GreaterOrEqual },
+                { "<", Comparison::Less },
+                { ">", Comparison::Greater },
+                { "=", Comparison::Equal },
+            };
+
+            std::string_view text = std::get<std::string_view>(key_);
+            for (const auto& [prefix, comparison] : PREFIXES)
+            {
+                if (text.substr(0, prefix.size()) == prefix)
+                {
+                    criterion.comparison = comparison;
+                    text.remove_prefix(prefix.size());
+                    break;
+                }
+            }
+
+            double number = 0;
+            const auto parsed = std::from_chars(text.data(), text.data() + text.size(), number);
+            if (!text.empty() && parsed.ec == std::errc() && parsed.ptr == text.data() + text.size())
+            {
+                criterion.key = number;
+            }
+            else
+            {
+                criterion.key = text;
+            }
+            return criterion;
+        }
+
+        // IF, AND and OR evaluate their arguments left to right and stop as soon as the
+        // result is known, so an argument that is not needed is never read and its errors
+        // never surface. VLOOKUP, MATCH and COUNTIF hand their range to the sheet, which
+        // answers from its column indexes instead of reading every cell of the range.
+        class FunctionExpr final : public Expr 
+        {
+        public:
+            enum Type 
+            {
+                If,
+                And,
+                Or,
+                VLookup,
+                Match,
+                CountIf,
+            };
+
+            explicit FunctionExpr(Type type_, std::vector<ExprPtr> args_) : type(type_), args(std::move(args_)) {}
+
+            // Throws ParsingError for an unknown name or a wrong number of arguments.
+            static Type FromName(const std::string& name_, size_t arg_count_)
+            {
+                if (name_ == "IF" && (arg_count_ == 2 || arg_count_ == 3))
+                {
+                    return If;
+                }
+                if (name_ == "AND" && arg_count_ > 0)
+                {
+                    return And;
+                }
+                if (name_ == "OR" && arg_count_ > 0)
+                {
+                    return Or;
+                }
+                if (name_ == "VLOOKUP" && (arg_count_ == 3 || arg_count_ == 4))
+                {
+                    return VLookup;
+                }
+                if (name_ == "MATCH" && (arg_count_ == 2 || arg_count_ == 3))
+                {
+                    return Match;
+                }
+                if (name_ == "COUNTIF" && arg_count_ == 2)
+                {
+                    return CountIf;
+                }
+                throw ParsingError("Unknown function or wrong argument count: " + name_);
+            }
+
+            // Whether argument index_ of a call is a range, which no other argument may be.
+            static bool TakesRange(Type type_, size_t index_)
+            {
+                switch (type_)
+                {
+                case VLookup:
+                case Match:
+                    return index_ == 1;
+
+                case CountIf:
+                    return index_ == 0;
+
+                default:
+                    return false;
+                }
+            }
+
+            void Print(std::ostream& out_) const override 
+            {
+                out_ << '(' << GetName();
+                for (const auto& arg : args)
+                {
+                    out_ << ' ';
+                    arg->Print(out_);
+                }
+                out_ << ')';
+            }
+
+            void DoPrintFormula(std::ostream& out_, ExprPrecedence /* precedence */) const override 
+            {
+                out_ << GetName() << '(';
+                for (size_t i = 0; i < args.size(); ++i)
+                {
+                    if (i > 0)
+                    {
+                        out_ << ',';
+                    }
+                    args[i]->PrintFormula(out_, EP_ATOM);
+                }
+                out_ << ')';
+            }
+
+            ExprPrecedence GetPrecedence() const override 
+            {
+                return EP_ATOM;
+            }
+
+            double Evaluate(const SheetArgs& args_) const override 
+            {
+                switch (type)
+                {
+                case If:
+                    if (EvaluateNode(args[0], args_) != 0)
+                    {
+                        return EvaluateNode(args[1], args_);
+                    }
+                    return args.size() > 2 ? EvaluateNode(args[2], args_) : 0;
+
+                case And:
+                    for (const auto& arg : args)
+                    {
+                        if (EvaluateNode(arg, args_) == 0)
+                        {
+                            return 0;
+                        }
+                    }
+                    return 1;
+
+                case Or:
+                    for (const auto& arg : args)
+                    {
+                        if (EvaluateNode(arg, args_) != 0)
+                        {
+                            return 1;
+                        }
+                    }
+                    return 0;
+
+                case VLookup:
+                    return EvaluateVLookup(args_);
+
+                case Match:
+                    return EvaluateMatch(args_);
+
+                case CountIf:
+                    return static_cast<double>(args_.GetSheet().CountIf(*args[0]->GetRange(), ParseCriterion(args[1]->EvaluateKey(args_))));
+                }
+                return 0;
+            }
+
+            size_t GetMemoryUsage() const override
+            {
+                size_t result = sizeof(*this) + args.capacity() * sizeof(ExprPtr);
+                for (const auto& arg : args)
+                {
+                    result += arg->GetMemoryUsage();
+                }
+                return result;
+            }
+
+            size_t Hash() const override
+            {
+                size_t result = HashCombine('F', type);
+                for (const auto& arg : args)
+                {
+                    result = HashCombine(result, HashNode(arg));
+                }
+                return result;
+            }
+
+            bool SameAs(const Expr& other_) const override
+            {
+                const auto* other = dynamic_cast<const FunctionExpr*>(&other_);
+                return other && other->type == type && std::equal(args.begin(), args.end(), other->args.begin(), other->args.end(), SameNode);
+            }
+
+            void ForEachChild(const std::function<void(const Expr&)>& action_) const override
+            {
+                for (const auto& arg : args)
+                {
+                    action_(*arg);
+                }
+            }
+
+        private:
+
+            std::string_view GetName() const
+            {
+                static constexpr std::string_view NAMES[] = { "IF", "AND", "OR", "VLOOKUP", "MATCH", "COUNTIF" };
+                return NAMES[type];
+            }
+
+            // Approximate matching, the default, takes the last row holding the greatest
+            // key not above the one looked up, as on a table sorted by its first column.
+            double EvaluateVLookup(const SheetArgs& args_) const
+            {
+                const LookupKey key = args[0]->EvaluateKey(args_);
+                const Range& table = *args[1]->GetRange();
+                const double column = std::trunc(EvaluateNode(args[2], args_));
+                if (column < 1)
+                {
+                    throw FormulaError(FormulaError::Category::Value);
+                }
+                if (column > table.size.cols)
+                {
+                    throw FormulaError(FormulaError::Category::Ref);
+                }
+                const bool approximate = args.size() < 4 || EvaluateNode(args[3], args_) != 0;
+
+                const Range keys{ table.top_left, Size{ table.size.rows, 1 } };
+                const int row = args_.GetSheet().FindInColumn(keys, key, approximate ? LookupMode::LessOrEqual : LookupMode::Exact);
+                if (row < 0)
+                {
+                    throw FormulaError(FormulaError::Category::NA);
+                }
+                return args_.GetNumber(Position{ row, table.top_left.col + static_cast<int>(column) - 1 });
+            }
+
+            // Match type 1, the default, finds the greatest key not above the one looked up,
+            // 0 an equal key and -1 the smallest key not below it.
+            double EvaluateMatch(const SheetArgs& args_) const
+            {
+                const LookupKey key = args[0]->EvaluateKey(args_);
+                const Range& column = *args[1]->GetRange();
+                if (column.size.cols != 1)
+                {
+                    throw FormulaError(FormulaError::Category::Value);
+                }
+                const double match_type = args.size() > 2 ? EvaluateNode(args[2], args_) : 1;
+                const LookupMode mode = match_type > 0 ? LookupMode::LessOrEqual : match_type < 0 ? LookupMode::GreaterOrEqual : LookupMode::Exact;
+
+                const int row = args_.GetSheet().FindInColumn(column, key, mode);
+                if (row < 0)
+                {
+                    throw FormulaError(FormulaError::Category::NA);
+                }
+                return row - column.top_left.row + 1;
+            }
+
+            Type type;
+            std::vector<ExprPtr> args;
+        };
+
+        class UnaryOpExpr final : public Expr 
+        {
+        public:
+            enum Type : char 
+            {
+                UnaryPlus = '+',
+                UnaryMinus = '-',
+            };
+
+            explicit UnaryOpExpr(Type type_, ExprPtr operand_) : type(type_), operand(std::move(operand_)) {}
+
+            void Print(std::ostream& out_) const override 
+            {
+                out_ << '(' << static_cast<char>(type) << ' ';
+                operand->Print(out_);
+                out_ << ')';
+            }
+
+            void DoPrintFormula(std::ostream& out_, ExprPrecedence precedence_) const override 
+            {
+                out_ << static_cast<char>(type);
+                operand->PrintFormula(out_, precedence_);
+            }
+
+            ExprPrecedence GetPrecedence() const override 
+            {
+                return EP_UNARY;
+            }
+
+            double Evaluate(const SheetArgs& args_) const override 
+            {
+                if (type == UnaryMinus)
+                {
+                    return -1 * EvaluateNode(operand, args_);
+                }
+                else return EvaluateNode(operand, args_);
+            }
+
+            size_t GetMemoryUsage() const override
+            {
+                return sizeof(*this) + operand->GetMemoryUsage();
+            }
+
+            size_t Hash() const override
+            {
+                return HashCombine(HashCombine('U', type), HashNode(operand));
+            }
+
+            bool SameAs(const Expr& other_) const override
+            {
+                const auto* other = dynamic_cast<const UnaryOpExpr*>(&other_);
+                return other && other->type == type && SameNode(other->operand, operand);
+            }
+
+            void ForEachChild(const std::function<void(const Expr&)>& action_) const override
+            {
+                action_(*operand);
+            }
+
+            bool Compile(ColumnKernel& kernel_, Position origin_) const override
+            {
+                if (!operand->Compile(kernel_, origin_))
+                {
+                    return false;
+                }
+                if (type == UnaryMinus)
+                {
+                    kernel_.PushNegate();
+                }
+                return true;
+            }
+
+            Size GetArraySize() const override
+            {
+                return operand->GetArraySize();
+            }
+
+            void EvaluateArray(const SheetArgs& args_, ArrayValue& out_) const override
+            {
+                operand->EvaluateArray(args_, out_);
+                if (type == UnaryMinus)
+                {
+                    for (double& number : out_.numbers)
+                    {
+                        number = -1 * number;
+                    }
+                }
+            }
+
+        private:
+
+            Type type;
+            ExprPtr operand;
+        };
+
+        class CellExpr final : public Expr 
+        {
+        public:
+
+            explicit CellExpr(Position cell_) : cell(cell_) {}
+
+            void Print(std::ostream& out_) const override 
+            {
+                if (!cell.IsValid()) 
+                {
+                    out_ << FormulaError::Category::Ref;
+                }
+                else 
+                {
+                    char name[Position::MAX_STRING_LENGTH];
+                    out_.write(name, static_cast<std::streamsize>(cell.ToChars(name)));
+                }
+            }
+
+            void DoPrintFormula(std::ostream& out_, ExprPrecedence /* precedence */) const override 
+            {
+                Print(out_);
             }
 
             ExprPrecedence GetPrecedence() const override 
             {
-                switch (type) 
-                {
-                case Add:
-                    return EP_ADD;
-
-                case Subtract:
-                    return EP_SUB;
-
-                case Multiply:
-                    return EP_MUL;
-
-                case Divide:
-                    return EP_DIV;
-
-                default:
-                    assert(false);
-                    return static_cast<ExprPrecedence>(INT_MAX);
-                }
+                return EP_ATOM;
             }
 
             double Evaluate(const SheetArgs& args_) const override 
             {
-                double lhsValue = lhs->Evaluate(args_);
-                double rhsValue = rhs->Evaluate(args_);
-                double result = 0.0;
+                return args_.GetNumber(cell);
+            }
 
-                switch (type)
+            LookupKey EvaluateKey(const SheetArgs& args_) const override
+            {
+                const CellInterface::ValueView value = args_.GetValue(cell);
+                if (const FormulaError* error = std::get_if<FormulaError>(&value))
                 {
-                case Add:
-                    result = lhsValue + rhsValue;
-                    break;
+                    throw *error;
+                }
+                if (const double* number = std::get_if<double>(&value))
+                {
+                    return *number;
+                }
+                const std::string_view text = std::get<std::string_view>(value);
+                if (double number = 0; ParseCanonicalNumber(text, number))
+                {
+                    return number;
+                }
+                return text;
+            }
 
-                case Subtract:
-                    result = lhsValue - rhsValue;
-                    break;
+            size_t GetMemoryUsage() const override
+            {
+                return sizeof(*this);
+            }
 
-                case Multiply:
-                    result = lhsValue * rhsValue;
-                    break;
+            size_t Hash() const override
+            {
+                return HashCombine('P', PositionHasher()(cell));
+            }
 
-                case Divide:
-                    result = lhsValue / rhsValue;
-                    break;
-                }
-                if (!std::isfinite(result))
+            bool SameAs(const Expr& other_) const override
+            {
+                const auto* other = dynamic_cast<const CellExpr*>(&other_);
+                return other && other->cell == cell;
+            }
+
+            // A run of formulas reading their own column may read each other, so those are left out.
+            bool Compile(ColumnKernel& kernel_, Position origin_) const override
+            {
+                if (!cell.IsValid() || cell.col == origin_.col)
                 {
-                    throw FormulaError{ FormulaError::Category::Div0 };
+                    return false;
                 }
+                kernel_.PushInput(cell.col, cell.row - origin_.row);
+                return true;
+            }
 
-                return result;
+            bool IsLeaf() const override
+            {
+                return true;
             }
 
         private:
 
-            Type type;
-            std::unique_ptr<Expr> lhs;
-            std::unique_ptr<Expr> rhs;
+            Position cell;
         };
 
-        class UnaryOpExpr final : public Expr 
+        // A range is what a lookup searches, or an array of the values of its cells; one
+        // cell on its own is just that cell's value.
+        class RangeExpr final : public Expr 
         {
         public:
-            enum Type : char 
-            {
-                UnaryPlus = '+',
-                UnaryMinus = '-',
-            };
 
-            explicit UnaryOpExpr(Type type_, std::unique_ptr<Expr> operand_) : type(type_), operand(std::move(operand_)) {}
+            explicit RangeExpr(Range range_) : range(range_) {}
 
             void Print(std::ostream& out_) const override 
             {
-                out_ << '(' << static_cast<char>(type) << ' ';
-                operand->Print(out_);
-                out_ << ')';
+                const Position bottom_right{ range.top_left.row + range.size.rows - 1, range.top_left.col + range.size.cols - 1 };
+                char name[Position::MAX_STRING_LENGTH];
+                out_.write(name, static_cast<std::streamsize>(range.top_left.ToChars(name))) << ':';
+                out_.write(name, static_cast<std::streamsize>(bottom_right.ToChars(name)));
             }
 
-            void DoPrintFormula(std::ostream& out_, ExprPrecedence precedence_) const override 
+            void DoPrintFormula(std::ostream& out_, ExprPrecedence /* precedence */) const override 
             {
-                out_ << static_cast<char>(type);
-                operand->PrintFormula(out_, precedence_);
+                Print(out_);
             }
 
             ExprPrecedence GetPrecedence() const override 
             {
-                return EP_UNARY;
+                return EP_ATOM;
             }
 
             double Evaluate(const SheetArgs& args_) const override 
             {
-                if (type == UnaryMinus)
+                if (range.size == Size{ 1, 1 })
+                {
+                    return args_.GetNumber(range.top_left);
+                }
+                throw FormulaError(FormulaError::Category::Value);
+            }
+
+            const Range* GetRange() const override
+            {
+                return &range;
+            }
+
+            Size GetArraySize() const override
+            {
+                return range.size;
+            }
+
+            // Cells are read as numbers the way a formula reads one, each failing on its own.
+            void EvaluateArray(const SheetArgs& args_, ArrayValue& out_) const override
+            {
+                out_.Resize(range.size);
+                size_t index = 0;
+                for (int row = range.top_left.row; row < range.top_left.row + range.size.rows; ++row)
                 {
-                    return -1 * operand->Evaluate(args_);
+                    for (int col = range.top_left.col; col < range.top_left.col + range.size.cols; ++col, ++index)
+                    {
+                        const Position pos{ row, col };
+                        const CellInterface::ValueView value = args_.GetValue(pos);
+                        out_.errors[index] = 0;
+                        if (const double* number = std::get_if<double>(&value))
+                        {
+                            out_.numbers[index] = *number;
+                            continue;
+                        }
+
+                        try
+                        {
+                            out_.numbers[index] = args_.GetNumber(pos);
+                        }
+                        catch (const FormulaError& error_)
+                        {
+                            out_.numbers[index] = 0;
+                            out_.errors[index] = ArrayValue::ToCode(error_);
+                        }
+                    }
                 }
-                else return operand->Evaluate(args_);
+            }
+
+            size_t GetMemoryUsage() const override
+            {
+                return sizeof(*this);
+            }
+
+            size_t Hash() const override
+            {
+                return HashCombine(HashCombine(HashCombine('R', PositionHasher()(range.top_left)), range.size.rows), range.size.cols);
+            }
+
+            bool SameAs(const Expr& other_) const override
+            {
+                const auto* other = dynamic_cast<const RangeExpr*>(&other_);
+                return other && other->range == range;
+            }
+
+            bool IsLeaf() const override
+            {
+                return true;
             }
 
         private:
 
-            Type type;
-            std::unique_ptr<Expr> operand;
+            Range range;
         };
 
-        class CellExpr final : public Expr 
+        // String literals are keys and criteria of lookups; they have no number.
+        class StringExpr final : public Expr 
         {
         public:
 
-            explicit CellExpr(const Position* cell_) : cell(cell_) {}
+            explicit StringExpr(std::string text_) : text(std::move(text_)) {}
 
             void Print(std::ostream& out_) const override 
             {
-                if (!cell->IsValid()) 
-                {
-                    out_ << FormulaError::Category::Ref;
-                }
-                else 
+                out_ << '"';
+                for (const char c : text)
                 {
-                    out_ << cell->ToString();
+                    out_ << c;
+                    if (c == '"')
+                    {
+                        out_ << c;
+                    }
                 }
+                out_ << '"';
             }
 
             void DoPrintFormula(std::ostream& out_, ExprPrecedence /* precedence */) const override 
@@ -239,14 +1154,40 @@ namespace ASTImpl
                 return EP_ATOM;
             }
 
-            double Evaluate(const SheetArgs& args_) const override 
+            double Evaluate(const SheetArgs& /* args */) const override 
+            {
+                throw FormulaError(FormulaError::Category::Value);
+            }
+
+            LookupKey EvaluateKey(const SheetArgs& /* args */) const override
+            {
+                return std::string_view(text);
+            }
+
+            size_t GetMemoryUsage() const override
+            {
+                return sizeof(*this) + text.capacity();
+            }
+
+            size_t Hash() const override
+            {
+                return HashCombine('S', std::hash<std::string>()(text));
+            }
+
+            bool SameAs(const Expr& other_) const override
             {
-                return args_(*cell);
+                const auto* other = dynamic_cast<const StringExpr*>(&other_);
+                return other && other->text == text;
+            }
+
+            bool IsLeaf() const override
+            {
+                return true;
             }
 
         private:
 
-            const Position* cell;
+            std::string text;
         };
 
         class NumberExpr final : public Expr 
@@ -275,6 +1216,36 @@ namespace ASTImpl
                 return value;
             }
 
+            size_t GetMemoryUsage() const override
+            {
+                return sizeof(*this);
+            }
+
+            size_t Hash() const override
+            {
+                uint64_t bits = 0;
+                std::memcpy(&bits, &value, sizeof(bits));
+                return HashCombine('N', std::hash<uint64_t>()(bits));
+            }
+
+            // Bitwise, so 0 and -0, which print differently, stay apart.
+            bool SameAs(const Expr& other_) const override
+            {
+                const auto* other = dynamic_cast<const NumberExpr*>(&other_);
+                return other && std::memcmp(&other->value, &value, sizeof(value)) == 0;
+            }
+
+            bool Compile(ColumnKernel& kernel_, Position /* origin */) const override
+            {
+                kernel_.PushConstant(value);
+                return true;
+            }
+
+            bool IsLeaf() const override
+            {
+                return true;
+            }
+
         private:
 
             double value;
@@ -284,10 +1255,12 @@ namespace ASTImpl
         {
         public:
 
-            std::unique_ptr<Expr> MoveRoot() 
+            explicit ParseASTListener(ExpressionPool* pool_) : pool(pool_) {}
+
+            ExprPtr MoveRoot() 
             {
                 assert(args.size() == 1);
-                std::unique_ptr<Expr> root = std::move(args.front());
+                ExprPtr root = std::move(args.front());
                 args.clear();
 
                 return root;
@@ -298,11 +1271,21 @@ namespace ASTImpl
                 return std::move(cells);
             }
 
+            std::vector<Range> MoveRanges() 
+            {
+                return std::move(ranges);
+            }
+
+            std::vector<uint64_t> MoveSubexpressions() 
+            {
+                return std::move(subexpressions);
+            }
+
             void exitUnaryOp(FormulaParser::UnaryOpContext* ctx_) override 
             {
                 assert(args.size() >= 1);
 
-                std::unique_ptr<Expr> operand = std::move(args.back());
+                ExprPtr operand = std::move(args.back());
 
                 UnaryOpExpr::Type type;
                 if (ctx_->SUB()) 
@@ -315,8 +1298,8 @@ namespace ASTImpl
                     type = UnaryOpExpr::UnaryPlus;
                 }
 
-                auto node = std::make_unique<UnaryOpExpr>(type, std::move(operand));
-                args.back() = std::move(node);
+                auto node = std::make_shared<UnaryOpExpr>(type, std::move(operand));
+                args.back() = Share(std::move(node));
             }
 
             void exitLiteral(FormulaParser::LiteralContext* ctx_) override 
@@ -331,8 +1314,8 @@ namespace ASTImpl
                     throw ParsingError("Invalid number: " + valueStr);
                 }
 
-                auto node = std::make_unique<NumberExpr>(value);
-                args.push_back(std::move(node));
+                auto node = std::make_shared<NumberExpr>(value);
+                args.push_back(Share(std::move(node)));
             }
 
             void exitCell(FormulaParser::CellContext* ctx_) override 
@@ -346,18 +1329,58 @@ namespace ASTImpl
                 }
 
                 cells.push_front(value);
-                auto node = std::make_unique<CellExpr>(&cells.front());
-                args.push_back(std::move(node));
+                auto node = std::make_shared<CellExpr>(value);
+                args.push_back(Share(std::move(node)));
+            }
+
+            void exitRange(FormulaParser::RangeContext* ctx_) override 
+            {
+                const std::string first_str = ctx_->CELL(0)->getSymbol()->getText();
+                const std::string last_str = ctx_->CELL(1)->getSymbol()->getText();
+                const Position first = Position::FromString(first_str);
+                const Position last = Position::FromString(last_str);
+
+                if (!first.IsValid() || !last.IsValid())
+                {
+                    throw FormulaException("Invalid range: " + first_str + ':' + last_str);
+                }
+
+                // Any two opposite corners name the same cells.
+                const Position top_left{ std::min(first.row, last.row), std::min(first.col, last.col) };
+                const Range range{ top_left, Size{ std::abs(last.row - first.row) + 1, std::abs(last.col - first.col) + 1 } };
+
+                ranges.push_back(range);
+                auto node = std::make_shared<RangeExpr>(range);
+                args.push_back(Share(std::move(node)));
+            }
+
+            void exitString(FormulaParser::StringContext* ctx_) override 
+            {
+                const std::string quoted = ctx_->STRING()->getSymbol()->getText();
+
+                // Drop the enclosing quotes and undo the doubling of the ones inside.
+                std::string text;
+                for (size_t i = 1; i + 1 < quoted.size(); ++i)
+                {
+                    text += quoted[i];
+                    if (quoted[i] == '"')
+                    {
+                        ++i;
+                    }
+                }
+
+                auto node = std::make_shared<StringExpr>(std::move(text));
+                args.push_back(Share(std::move(node)));
             }
 
             void exitBinaryOp(FormulaParser::BinaryOpContext* ctx_) override 
             {
                 assert(args.size() >= 2);
 
-                std::unique_ptr<Expr> rhs = std::move(args.back());
+                ExprPtr rhs = std::move(args.back());
                 args.pop_back();
 
-                std::unique_ptr<Expr> lhs = std::move(args.back());
+                ExprPtr lhs = std::move(args.back());
 
                 BinaryOpExpr::Type type;
                 if (ctx_->ADD()) 
@@ -378,8 +1401,82 @@ namespace ASTImpl
                     type = BinaryOpExpr::Divide;
                 }
 
-                auto node = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
-                args.back() = std::move(node);
+                if (IsArray(lhs) && IsArray(rhs) && !(lhs->GetArraySize() == rhs->GetArraySize()))
+                {
+                    throw ParsingError("Arrays of different sizes");
+                }
+
+                auto node = std::make_shared<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
+                args.back() = Share(std::move(node));
+            }
+
+            void exitComparison(FormulaParser::ComparisonContext* ctx_) override 
+            {
+                assert(args.size() >= 2);
+
+                ExprPtr rhs = std::move(args.back());
+                args.pop_back();
+
+                ExprPtr lhs = std::move(args.back());
+
+                ComparisonExpr::Type type;
+                if (ctx_->EQ()) 
+                {
+                    type = ComparisonExpr::Equal;
+                }
+                else if (ctx_->NE()) 
+                {
+                    type = ComparisonExpr::NotEqual;
+                }
+                else if (ctx_->LT()) 
+                {
+                    type = ComparisonExpr::Less;
+                }
+                else if (ctx_->LE()) 
+                {
+                    type = ComparisonExpr::LessOrEqual;
+                }
+                else if (ctx_->GT()) 
+                {
+                    type = ComparisonExpr::Greater;
+                }
+                else 
+                {
+                    assert(ctx_->GE() != nullptr);
+                    type = ComparisonExpr::GreaterOrEqual;
+                }
+
+                if (IsArray(lhs) || IsArray(rhs))
+                {
+                    throw ParsingError("Arrays cannot be compared");
+                }
+
+                auto node = std::make_shared<ComparisonExpr>(type, std::move(lhs), std::move(rhs));
+                args.back() = Share(std::move(node));
+            }
+
+            void exitCall(FormulaParser::CallContext* ctx_) override 
+            {
+                const size_t count = ctx_->expr().size();
+                assert(args.size() >= count);
+
+                const std::string name = ctx_->NAME()->getSymbol()->getText();
+                const FunctionExpr::Type type = FunctionExpr::FromName(name, count);
+
+                std::vector<ExprPtr> call_args(std::make_move_iterator(args.end() - count), std::make_move_iterator(args.end()));
+                args.resize(args.size() - count);
+
+                for (size_t i = 0; i < count; ++i)
+                {
+                    const bool takes_range = FunctionExpr::TakesRange(type, i);
+                    if ((call_args[i]->GetRange() != nullptr) != takes_range || (!takes_range && IsArray(call_args[i])))
+                    {
+                        throw ParsingError("Range in the wrong place in a call to " + name);
+                    }
+                }
+
+                auto node = std::make_shared<FunctionExpr>(type, std::move(call_args));
+                args.push_back(Share(std::move(node)));
             }
 
             void visitErrorNode(antlr4::tree::ErrorNode* node_) override 
@@ -389,8 +1486,26 @@ namespace ASTImpl
 
         private:
 
-            std::vector<std::unique_ptr<Expr>> args;
+            // Nodes are pooled as soon as they are built, so the children of every new node are pooled already.
+            ExprPtr Share(ExprPtr node_)
+            {
+                if (node_->IsLeaf())
+                {
+                    return node_;
+                }
+                if (pool)
+                {
+                    node_ = pool->Intern(std::move(node_));
+                    subexpressions.push_back(node_->GetPoolId());
+                }
+                return node_;
+            }
+
+            ExpressionPool* pool;
+            std::vector<ExprPtr> args;
             std::forward_list<Position> cells;
+            std::vector<Range> ranges;
+            std::vector<uint64_t> subexpressions;
         };
 
         class BailErrorListener : public antlr4::BaseErrorListener 
@@ -405,7 +1520,7 @@ namespace ASTImpl
     }  // namespace
 }  // namespace ASTImpl
 
-FormulaAST ParseFormulaAST(std::istream& in_) 
+FormulaAST ParseFormulaAST(std::istream& in_, ExpressionPool* pool_) 
 {
     using namespace antlr4;
 
@@ -424,23 +1539,29 @@ FormulaAST ParseFormulaAST(std::istream& in_)
     parser.removeErrorListeners();
 
     tree::ParseTree* tree = parser.main();
-    ASTImpl::ParseASTListener listener;
+    ASTImpl::ParseASTListener listener(pool_);
     tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+    std::shared_ptr<const ASTImpl::Expr> root = listener.MoveRoot();
+    if (pool_)
+    {
+        pool_->Hold(root);
+    }
+    return FormulaAST(std::move(root), listener.MoveCells(), listener.MoveRanges(), listener.MoveSubexpressions());
 }
 
-FormulaAST ParseFormulaAST(const std::string& in_str_)
+FormulaAST ParseFormulaAST(const std::string& in_str_, ExpressionPool* pool_)
 {
     std::istringstream in(in_str_);
-    return ParseFormulaAST(in);
+    return ParseFormulaAST(in, pool_);
 }
 
 void FormulaAST::PrintCells(std::ostream& out_) const 
 {
+    char name[Position::MAX_STRING_LENGTH];
     for (Position cell : cells) 
     {
-        out_ << cell.ToString() << ' ';
+        out_.write(name, static_cast<std::streamsize>(cell.ToChars(name))) << ' ';
     }
 }
 
@@ -456,12 +1577,120 @@ void FormulaAST::PrintFormula(std::ostream& out_) const
 
 double FormulaAST::Execute(const SheetArgs& args_) const 
 {
-    return root_expr->Evaluate(args_);
+    return ASTImpl::EvaluateNode(root_expr, args_);
+}
+
+void FormulaAST::ExecuteArray(const SheetArgs& args_, ArrayValue& out_) const
+{
+    if (ASTImpl::IsArray(root_expr))
+    {
+        root_expr->EvaluateArray(args_, out_);
+        return;
+    }
+
+    const ASTImpl::SingleOperand value = ASTImpl::EvaluateSingle(root_expr, args_);
+    out_.Resize(Size{ 1, 1 });
+    out_.numbers[0] = value.number;
+    out_.errors[0] = value.error;
+}
+
+bool FormulaAST::Compile(Position origin_, ColumnKernel& kernel_) const
+{
+    kernel_.Clear();
+    return root_expr->Compile(kernel_, origin_);
+}
+
+size_t FormulaAST::GetMemoryUsage() const
+{
+    // A forward_list node is the element plus one link.
+    const size_t cell_node = sizeof(Position) + sizeof(void*);
+    return root_expr->GetMemoryUsage() + cell_node * static_cast<size_t>(std::distance(cells.begin(), cells.end()))
+        + ranges.capacity() * sizeof(Range) + subexpressions.capacity() * sizeof(uint64_t);
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr_, std::forward_list<Position> cells_) : root_expr(std::move(root_expr_)), cells(std::move(cells_))
+FormulaAST::FormulaAST(std::shared_ptr<const ASTImpl::Expr> root_expr_, std::forward_list<Position> cells_, std::vector<Range> ranges_, std::vector<uint64_t> subexpressions_) : root_expr(std::move(root_expr_)), cells(std::move(cells_)), ranges(std::move(ranges_)), subexpressions(std::move(subexpressions_)), array_size(root_expr->GetArraySize())
 {
     cells.sort();
 }
 
-FormulaAST::~FormulaAST() = default;
\ No newline at end of file
+FormulaAST::~FormulaAST() = default;
+
+std::shared_ptr<const ASTImpl::Expr> ExpressionPool::Intern(std::shared_ptr<const ASTImpl::Expr> node_)
+{
+    // Ids are unique across pools, as a fork evaluates nodes of its base's pool next to its own.
+    static std::atomic<uint64_t> next_id = 1;
+
+    const size_t hash = node_->Hash();
+    const auto [begin, end] = nodes.equal_range(hash);
+    for (auto it = begin; it != end; ++it)
+    {
+        std::shared_ptr<const ASTImpl::Expr> pooled = it->second.node.lock();
+        if (pooled && pooled->SameAs(*node_))
+        {
+            return pooled;
+        }
+    }
+
+    // A new node is a new parent for each of its children.
+    node_->SetPoolId(next_id.fetch_add(1, std::memory_order_relaxed));
+    node_->ForEachChild([this](const ASTImpl::Expr& child_)
+        {
+            AddHolder(child_);
+        });
+    nodes.emplace(hash, Entry{ node_, 0 });
+    if (nodes.size() > 2 * purge_size + MIN_PURGE_SIZE)
+    {
+        Purge();
+    }
+    return node_;
+}
+
+void ExpressionPool::Hold(const std::shared_ptr<const ASTImpl::Expr>& root_)
+{
+    AddHolder(*root_);
+}
+
+void ExpressionPool::AddHolder(const ASTImpl::Expr& node_)
+{
+    if (node_.GetPoolId() == 0)
+    {
+        return;
+    }
+    const auto [begin, end] = nodes.equal_range(node_.Hash());
+    for (auto it = begin; it != end; ++it)
+    {
+        if (it->second.node.lock().get() == &node_)
+        {
+            if (++it->second.holders == 2)
+            {
+                node_.MarkShared();
+            }
+            return;
+        }
+    }
+}
+
+size_t ExpressionPool::GetSize() const
+{
+    size_t result = 0;
+    for (const auto& [hash, entry] : nodes)
+    {
+        result += entry.node.expired() ? 0 : 1;
+    }
+    return result;
+}
+
+size_t ExpressionPool::GetIndexBytes() const
+{
+    const size_t node = sizeof(decltype(nodes)::value_type) + 2 * sizeof(void*);
+    return nodes.bucket_count() * sizeof(void*) + nodes.size() * node;
+}
+
+void ExpressionPool::Purge()
+{
+    for (auto it = nodes.begin(); it != nodes.end();)
+    {
+        it = it->second.node.expired() ? nodes.erase(it) : std::next(it);
+    }
+    purge_size = nodes.size();
+}
\ No newline at end of file
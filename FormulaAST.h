@@ -2,10 +2,13 @@
 
 #include "FormulaLexer.h"
 #include "common.h"
+#include "exprpool.h"
+#include "kernel.h"
 
 #include <forward_list>
 #include <functional>
 #include <stdexcept>
+#include <vector>
 
 namespace ASTImpl 
 {
@@ -17,13 +20,28 @@ class ParsingError : public std::runtime_error
     using std::runtime_error::runtime_error;
 };
 
-using SheetArgs = std::function<double(Position)>;
+// What a formula reads from its sheet while it is evaluated.
+class SheetArgs
+{
+public:
+
+    virtual ~SheetArgs() = default;
+
+    // Value of a referenced cell as a number; throws FormulaError when it is not one.
+    virtual double GetNumber(Position pos_) const = 0;
+    // Value of a referenced cell as it is, for lookup keys.
+    virtual CellInterface::ValueView GetValue(Position pos_) const = 0;
+    // The sheet itself, for lookups over ranges.
+    virtual const SheetInterface& GetSheet() const = 0;
+    // Value of a subexpression several formulas share, see SheetInterface::EvaluateShared.
+    virtual double EvaluateShared(uint64_t key_, const std::function<double()>& evaluate_) const = 0;
+};
 
 class FormulaAST 
 {
 public:
 
-    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr_, std::forward_list<Position> cells_);
+    explicit FormulaAST(std::shared_ptr<const ASTImpl::Expr> root_expr_, std::forward_list<Position> cells_, std::vector<Range> ranges_ = {}, std::vector<uint64_t> subexpressions_ = {});
     FormulaAST(FormulaAST&&) = default;
 
     FormulaAST& operator=(FormulaAST&&) = default;
@@ -31,11 +49,17 @@ public:
     ~FormulaAST();
 
     double Execute(const SheetArgs& args_) const;
+    // Evaluates every element of an array formula; a formula of one value fills a 1x1 array.
+    void ExecuteArray(const SheetArgs& args_, ArrayValue& out_) const;
+    // Compiles the formula of cell origin_ into kernel_, see FormulaInterface::CompileKernel.
+    bool Compile(Position origin_, ColumnKernel& kernel_) const;
 
     void PrintCells(std::ostream& out_) const;
     void Print(std::ostream& out_) const;
     void PrintFormula(std::ostream& out_) const;
 
+    size_t GetMemoryUsage() const;
+
     std::forward_list<Position>& GetCells() 
     {
         return cells;
@@ -46,11 +70,32 @@ public:
         return cells;
     }
 
+    // Ranges the formula reads, in lookups or as arrays, in the order they appear.
+    const std::vector<Range>& GetRanges() const
+    {
+        return ranges;
+    }
+
+    // Inner nodes of the formula, the keys its subexpressions are shared under.
+    const std::vector<uint64_t>& GetSubexpressions() const
+    {
+        return subexpressions;
+    }
+
+    Size GetArraySize() const
+    {
+        return array_size;
+    }
+
 private:
 
-    std::unique_ptr<ASTImpl::Expr> root_expr;
+    std::shared_ptr<const ASTImpl::Expr> root_expr;
     std::forward_list<Position> cells;
+    std::vector<Range> ranges;
+    std::vector<uint64_t> subexpressions;
+    Size array_size;
 };
 
-FormulaAST ParseFormulaAST(std::istream& in_);
-FormulaAST ParseFormulaAST(const std::string& in_str_);
\ No newline at end of file
+// Nodes are interned in pool_ when one is given.
+FormulaAST ParseFormulaAST(std::istream& in_, ExpressionPool* pool_ = nullptr);
+FormulaAST ParseFormulaAST(const std::string& in_str_, ExpressionPool* pool_ = nullptr);
\ No newline at end of file
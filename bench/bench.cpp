@@ -0,0 +1,683 @@
+#include "common.h"
+#include "formula.h"
+#include "sheet.h"
+#include "solver.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+// Synthetic workloads for the spreadsheet core. Every scenario prints one JSON
+// object per line, so runs on different commits can be diffed or loaded directly:
+//
+//     spreadsheet_bench [--scenario NAME] [--size N] [--repeat N]
+
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+
+    struct Options
+    {
+        std::string scenario;
+        int size = 0;
+        int repeat = 3;
+    };
+
+    // Collects the latency of every measured operation of one scenario run.
+    class Recorder
+    {
+    public:
+
+        template <typename Action>
+        void Measure(Action&& action_)
+        {
+            const auto start = Clock::now();
+            action_();
+            latencies.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+        }
+
+        void Report(const std::string& scenario_, int size_, int repeat_) const;
+
+    private:
+
+        double Percentile(const std::vector<double>& sorted_, double fraction_) const;
+
+        std::vector<double> latencies;
+    };
+
+    long PeakRssKb()
+    {
+#ifdef _WIN32
+        PROCESS_MEMORY_COUNTERS counters;
+        GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+        return static_cast<long>(counters.PeakWorkingSetSize / 1024);
+#else
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_maxrss;
+#endif
+    }
+
+    double Recorder::Percentile(const std::vector<double>& sorted_, double fraction_) const
+    {
+        if (sorted_.empty())
+        {
+            return 0;
+        }
+        const size_t index = static_cast<size_t>(fraction_ * static_cast<double>(sorted_.size() - 1));
+        return sorted_[index];
+    }
+
+    void Recorder::Report(const std::string& scenario_, int size_, int repeat_) const
+    {
+        std::vector<double> sorted = latencies;
+        std::sort(sorted.begin(), sorted.end());
+
+        double total = 0;
+        for (double latency : sorted)
+        {
+            total += latency;
+        }
+        const double seconds = total / 1e6;
+
+        std::cout << "{\"scenario\":\"" << scenario_ << "\""
+                  << ",\"size\":" << size_
+                  << ",\"repeat\":" << repeat_
+                  << ",\"ops\":" << sorted.size()
+                  << ",\"seconds\":" << seconds
+                  << ",\"ops_per_sec\":" << (seconds > 0 ? static_cast<double>(sorted.size()) / seconds : 0)
+                  << ",\"p50_us\":" << Percentile(sorted, 0.50)
+                  << ",\"p90_us\":" << Percentile(sorted, 0.90)
+                  << ",\"p99_us\":" << Percentile(sorted, 0.99)
+                  << ",\"max_us\":" << (sorted.empty() ? 0 : sorted.back())
+                  << ",\"peak_rss_kb\":" << PeakRssKb()
+                  << "}" << std::endl;
+    }
+
+    std::string Ref(int row_, int col_)
+    {
+        return Position{ row_, col_ }.ToString();
+    }
+
+    // Formulas evaluate recursively, so long chains are read from the top down.
+    void ReadColumn(Sheet& sheet_, int col_, int rows_)
+    {
+        for (int row = 0; row < rows_; ++row)
+        {
+            sheet_.GetCell(Position{ row, col_ })->GetValue();
+        }
+    }
+
+    // A1 = 1, An = A(n-1) + 1: building the chain, then editing its head and reading it back.
+    void RunChain(int size_, Recorder& recorder_)
+    {
+        Sheet sheet;
+        recorder_.Measure([&] { sheet.SetCell(Position{ 0, 0 }, "1"); });
+        for (int row = 1; row < size_; ++row)
+        {
+            recorder_.Measure([&] { sheet.SetCell(Position{ row, 0 }, "=" + Ref(row - 1, 0) + "+1"); });
+        }
+
+        for (int step = 0; step < 10; ++step)
+        {
+            recorder_.Measure([&]
+                {
+                    sheet.SetCell(Position{ 0, 0 }, std::to_string(step));
+                    ReadColumn(sheet, 0, size_);
+                });
+        }
+    }
+
+    // One cell that adds up `size_` sources, each of which is edited in turn.
+    void RunFanIn(int size_, Recorder& recorder_)
+    {
+        Sheet sheet;
+        std::string expression = "=A1";
+        sheet.SetCell(Position{ 0, 0 }, "1");
+        for (int row = 1; row < size_; ++row)
+        {
+            sheet.SetCell(Position{ row, 0 }, "1");
+            expression += "+" + Ref(row, 0);
+        }
+
+        recorder_.Measure([&] { sheet.SetCell(Position{ 0, 1 }, expression); });
+        for (int row = 0; row < size_; ++row)
+        {
+            recorder_.Measure([&]
+                {
+                    sheet.SetCell(Position{ row, 0 }, "2");
+                    sheet.GetCell(Position{ 0, 1 })->GetValue();
+                });
+        }
+    }
+
+    // `size_` cells that all read A1; every edit of A1 invalidates and recomputes all of them.
+    void RunFanOut(int size_, Recorder& recorder_)
+    {
+        Sheet sheet;
+        sheet.SetCell(Position{ 0, 0 }, "1");
+        for (int row = 0; row < size_; ++row)
+        {
+            recorder_.Measure([&] { sheet.SetCell(Position{ row, 1 }, "=A1*2"); });
+        }
+
+        for (int step = 0; step < 20; ++step)
+        {
+            recorder_.Measure([&]
+                {
+                    sheet.SetCell(Position{ 0, 0 }, std::to_string(step));
+                    ReadColumn(sheet, 1, size_);
+                });
+        }
+    }
+
+    // A grid filled down and right the way users extend a table: each cell adds its left and upper neighbours.
+    void RunFillDown(int size_, Recorder& recorder_)
+    {
+        const int cols = 16;
+        const int rows = std::max(1, size_ / cols);
+
+        Sheet sheet;
+        for (int row = 0; row < rows; ++row)
+        {
+            recorder_.Measure([&] { sheet.SetCell(Position{ row, 0 }, std::to_string(row)); });
+            for (int col = 1; col < cols; ++col)
+            {
+                const std::string up = row > 0 ? Ref(row - 1, col) : "0";
+                recorder_.Measure([&] { sheet.SetCell(Position{ row, col }, "=" + Ref(row, col - 1) + "+" + up); });
+            }
+        }
+
+        recorder_.Measure([&]
+            {
+                for (int col = 0; col < cols; ++col)
+                {
+                    ReadColumn(sheet, col, rows);
+                }
+            });
+    }
+
+    // Plain numbers entered as text and read back, which exercises storage alone.
+    void RunDenseNumeric(int size_, Recorder& recorder_)
+    {
+        const int cols = 32;
+        const int rows = std::max(1, size_ / cols);
+        std::mt19937 random(42);
+        std::uniform_real_distribution<double> values(-1e6, 1e6);
+
+        Sheet sheet;
+        for (int row = 0; row < rows; ++row)
+        {
+            for (int col = 0; col < cols; ++col)
+            {
+                const std::string text = std::to_string(values(random));
+                recorder_.Measure([&] { sheet.SetCell(Position{ row, col }, text); });
+            }
+        }
+
+        for (int row = 0; row < rows; ++row)
+        {
+            recorder_.Measure([&]
+                {
+                    for (int col = 0; col < cols; ++col)
+                    {
+                        sheet.GetCell(Position{ row, col })->GetValue();
+                    }
+                });
+        }
+    }
+
+    // A division by zero at the head of a chain that every cell below inherits.
+    void RunErrorCascade(int size_, Recorder& recorder_)
+    {
+        Sheet sheet;
+        sheet.SetCell(Position{ 0, 0 }, "=1/0");
+        for (int row = 1; row < size_; ++row)
+        {
+            sheet.SetCell(Position{ row, 0 }, "=" + Ref(row - 1, 0) + "+1");
+        }
+
+        for (int step = 0; step < 10; ++step)
+        {
+            recorder_.Measure([&]
+                {
+                    sheet.SetCell(Position{ 0, 0 }, step % 2 ? "=1/0" : "=1/1");
+                    ReadColumn(sheet, 0, size_);
+                });
+        }
+    }
+
+    // 100x50 viewport refreshes over a mixed sheet, read as one range into reused buffers.
+    void RunViewport(int size_, Recorder& recorder_)
+    {
+        const Range viewport{ Position{ 0, 0 }, Size{ 100, 50 } };
+
+        Sheet sheet;
+        for (int row = 0; row < viewport.size.rows; ++row)
+        {
+            for (int col = 0; col < viewport.size.cols; ++col)
+            {
+                const Position pos{ row, col };
+                switch (col % 3)
+                {
+                case 0:
+                    sheet.SetCell(pos, std::to_string(row * col));
+                    break;
+
+                case 1:
+                    sheet.SetCell(pos, "label " + std::to_string(row));
+                    break;
+
+                default:
+                    sheet.SetCell(pos, "=" + Ref(row, col - 2) + "*2");
+                    break;
+                }
+            }
+        }
+
+        using Kind = Sheet::RangeValues::Kind;
+        std::vector<Kind> kinds(viewport.GetCellCount());
+        std::vector<double> numbers(viewport.GetCellCount());
+        std::vector<FormulaError::Category> errors(viewport.GetCellCount());
+        std::vector<std::string_view> texts(viewport.GetCellCount());
+        const Sheet::RangeValues out{ kinds.data(), numbers.data(), errors.data(), texts.data() };
+
+        for (int step = 0; step < size_; ++step)
+        {
+            sheet.SetCell(Position{ step % viewport.size.rows, 0 }, std::to_string(step));
+            recorder_.Measure([&] { sheet.GetValues(viewport, out); });
+        }
+    }
+
+    // A 1000x16 grid of prices streamed in as whole blocks, with a formula column reading them.
+    void RunStreamGrid(int size_, Recorder& recorder_)
+    {
+        const int rows = 1000;
+        const int cols = 16;
+        std::mt19937 random(11);
+        std::uniform_real_distribution<double> prices(1, 1000);
+
+        Sheet sheet;
+        for (int row = 0; row < rows; ++row)
+        {
+            sheet.SetCell(Position{ row, cols }, "=" + Ref(row, 0) + "*" + Ref(row, cols - 1));
+        }
+
+        std::vector<double> block(static_cast<size_t>(rows) * cols);
+        for (int step = 0; step < size_; ++step)
+        {
+            for (double& price : block)
+            {
+                price = prices(random);
+            }
+            recorder_.Measure([&] { sheet.SetNumberRange(Position{ 0, 0 }, rows, cols, block); });
+        }
+    }
+
+    // Numbers and formulas scattered over the whole grid, far apart from each other.
+    void RunSparseGrid(int size_, Recorder& recorder_)
+    {
+        std::mt19937 random(13);
+        std::uniform_int_distribution<int> rows(0, Position::MAX_ROWS - 1);
+        std::uniform_int_distribution<int> cols(0, Position::MAX_COLS - 1);
+
+        Sheet sheet;
+        Position previous{ 0, 0 };
+        for (int step = 0; step < size_; ++step)
+        {
+            const Position pos{ rows(random), cols(random) };
+            const std::string text = step % 2 ? "=" + previous.ToString() + "+1" : std::to_string(step);
+            recorder_.Measure([&]
+                {
+                    sheet.SetCell(pos, text);
+                    sheet.GetPrintableSize();
+                });
+            previous = pos;
+        }
+    }
+
+    // Random SetCell and ClearCell over a small window, mixing values and formulas.
+    void RunChurn(int size_, Recorder& recorder_)
+    {
+        const int window = 64;
+        std::mt19937 random(7);
+        std::uniform_int_distribution<int> cell(0, window - 1);
+        std::uniform_int_distribution<int> action(0, 3);
+
+        Sheet sheet;
+        for (int step = 0; step < size_; ++step)
+        {
+            const Position pos{ cell(random), cell(random) % 8 };
+            switch (action(random))
+            {
+            case 0:
+                recorder_.Measure([&] { sheet.ClearCell(pos); });
+                break;
+
+            case 1:
+                recorder_.Measure([&] { sheet.SetCell(pos, std::to_string(step)); });
+                break;
+
+            default:
+            {
+                // Only reference cells in earlier rows so the churn never builds a cycle.
+                const std::string text = pos.row > 0 ? "=" + Ref(cell(random) % pos.row, cell(random) % 8) + "+1" : "1";
+                recorder_.Measure([&] { sheet.SetCell(pos, text); });
+                break;
+            }
+            }
+        }
+    }
+
+    // Parsing alone, over a mix of expression shapes.
+    void RunParse(int size_, Recorder& recorder_)
+    {
+        const std::vector<std::string> expressions = {
+            "1+2*3",
+            "(A1+B2)*(C3-D4)/E5",
+            "-A1+-(B1*2)",
+            "AA100/ZZ200+1.5e3",
+            "((((A1))))+((((B1))))",
+        };
+
+        for (int step = 0; step < size_; ++step)
+        {
+            const std::string& expression = expressions[step % expressions.size()];
+            recorder_.Measure([&] { ParseFormula(expression); });
+        }
+    }
+
+    // Names of random positions encoded and decoded back, a block of 1024 per measured step.
+    void RunPositionCodec(int size_, Recorder& recorder_)
+    {
+        const size_t block = 1024;
+        std::mt19937 random(17);
+        std::uniform_int_distribution<int> rows(0, Position::MAX_ROWS - 1);
+        std::uniform_int_distribution<int> cols(0, Position::MAX_COLS - 1);
+
+        std::vector<Position> positions(block);
+        std::vector<Position> decoded(block);
+        std::vector<std::string_view> names(block);
+        std::vector<char> buffer(block * Position::MAX_STRING_LENGTH);
+
+        for (int step = 0; step < size_; ++step)
+        {
+            for (Position& pos : positions)
+            {
+                pos = Position{ rows(random), cols(random) };
+            }
+            recorder_.Measure([&]
+                {
+                    Position::ToStrings(positions.data(), block, buffer.data(), names.data());
+                    Position::FromStrings(names.data(), block, decoded.data());
+                });
+        }
+    }
+
+    // Rejected edits that would close a cycle at the end of a long chain.
+    void RunCycleCheck(int size_, Recorder& recorder_)
+    {
+        Sheet sheet;
+        sheet.SetCell(Position{ 0, 0 }, "1");
+        for (int row = 1; row < size_; ++row)
+        {
+            sheet.SetCell(Position{ row, 0 }, "=" + Ref(row - 1, 0) + "+1");
+        }
+
+        const std::string closing = "=" + Ref(size_ - 1, 0);
+        for (int step = 0; step < 100; ++step)
+        {
+            recorder_.Measure([&]
+                {
+                    try
+                    {
+                        sheet.SetCell(Position{ 0, 0 }, closing);
+                    }
+                    catch (const CircularDependencyException&)
+                    {
+                    }
+                });
+        }
+    }
+
+    // Edits to the key column of a table, each followed by reading lookups over the whole column.
+    void RunLookups(int size_, Recorder& recorder_)
+    {
+        Sheet sheet;
+        std::vector<double> keys(static_cast<size_t>(size_) * 2);
+        for (int row = 0; row < size_; ++row)
+        {
+            keys[static_cast<size_t>(row) * 2] = row;
+            keys[static_cast<size_t>(row) * 2 + 1] = row * 10;
+        }
+        sheet.SetNumberRange(Position{ 0, 0 }, size_, 2, keys);
+
+        const std::string table = Ref(0, 0) + ":" + Ref(size_ - 1, 1);
+        const std::string column = Ref(0, 0) + ":" + Ref(size_ - 1, 0);
+        sheet.SetCell(Position{ 0, 3 }, "=VLOOKUP(" + std::to_string(size_ / 2) + "," + table + ",2,0)");
+        sheet.SetCell(Position{ 1, 3 }, "=COUNTIF(" + column + ",\">=" + std::to_string(size_ / 2) + "\")");
+        sheet.SetCell(Position{ 2, 3 }, "=MATCH(" + std::to_string(size_ / 3) + "," + column + ")");
+
+        std::mt19937 random(46);
+        std::uniform_int_distribution<int> rows(0, size_ - 1);
+        for (int step = 0; step < 1000; ++step)
+        {
+            const Position pos{ rows(random), 0 };
+            const std::string text = std::to_string(rows(random));
+            recorder_.Measure([&]
+                {
+                    sheet.SetCell(pos, text);
+                    for (int row = 0; row < 3; ++row)
+                    {
+                        sheet.GetCell(Position{ row, 3 })->GetValue();
+                    }
+                });
+        }
+    }
+
+    // One relative formula filled down a whole column; each step rewrites an input column and reads the results.
+    void RunColumnFormulas(int size_, Recorder& recorder_)
+    {
+        std::mt19937 random(48);
+        std::uniform_real_distribution<double> values(-1e3, 1e3);
+        std::vector<double> inputs(static_cast<size_t>(size_) * 3);
+        for (double& value : inputs)
+        {
+            value = values(random);
+        }
+
+        Sheet sheet;
+        sheet.SetNumberRange(Position{ 0, 0 }, size_, 3, inputs);
+        std::vector<std::string> formulas;
+        for (int row = 0; row < size_; ++row)
+        {
+            formulas.push_back("=" + Ref(row, 0) + "*" + Ref(row, 1) + "+" + Ref(row, 2));
+        }
+        recorder_.Measure([&] { sheet.SetRange(Position{ 0, 3 }, size_, 1, formulas); });
+
+        std::vector<double> column(static_cast<size_t>(size_));
+        for (int step = 0; step < 20; ++step)
+        {
+            for (double& value : column)
+            {
+                value = values(random);
+            }
+            recorder_.Measure([&]
+                {
+                    sheet.SetNumberRange(Position{ 0, 0 }, size_, 1, column);
+                    ReadColumn(sheet, 3, size_);
+                });
+        }
+    }
+
+    // D1 = A1:An*B1:Bn+C1:Cn spilling down the column: editing a column of inputs, then reading the spill.
+    void RunArrayFormula(int size_, Recorder& recorder_)
+    {
+        std::mt19937 random(49);
+        std::uniform_real_distribution<double> values(-1e3, 1e3);
+        std::vector<double> inputs(static_cast<size_t>(size_) * 3);
+        for (double& value : inputs)
+        {
+            value = values(random);
+        }
+
+        Sheet sheet;
+        sheet.SetNumberRange(Position{ 0, 0 }, size_, 3, inputs);
+        const auto column = [size_](int col_)
+            {
+                return Ref(0, col_) + ":" + Ref(size_ - 1, col_);
+            };
+        recorder_.Measure([&]
+            {
+                sheet.SetCell(Position{ 0, 3 }, "=" + column(0) + "*" + column(1) + "+" + column(2));
+                ReadColumn(sheet, 3, size_);
+            });
+
+        std::vector<double> edited(static_cast<size_t>(size_));
+        for (int step = 0; step < 20; ++step)
+        {
+            for (double& value : edited)
+            {
+                value = values(random);
+            }
+            recorder_.Measure([&]
+                {
+                    sheet.SetNumberRange(Position{ 0, 0 }, size_, 1, edited);
+                    ReadColumn(sheet, 3, size_);
+                });
+        }
+    }
+
+    // `size_` formulas filled down B beside a 100 formula model of C1 in D; each step
+    // evaluates the model for another C1 without editing the sheet.
+    void RunGoalSeek(int size_, Recorder& recorder_)
+    {
+        const int model = 100;
+        Sheet sheet;
+        std::vector<std::string> formulas;
+        for (int row = 0; row < size_; ++row)
+        {
+            formulas.push_back("=" + Ref(row, 0) + "*2+1");
+        }
+        sheet.SetRange(Position{ 0, 1 }, size_, 1, formulas);
+        sheet.SetCell(Position{ 0, 2 }, "1");
+        sheet.SetCell(Position{ 0, 3 }, "=C1*1.01+" + Ref(0, 1));
+        for (int row = 1; row < model; ++row)
+        {
+            sheet.SetCell(Position{ row, 3 }, "=" + Ref(row - 1, 3) + "*1.01+" + Ref(row, 1) + "-C1");
+        }
+        ReadColumn(sheet, 1, size_);
+
+        std::unique_ptr<Solver> solver;
+        recorder_.Measure([&] { solver = std::make_unique<Solver>(sheet, Position{ 0, 2 }, Position{ model - 1, 3 }); });
+        for (int step = 0; step < 1000; ++step)
+        {
+            recorder_.Measure([&] { solver->Evaluate(step * 0.5); });
+        }
+        recorder_.Measure([&] { solver->GoalSeek(1000, 1); });
+    }
+
+    struct Scenario
+    {
+        const char* name;
+        int default_size;
+        std::function<void(int, Recorder&)> run;
+    };
+
+    const std::vector<Scenario>& GetScenarios()
+    {
+        static const std::vector<Scenario> scenarios = {
+            { "chain", 10000, RunChain },
+            { "fan_in", 2000, RunFanIn },
+            { "fan_out", 10000, RunFanOut },
+            { "fill_down", 32000, RunFillDown },
+            { "dense_numeric", 64000, RunDenseNumeric },
+            { "error_cascade", 10000, RunErrorCascade },
+            { "churn", 100000, RunChurn },
+            { "viewport", 2000, RunViewport },
+            { "stream_grid", 200, RunStreamGrid },
+            { "sparse_grid", 100000, RunSparseGrid },
+            { "parse", 20000, RunParse },
+            { "position_codec", 1000, RunPositionCodec },
+            { "cycle_check", 10000, RunCycleCheck },
+            { "lookups", 100000, RunLookups },
+            { "column_formulas", 100000, RunColumnFormulas },
+            { "array_formula", 100000, RunArrayFormula },
+            { "goal_seek", 100000, RunGoalSeek },
+        };
+        return scenarios;
+    }
+
+    bool ParseOptions(int argc_, char** argv_, Options& options_)
+    {
+        for (int i = 1; i < argc_; ++i)
+        {
+            const bool has_value = i + 1 < argc_;
+            if (std::strcmp(argv_[i], "--scenario") == 0 && has_value)
+            {
+                options_.scenario = argv_[++i];
+            }
+            else if (std::strcmp(argv_[i], "--size") == 0 && has_value)
+            {
+                options_.size = std::stoi(argv_[++i]);
+            }
+            else if (std::strcmp(argv_[i], "--repeat") == 0 && has_value)
+            {
+                options_.repeat = std::stoi(argv_[++i]);
+            }
+            else
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+}  // namespace
+
+int main(int argc_, char** argv_)
+{
+    Options options;
+    if (!ParseOptions(argc_, argv_, options))
+    {
+        std::cerr << "usage: spreadsheet_bench [--scenario NAME] [--size N] [--repeat N]" << std::endl;
+        return 1;
+    }
+
+    bool found = false;
+    for (const Scenario& scenario : GetScenarios())
+    {
+        if (!options.scenario.empty() && options.scenario != scenario.name)
+        {
+            continue;
+        }
+        found = true;
+
+        const int size = options.size > 0 ? options.size : scenario.default_size;
+        Recorder recorder;
+        for (int run = 0; run < options.repeat; ++run)
+        {
+            scenario.run(size, recorder);
+        }
+        recorder.Report(scenario.name, size, options.repeat);
+    }
+
+    if (!found)
+    {
+        std::cerr << "unknown scenario: " << options.scenario << std::endl;
+        return 1;
+    }
+    return 0;
+}
\ No newline at end of file
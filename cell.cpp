@@ -1,258 +1,494 @@
 #include "cell.h"
-#include "sheet.h"
 
-#include <cassert>
-#include <iostream>
-#include <string>
+#include "tracing.h"
+
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <new>
 #include <optional>
-#include <stack>
 
-class Cell::Impl 
+namespace
 {
+    const size_t MAX_NUMBER_LENGTH = 32;
 
-public:
-    virtual ~Impl() = default;
-
-    virtual Value GetValue() const = 0;
-    virtual std::string GetText() const = 0;
-    virtual std::vector<Position> GetReferencedCells() const
+    std::string_view FormatNumber(double number_, char (&buffer_)[MAX_NUMBER_LENGTH])
     {
-        return {}; 
+        const auto result = std::to_chars(buffer_, buffer_ + MAX_NUMBER_LENGTH, number_);
+        return { buffer_, static_cast<size_t>(result.ptr - buffer_) };
     }
+}  // namespace
 
-    virtual bool IsCacheValid() const 
-    { 
-        return true;
+struct Cell::FormulaData
+{
+    std::shared_ptr<const FormulaInterface> formula;
+    const SheetInterface* sheet;
+    std::optional<FormulaInterface::Value> cache;
+    std::pmr::memory_resource* resource;
+    RecalcProfiler* profiler;
+    Position pos;
+    // Cleared once the formula fails to compile into a column kernel.
+    bool compilable = true;
+    Cell::Match above = Cell::Match::Unknown;
+    Cell::Match below = Cell::Match::Unknown;
+    // Every element of an array formula that spilled, set along with the cache.
+    std::shared_ptr<const ArrayValue> array{};
+
+    static FormulaData* Create(std::shared_ptr<const FormulaInterface> formula_, const SheetInterface& sheet_, std::optional<FormulaInterface::Value> cache_, std::pmr::memory_resource* resource_)
+    {
+        void* memory = resource_->allocate(sizeof(FormulaData), alignof(FormulaData));
+        return new (memory) FormulaData{ std::move(formula_), &sheet_, std::move(cache_), resource_, nullptr, Position::NONE };
     }
 
-    virtual void InvalidateCache() {}
+    static void Destroy(FormulaData* data_)
+    {
+        std::pmr::memory_resource* resource = data_->resource;
+        data_->~FormulaData();
+        resource->deallocate(data_, sizeof(FormulaData), alignof(FormulaData));
+    }
 };
 
-class Cell::EmptyImpl : public Impl 
+Cell::Cell(std::string text_, const SheetInterface& sheet_, std::pmr::memory_resource* resource_, StringPool* strings_, ExpressionPool* expressions_)
 {
-public:
+    if (text_.empty())
+    {
+        return;
+    }
 
-    Value GetValue() const override 
-    { 
-        return "";
+    if (text_.size() > 1 && text_[0] == FORMULA_SIGN)
+    {
+        payload.formula = FormulaData::Create(ParseFormula(text_.substr(1), expressions_), sheet_, std::nullopt, resource_);
+        kind = Kind::Formula;
+        return;
     }
 
-    std::string GetText() const override 
-    { 
-        return "";
+    double number = 0;
+    if (ParseCanonicalNumber(text_, number))
+    {
+        SetNumber(number, resource_);
+        return;
     }
-};
 
-class Cell::TextImpl : public Impl 
-{
-public:
+    SetText(text_, resource_, strings_);
+}
 
-    TextImpl(std::string text_) : text(std::move(text_)) 
+Cell::Cell(double number_, std::pmr::memory_resource* resource_)
+{
+    if (std::isfinite(number_))
     {
-        if (text.empty()) 
-        {
-            throw std::logic_error(""); 
-        }
+        SetNumber(number_, resource_);
+        return;
     }
 
-    Value GetValue() const override 
+    char buffer[MAX_NUMBER_LENGTH];
+    SetText(FormatNumber(number_, buffer), resource_, nullptr);
+}
+
+Cell::Cell(const Cell& other_, const SheetInterface& sheet_, std::pmr::memory_resource* resource_, StringPool* strings_)
+{
+    switch (other_.kind)
     {
-        if (text[0] == ESCAPE_SIGN)
+    case Kind::Empty:
+        break;
+
+    case Kind::Number:
+        SetNumber(other_.payload.number.value, resource_);
+        break;
+
+    case Kind::Text:
+        if (other_.heap && strings_ && other_.payload.text->GetPool() == strings_)
+        {
+            payload.text = StringPool::Acquire(other_.payload.text);
+            heap = true;
+            kind = Kind::Text;
+        }
+        else
         {
-            return text.substr(1);
+            SetText(other_.GetTextView(), resource_, strings_);
         }
-        return text;
+        break;
+
+    case Kind::Formula:
+        payload.formula = FormulaData::Create(other_.payload.formula->formula, sheet_, other_.payload.formula->cache, resource_);
+        payload.formula->array = other_.payload.formula->array;
+        kind = Kind::Formula;
+        break;
     }
+}
+
+Cell::Cell(Cell&& other_) noexcept : payload(other_.payload), kind(other_.kind), heap(other_.heap), inline_size(other_.inline_size)
+{
+    other_.kind = Kind::Empty;
+    other_.heap = false;
+}
 
-    std::string GetText() const override 
+Cell& Cell::operator=(Cell&& other_) noexcept
+{
+    if (this != &other_)
     {
-        return text;
+        Release();
+        payload = other_.payload;
+        kind = other_.kind;
+        heap = other_.heap;
+        inline_size = other_.inline_size;
+
+        other_.kind = Kind::Empty;
+        other_.heap = false;
     }
+    return *this;
+}
 
-private:
-
-    std::string text;
-};
+Cell::~Cell()
+{
+    Release();
+}
 
-class Cell::FormulaImpl : public Impl 
+void Cell::Clear()
 {
-public:
+    Release();
+}
 
-    explicit FormulaImpl(std::string expression_, const SheetInterface& sheet_) : sheet(sheet_) 
+Cell::Value Cell::GetValue() const
+{
+    switch (kind)
     {
-        if (expression_.empty() || expression_[0] != FORMULA_SIGN)
-        {
-            throw std::logic_error("");
-        }
+    case Kind::Empty:
+        return "";
 
-        formula_ptr = ParseFormula(expression_.substr(1));
+    case Kind::Number:
+    {
+        char buffer[MAX_NUMBER_LENGTH];
+        return std::string(FormatNumber(payload.number.value, buffer));
     }
 
-    Value GetValue() const override
+    case Kind::Text:
+        return std::string(GetDisplayedText());
+
+    case Kind::Formula:
     {
-        if (!cache)
+        const FormulaInterface::Value value = GetFormulaValue();
+        if (std::holds_alternative<double>(value))
         {
-            cache = formula_ptr->Evaluate(sheet);
+            return std::get<double>(value);
         }
+        return std::get<FormulaError>(value);
+    }
+    }
+    return "";
+}
 
-        FormulaInterface::Value value = formula_ptr->Evaluate(sheet);
+Cell::ValueView Cell::GetValueView() const
+{
+    switch (kind)
+    {
+    case Kind::Empty:
+        return std::string_view();
+
+    case Kind::Number:
+    case Kind::Text:
+        return GetDisplayedText();
+
+    case Kind::Formula:
+    {
+        const FormulaInterface::Value value = GetFormulaValue();
         if (std::holds_alternative<double>(value))
         {
             return std::get<double>(value);
         }
-
         return std::get<FormulaError>(value);
     }
-
-    std::string GetText() const override 
-    {
-        return FORMULA_SIGN + formula_ptr->GetExpression();
     }
+    return std::string_view();
+}
+
+double Cell::GetNumber() const
+{
+    return payload.number.value;
+}
 
-    bool IsCacheValid() const override 
+std::string_view Cell::GetDisplayedText() const
+{
+    std::string_view text = GetTextView();
+    if (text[0] == ESCAPE_SIGN)
     {
-        return cache.has_value();
+        text.remove_prefix(1);
     }
+    return text;
+}
 
-    void InvalidateCache() override 
+FormulaInterface::Value Cell::GetFormulaValue() const
+{
+    FormulaData& data = *payload.formula;
+    if (data.cache)
     {
-        cache.reset();
+        if (data.profiler)
+        {
+            data.profiler->RecordHit(data.pos);
+        }
     }
-
-    std::vector<Position> GetReferencedCells() const 
+    else
     {
-        return formula_ptr->GetReferencedCells();
+        if (data.compilable && !data.profiler && (data.above != Match::Different || data.below != Match::Different))
+        {
+            // The sheet may evaluate the formula together with its copies filled down around it.
+            data.sheet->EvaluateColumnRun(data.pos);
+        }
+        if (!data.cache)
+        {
+            TraceScope trace("evaluate", "recalc", data.pos);
+            if (data.profiler)
+            {
+                data.profiler->BeginEvaluation(data.pos);
+                Evaluate(data);
+                data.profiler->EndEvaluation();
+            }
+            else
+            {
+                Evaluate(data);
+            }
+        }
     }
+    return *data.cache;
+}
 
-private:
+const FormulaInterface* Cell::GetFormula() const
+{
+    return kind == Kind::Formula ? payload.formula->formula.get() : nullptr;
+}
 
-    std::unique_ptr<FormulaInterface> formula_ptr;
-    const SheetInterface& sheet;
-    mutable std::optional<FormulaInterface::Value> cache;
-};
+Size Cell::GetArraySize() const
+{
+    return kind == Kind::Formula ? payload.formula->formula->GetArraySize() : Size{ 1, 1 };
+}
 
-bool Cell::WouldIntroduceCircularDependency(const Impl& new_impl_) const 
+const ArrayValue* Cell::GetArrayValue() const
 {
-    if (new_impl_.GetReferencedCells().empty())
+    if (kind != Kind::Formula)
     {
-        return false;
+        return nullptr;
     }
+    GetFormulaValue();
+    return payload.formula->array.get();
+}
 
-    std::unordered_set<const Cell*> referenced;
-    for (const Position& pos : new_impl_.GetReferencedCells()) 
+std::string Cell::GetText() const
+{
+    switch (kind)
     {
-        referenced.insert(sheet.GetCellPtr(pos));
+    case Kind::Empty:
+        return "";
+
+    case Kind::Number:
+    {
+        char buffer[MAX_NUMBER_LENGTH];
+        return std::string(FormatNumber(payload.number.value, buffer));
     }
 
-    std::unordered_set<const Cell*> visited;
-    std::stack<const Cell*> to_visit;
-    to_visit.push(this);
+    case Kind::Text:
+        return std::string(GetTextView());
 
-    while (!to_visit.empty()) 
-    {
-        const Cell* current = to_visit.top();
-        to_visit.pop();
-        visited.insert(current);
+    case Kind::Formula:
+        return FORMULA_SIGN + payload.formula->formula->GetExpression();
+    }
+    return "";
+}
 
-        if (referenced.find(current) != referenced.end())
-        {
-            return true;
-        }
+std::vector<Position> Cell::GetReferencedCells() const
+{
+    if (kind == Kind::Formula)
+    {
+        return payload.formula->formula->GetReferencedCells();
+    }
+    return {};
+}
 
-        for (const Cell* incoming : current->l_nodes) 
-        {
-            if (visited.find(incoming) == visited.end())
-            {
-                to_visit.push(incoming);
-            }
-        }
+std::vector<Range> Cell::GetReferencedRanges() const
+{
+    if (kind == Kind::Formula)
+    {
+        return payload.formula->formula->GetReferencedRanges();
     }
+    return {};
+}
 
-    return false;
+const std::vector<uint64_t>& Cell::GetSubexpressions() const
+{
+    static const std::vector<uint64_t> NONE;
+    return kind == Kind::Formula ? payload.formula->formula->GetSubexpressions() : NONE;
 }
 
-void Cell::InvalidateCacheRecursive(bool force_) 
+bool Cell::CompileKernel(ColumnKernel& kernel_) const
 {
-    if (impl->IsCacheValid() || force_) 
+    if (kind != Kind::Formula || !payload.formula->compilable)
     {
-        impl->InvalidateCache();
-        for (Cell* incoming : l_nodes) 
-        {
-            incoming->InvalidateCacheRecursive();
-        }
+        return false;
     }
+    FormulaData& data = *payload.formula;
+    data.compilable = data.formula->CompileKernel(data.pos, kernel_);
+    return data.compilable;
 }
 
-Cell::Cell(Sheet& sheet_) : impl(std::make_unique<EmptyImpl>()), sheet(sheet_) {}
+void Cell::SetCachedValue(double value_) const
+{
+    payload.formula->cache = value_;
+}
 
-Cell::~Cell() {}
+Cell::Match Cell::GetMatchAbove() const
+{
+    return kind == Kind::Formula ? payload.formula->above : Match::Different;
+}
 
-void Cell::Set(std::string text_) 
+Cell::Match Cell::GetMatchBelow() const
 {
-    std::unique_ptr<Impl> impl_;
+    return kind == Kind::Formula ? payload.formula->below : Match::Different;
+}
 
-    if (text_.empty())
+void Cell::SetMatch(const Cell* upper_, const Cell* lower_, Match match_)
+{
+    if (upper_ && upper_->kind == Kind::Formula)
     {
-        impl_ = std::make_unique<EmptyImpl>();
+        upper_->payload.formula->below = match_;
     }
-    else if (text_.size() > 1 && text_[0] == FORMULA_SIGN)
+    if (lower_ && lower_->kind == Kind::Formula)
     {
-        impl_ = std::make_unique<FormulaImpl>(std::move(text_), sheet);
+        lower_->payload.formula->above = match_;
     }
-    else
+}
+
+Cell::Kind Cell::GetKind() const
+{
+    return kind;
+}
+
+Cell::HeapUsage Cell::GetHeapUsage() const
+{
+    HeapUsage usage;
+    if (kind == Kind::Formula)
     {
-        impl_ = std::make_unique<TextImpl>(std::move(text_));
+        usage.formula = sizeof(FormulaData);
+        usage.ast = payload.formula->formula->GetMemoryUsage();
     }
-
-    if (WouldIntroduceCircularDependency(*impl_))
+    else if (kind == Kind::Text && heap && !payload.text->GetPool())
     {
-        throw CircularDependencyException("");
+        // Pooled text is shared, so the pool counts it once. A number's spelling
+        // comes and goes with reads, so it is not counted.
+        usage.text = StringPool::GetEntryBytes(payload.text->GetText().size());
     }
-    impl = std::move(impl_);
+    return usage;
+}
+
+bool Cell::IsCacheValid() const
+{
+    return kind != Kind::Formula || payload.formula->cache.has_value();
+}
 
-    for (Cell* outgoing : r_nodes) 
+void Cell::InvalidateCache()
+{
+    if (kind == Kind::Formula)
     {
-        outgoing->l_nodes.erase(this);
+        payload.formula->cache.reset();
+        payload.formula->array.reset();
     }
+}
 
-    r_nodes.clear();
-
-    for (const Position& pos : impl->GetReferencedCells()) 
+void Cell::AttachProfiler(RecalcProfiler* profiler_, Position pos_)
+{
+    if (kind == Kind::Formula)
     {
-        Cell* outgoing = sheet.GetCellPtr(pos);
-        if (!outgoing) 
-        {
-            sheet.SetCell(pos, "");
-            outgoing = sheet.GetCellPtr(pos);
-        }
-        r_nodes.insert(outgoing);
-        outgoing->l_nodes.insert(this);
+        payload.formula->profiler = profiler_;
+        payload.formula->pos = pos_;
     }
+}
 
-    InvalidateCacheRecursive(true);
+// An array formula keeps every element for the cells it spills into and shows the top left one.
+void Cell::Evaluate(FormulaData& data_)
+{
+    const Size size = data_.formula->GetArraySize();
+    if (size == Size{ 1, 1 })
+    {
+        data_.cache = data_.formula->Evaluate(*data_.sheet);
+    }
+    else if (data_.sheet->CanSpill(data_.pos, size))
+    {
+        auto array = std::make_shared<ArrayValue>();
+        data_.formula->EvaluateArray(*data_.sheet, *array);
+        data_.cache = array->Get(0);
+        data_.array = std::move(array);
+    }
+    else
+    {
+        data_.cache = FormulaError(FormulaError::Category::Spill);
+    }
 }
 
-void Cell::Clear() 
+void Cell::SetNumber(double number_, std::pmr::memory_resource* resource_)
 {
-    impl = std::make_unique<EmptyImpl>();
+    payload.number.value = number_;
+    payload.number.spelling.resource = resource_;
+    kind = Kind::Number;
 }
 
-Cell::Value Cell::GetValue() const 
+void Cell::SpellNumber() const
 {
-    return impl->GetValue();
+    Number& number = payload.number;
+    char buffer[MAX_NUMBER_LENGTH];
+    const std::string_view spelling = FormatNumber(number.value, buffer);
+    if (spelling.size() <= NUMBER_INLINE_CAPACITY)
+    {
+        std::memcpy(number.spelling.inline_text, spelling.data(), spelling.size());
+        inline_size = static_cast<uint8_t>(spelling.size());
+    }
+    else
+    {
+        number.spelling.text = StringPool::Allocate(spelling, number.spelling.resource);
+        heap = true;
+    }
 }
 
-std::string Cell::GetText() const 
+void Cell::SetText(std::string_view text_, std::pmr::memory_resource* resource_, StringPool* strings_)
 {
-    return impl->GetText();
+    if (text_.size() <= INLINE_CAPACITY)
+    {
+        std::memcpy(payload.inline_text, text_.data(), text_.size());
+        inline_size = static_cast<uint8_t>(text_.size());
+    }
+    else
+    {
+        payload.text = strings_ ? strings_->Intern(text_) : StringPool::Allocate(text_, resource_);
+        heap = true;
+    }
+    kind = Kind::Text;
 }
 
-std::vector<Position> Cell::GetReferencedCells() const 
+std::string_view Cell::GetTextView() const
 {
-    return impl->GetReferencedCells();
+    if (kind == Kind::Number)
+    {
+        if (!heap && inline_size == 0)
+        {
+            SpellNumber();
+        }
+        const Number& number = payload.number;
+        return heap ? number.spelling.text->GetText() : std::string_view(number.spelling.inline_text, inline_size);
+    }
+    if (heap)
+    {
+        return payload.text->GetText();
+    }
+    return { payload.inline_text, inline_size };
 }
 
-bool Cell::IsReferenced() const 
+void Cell::Release()
 {
-    return !l_nodes.empty();
+    if (kind == Kind::Formula)
+    {
+        FormulaData::Destroy(payload.formula);
+    }
+    else if (heap)
+    {
+        StringPool::Release(kind == Kind::Number ? payload.number.spelling.text : payload.text);
+    }
+
+    kind = Kind::Empty;
+    heap = false;
 }
\ No newline at end of file
@@ -2,40 +2,143 @@
 
 #include "common.h"
 #include "formula.h"
+#include "profiler.h"
+#include "stringpool.h"
 
-#include <functional>
-#include <unordered_set>
+#include <cstdint>
+#include <memory_resource>
 
-class Sheet;
-
-class Cell : public CellInterface 
+class Cell : public CellInterface
 {
 public:
 
-    Cell(Sheet& sheet_);
+    enum class Kind : uint8_t
+    {
+        Empty,
+        Number,
+        Text,
+        Formula,
+    };
+
+    // Bytes a cell holds outside its own object.
+    struct HeapUsage
+    {
+        size_t text = 0;
+        size_t formula = 0;
+        size_t ast = 0;
+    };
+
+    Cell() = default;
+    // Long text is interned in strings_ and formula nodes in expressions_ when they are given.
+    Cell(std::string text_, const SheetInterface& sheet_, std::pmr::memory_resource* resource_ = std::pmr::get_default_resource(), StringPool* strings_ = nullptr, ExpressionPool* expressions_ = nullptr);
+    Cell(const Cell& other_, const SheetInterface& sheet_, std::pmr::memory_resource* resource_ = std::pmr::get_default_resource(), StringPool* strings_ = nullptr);
+    // Same cell as for the shortest text spelling of number_.
+    explicit Cell(double number_, std::pmr::memory_resource* resource_ = std::pmr::get_default_resource());
+    Cell(Cell&& other_) noexcept;
+    Cell& operator=(Cell&& other_) noexcept;
     ~Cell();
 
-    void Set(std::string text_);
     void Clear();
 
     Value GetValue() const override;
+    ValueView GetValueView() const override;
     std::string GetText() const override;
     std::vector<Position> GetReferencedCells() const override;
+    std::vector<Range> GetReferencedRanges() const;
+    // Shared subexpression keys of a formula cell; empty for every other kind.
+    const std::vector<uint64_t>& GetSubexpressions() const;
+
+    Kind GetKind() const;
+    HeapUsage GetHeapUsage() const;
+
+    // Reads that do not build a Value, one per kind; a number also has its spelling
+    // as displayed text. The text view points into the cell and stays valid until
+    // the cell is changed.
+    double GetNumber() const;
+    std::string_view GetDisplayedText() const;
+    FormulaInterface::Value GetFormulaValue() const;
+    bool IsCacheValid() const;
+    // Parsed formula of a formula cell, which can be evaluated against another sheet
+    // without touching the cache; nullptr for every other kind.
+    const FormulaInterface* GetFormula() const;
+
+    // Shape of an array formula, see FormulaInterface::GetArraySize; 1x1 for every other cell.
+    Size GetArraySize() const;
+    // Elements of an array formula that spilled, evaluating it when stale; nullptr when
+    // it had no room to spill or is not an array formula.
+    const ArrayValue* GetArrayValue() const;
+    void InvalidateCache();
 
-    bool IsReferenced() const;
+    // Compiles a formula cell into kernel_ relative to its own position, see
+    // FormulaInterface::CompileKernel. A formula that does not compile is not tried
+    // again, and reads on its own without asking the sheet for a column run.
+    bool CompileKernel(ColumnKernel& kernel_) const;
+    // Stores the value of a formula cell computed by a column kernel.
+    void SetCachedValue(double value_) const;
+
+    // Whether a formula cell compiles to the same kernel as the formula right above or
+    // below it, once the sheet has found out. A new cell does not know; the sheet forgets
+    // what its neighbours knew about the cell it replaced. A formula differing from both
+    // is evaluated without asking the sheet for a column run.
+    enum class Match : uint8_t
+    {
+        Unknown,
+        Same,
+        Different,
+    };
+
+    Match GetMatchAbove() const;
+    Match GetMatchBelow() const;
+    // Records match_ in both cells; either can be nullptr.
+    static void SetMatch(const Cell* upper_, const Cell* lower_, Match match_);
+
+    // Tells a formula cell where it lives, for profiles and traces, and which
+    // profiler gets its evaluations and cache hits; nullptr detaches.
+    void AttachProfiler(RecalcProfiler* profiler_, Position pos_);
 
 private:
 
-    class Impl;
-    class EmptyImpl;
-    class TextImpl;
-    class FormulaImpl;
+    struct FormulaData;
+
+    static const size_t INLINE_CAPACITY = 16;
+    static const size_t NUMBER_INLINE_CAPACITY = 8;
+
+    // Plain text up to INLINE_CAPACITY bytes lives in the cell itself; text that is
+    // exactly the shortest spelling of a finite double is kept as that double. A
+    // number is spelled on the first view of its text, beside the double when that
+    // takes up to NUMBER_INLINE_CAPACITY bytes and as an entry of the cell's own
+    // otherwise; until then the spelling slot holds the resource to allocate it from.
+    // Longer text is a string pool entry, shared with every cell of the pool holding
+    // the same text. Formula handles come from the resource passed at construction,
+    // which they remember so the cell can give them back without growing.
+    struct Number
+    {
+        double value;
+        union
+        {
+            char inline_text[NUMBER_INLINE_CAPACITY];
+            StringPool::Entry* text;
+            std::pmr::memory_resource* resource;
+        } spelling;
+    };
+
+    union Payload
+    {
+        Number number;
+        char inline_text[INLINE_CAPACITY];
+        StringPool::Entry* text;
+        FormulaData* formula;
+    };
 
-    bool WouldIntroduceCircularDependency(const Impl& new_impl_) const;
-    void InvalidateCacheRecursive(bool force_ = false);
+    static void Evaluate(FormulaData& data_);
+    void SetNumber(double number_, std::pmr::memory_resource* resource_);
+    void SpellNumber() const;
+    void SetText(std::string_view text_, std::pmr::memory_resource* resource_, StringPool* strings_);
+    std::string_view GetTextView() const;
+    void Release();
 
-    std::unique_ptr<Impl> impl;
-    Sheet& sheet;
-    std::unordered_set<Cell*> l_nodes;
-    std::unordered_set<Cell*> r_nodes;
+    mutable Payload payload{};
+    Kind kind = Kind::Empty;
+    mutable bool heap = false;
+    mutable uint8_t inline_size = 0;
 };
\ No newline at end of file
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstdint>
+#include <functional>
 #include <iosfwd>
 #include <memory>
 #include <stdexcept>
@@ -19,13 +21,34 @@ struct Position
     bool IsValid() const;
     std::string ToString() const;
 
+    // Writes the name of a valid position into buffer_, which must hold MAX_STRING_LENGTH
+    // chars, and returns its length; an invalid position writes nothing.
+    size_t ToChars(char* buffer_) const;
+
     static Position FromString(std::string_view str_);
 
-    static const int MAX_ROWS = 16384;
-    static const int MAX_COLS = 16384;
+    // Array forms of the two conversions. ToStrings packs the names back to back into
+    // buffer_, which must hold count_ * MAX_STRING_LENGTH chars, and points out_ into it.
+    static void FromStrings(const std::string_view* strs_, size_t count_, Position* out_);
+    static void ToStrings(const Position* positions_, size_t count_, char* buffer_, std::string_view* out_);
+
+    static const int MAX_ROWS = 1 << 20;
+    static const int MAX_COLS = 1 << 14;
+    // Length of the longest name, XFD1048576.
+    static const size_t MAX_STRING_LENGTH = 10;
     static const Position NONE;
 };
 
+struct PositionHasher
+{
+    size_t operator()(Position pos_) const noexcept
+    {
+        // Row and column packed side by side into one 64-bit key, so no two positions collide whatever the limits.
+        const uint64_t key = static_cast<uint64_t>(static_cast<uint32_t>(pos_.row)) << 32 | static_cast<uint32_t>(pos_.col);
+        return std::hash<uint64_t>()(key);
+    }
+};
+
 struct Size 
 {
     int rows = 0;
@@ -34,6 +57,20 @@ struct Size
     bool operator==(Size rhs_) const;
 };
 
+// Rectangle of cells starting at top_left.
+struct Range
+{
+    Position top_left;
+    Size size;
+
+    bool operator==(const Range& rhs_) const;
+
+    bool IsValid() const;
+    bool Contains(Position pos_) const;
+    bool Intersects(const Range& other_) const;
+    size_t GetCellCount() const;
+};
+
 class FormulaError 
 {
 public:
@@ -43,6 +80,8 @@ public:
         Ref,  
         Value,
         Div0, 
+        NA,     // a lookup found no match
+        Spill,  // an array formula has no room for its values
     };
 
     FormulaError(Category category_);
@@ -60,6 +99,21 @@ private:
 
 std::ostream& operator<<(std::ostream& output_, FormulaError fe_);
 
+// Values of an array formula, one per cell of the area it fills, row by row. Each
+// element is a number, or the error it failed with on its own.
+struct ArrayValue
+{
+    Size size;
+    std::vector<double> numbers;
+    // 1 + the FormulaError category of a failed element, 0 for a number.
+    std::vector<uint8_t> errors;
+
+    void Resize(Size size_);
+    std::variant<double, FormulaError> Get(size_t index_) const;
+
+    static uint8_t ToCode(FormulaError error_);
+};
+
 class InvalidPositionException : public std::out_of_range 
 {
 public:
@@ -86,10 +140,14 @@ class CellInterface
 public:
 
     using Value = std::variant<std::string, double, FormulaError>;
+    // Value whose text is borrowed from the cell and stays valid until the cell changes.
+    using ValueView = std::variant<std::string_view, double, FormulaError>;
 
     virtual ~CellInterface() = default;
 
     virtual Value GetValue() const = 0;
+    // Same value read without allocating.
+    virtual ValueView GetValueView() const = 0;
     virtual std::string GetText() const = 0;
     virtual std::vector<Position> GetReferencedCells() const = 0;
 };
@@ -97,6 +155,37 @@ public:
 inline constexpr char FORMULA_SIGN = '=';
 inline constexpr char ESCAPE_SIGN = '\'';
 
+// Whether text_ is exactly the shortest spelling of a finite number, which is then stored in number_.
+bool ParseCanonicalNumber(std::string_view text_, double& number_);
+
+// Key of a lookup: a number, or text compared byte by byte. Text of a cell that is the
+// shortest spelling of a number is keyed as that number. Numbers never equal text,
+// and ordered comparisons only look at keys of the same kind.
+using LookupKey = std::variant<double, std::string_view>;
+
+enum class LookupMode
+{
+    Exact,
+    LessOrEqual,
+    GreaterOrEqual,
+};
+
+struct LookupCriterion
+{
+    enum class Comparison
+    {
+        Equal,
+        NotEqual,
+        Less,
+        LessOrEqual,
+        Greater,
+        GreaterOrEqual,
+    };
+
+    Comparison comparison = Comparison::Equal;
+    LookupKey key;
+};
+
 class SheetInterface 
 {
 public:
@@ -113,6 +202,44 @@ public:
 
     virtual void PrintValues(std::ostream& output_) const = 0;
     virtual void PrintTexts(std::ostream& output_) const = 0;
+
+    // Lookups for VLOOKUP, MATCH and COUNTIF; empty cells and errors hold no key.
+    // FindInColumn returns the row of the match in a one-column range, or -1: Exact takes
+    // the first equal key, LessOrEqual the greatest key not above key_ (the last row of
+    // a tie), GreaterOrEqual the smallest key not below it (the first row of a tie).
+    // CountIf counts the cells of range_ that satisfy criterion_; NotEqual counts every
+    // cell without an equal key, empty ones included. The defaults read cell by cell.
+    virtual int FindInColumn(Range column_, LookupKey key_, LookupMode mode_) const;
+    virtual size_t CountIf(Range range_, const LookupCriterion& criterion_) const;
+
+    // Formulas evaluate subexpressions they share with other formulas of the sheet through
+    // here, so the sheet can keep one value per key where each of them would compute it.
+    // evaluate_ computes the value or throws its FormulaError. The default keeps nothing.
+    virtual double EvaluateShared(uint64_t /* key */, const std::function<double()>& evaluate_) const
+    {
+        return evaluate_();
+    }
+
+    // Called before the stale formula at pos_ is evaluated on its own. The sheet may
+    // evaluate it there together with equal formulas around it and store their values
+    // in their cells. The default does nothing.
+    virtual void EvaluateColumnRun(Position /* pos */) const {}
+
+    // Value at pos_ as formulas read it, the value an array formula spills there included.
+    // A sheet may hand out text that spells a number as that number, which formulas would
+    // read it as anyway.
+    virtual CellInterface::ValueView GetValueView(Position pos_) const
+    {
+        const CellInterface* cell = GetCell(pos_);
+        return cell ? cell->GetValueView() : CellInterface::ValueView(std::string_view());
+    }
+
+    // Whether the array formula at anchor_ may fill the size_ area from it. Where it may
+    // not, the formula is a #SPILL! error. The default lets every formula spill.
+    virtual bool CanSpill(Position /* anchor */, Size /* size */) const
+    {
+        return true;
+    }
 };
 
 std::unique_ptr<SheetInterface> CreateSheet();
\ No newline at end of file
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <memory>
+#include <memory_resource>
+#include <unordered_map>
+
+namespace ASTImpl
+{
+    class Expr;
+}
+
+// Hash-consing table for the nodes of parsed formulas. Formulas parsed through
+// one pool are built bottom-up out of its nodes, so within a pool two equal
+// subexpressions, reading the same positions, are the same node. Every node the
+// pool adds gets an id that is never reused, the key its value is cached under.
+// The pool counts the pooled parents and formulas holding each node and marks a
+// node held twice as shared, which it stays for its life. Leaves, cheaper to
+// compare than to pool, stay out of it. The pool only watches its nodes; they
+// live while a formula holds them. Defined with the nodes in FormulaAST.cpp.
+class ExpressionPool
+{
+public:
+
+    explicit ExpressionPool(std::pmr::memory_resource* resource_ = std::pmr::get_default_resource()) : nodes(resource_) {}
+    ExpressionPool(const ExpressionPool&) = delete;
+    ExpressionPool& operator=(const ExpressionPool&) = delete;
+
+    // Returns the pooled node equal to node_, adding node_ if there is none.
+    std::shared_ptr<const ASTImpl::Expr> Intern(std::shared_ptr<const ASTImpl::Expr> node_);
+    // Counts a formula holding root_, the last node interned for it.
+    void Hold(const std::shared_ptr<const ASTImpl::Expr>& root_);
+
+    // Nodes still held by some formula.
+    size_t GetSize() const;
+    // Bytes of the table itself; the nodes are counted with the formulas holding them.
+    size_t GetIndexBytes() const;
+
+private:
+
+    // Nodes no formula holds any more are swept out once the table has doubled since the last sweep.
+    static const size_t MIN_PURGE_SIZE = 1024;
+
+    void AddHolder(const ASTImpl::Expr& node_);
+    void Purge();
+
+    struct Entry
+    {
+        std::weak_ptr<const ASTImpl::Expr> node;
+        size_t holders = 0;
+    };
+
+    std::pmr::unordered_multimap<size_t, Entry> nodes;
+    size_t purge_size = 0;
+};
\ No newline at end of file
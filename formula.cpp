@@ -5,6 +5,8 @@
 #include <algorithm>
 #include <cassert>
 #include <cctype>
+#include <charconv>
+#include <cmath>
 #include <sstream>
 
 using namespace std::literals;
@@ -33,6 +35,12 @@ std::string_view FormulaError::ToString() const
 
     case Category::Div0:
         return "#ARITHM!";
+
+    case Category::NA:
+        return "#N/A";
+
+    case Category::Spill:
+        return "#SPILL!";
     }
     return "";
 }
@@ -42,52 +50,123 @@ std::ostream& operator<<(std::ostream& output_, FormulaError fe_)
     return output_ << fe_.ToString();
 }
 
+void ArrayValue::Resize(Size size_)
+{
+    // Every element is written by whoever fills the array, so old values are not cleared.
+    size = size_;
+    const size_t count = static_cast<size_t>(size_.rows) * static_cast<size_t>(size_.cols);
+    numbers.resize(count);
+    errors.resize(count);
+}
+
+std::variant<double, FormulaError> ArrayValue::Get(size_t index_) const
+{
+    if (errors[index_])
+    {
+        return FormulaError(static_cast<FormulaError::Category>(errors[index_] - 1));
+    }
+    return numbers[index_];
+}
+
+uint8_t ArrayValue::ToCode(FormulaError error_)
+{
+    return static_cast<uint8_t>(1 + static_cast<int>(error_.GetCategory()));
+}
+
 namespace 
 {
+    // Reads referenced text the way an input stream would: leading blanks and a plus sign
+    // are allowed, anything after the number is not, and empty text counts as zero.
+    double ParseReferencedText(std::string_view text_)
+    {
+        const size_t start = text_.find_first_not_of(" \t\n\v\f\r");
+        if (start == std::string_view::npos)
+        {
+            if (text_.empty())
+            {
+                return 0;
+            }
+            throw FormulaError(FormulaError::Category::Value);
+        }
+        text_.remove_prefix(start);
+        if (text_[0] == '+' && text_.size() > 1 && text_[1] != '-')
+        {
+            text_.remove_prefix(1);
+        }
+
+        double result = 0;
+        const auto parsed = std::from_chars(text_.data(), text_.data() + text_.size(), result);
+        if (parsed.ec != std::errc() || parsed.ptr != text_.data() + text_.size() || !std::isfinite(result))
+        {
+            throw FormulaError(FormulaError::Category::Value);
+        }
+        return result;
+    }
+
+    class SheetReader : public SheetArgs
+    {
+    public:
+
+        explicit SheetReader(const SheetInterface& sheet_) : sheet(sheet_) {}
+
+        double GetNumber(Position pos_) const override
+        {
+            // Read the value once: every read of a formula cell goes through its cache.
+            const CellInterface::ValueView value = GetValue(pos_);
+            if (std::holds_alternative<double>(value))
+            {
+                return std::get<double>(value);
+            }
+            if (std::holds_alternative<std::string_view>(value)) 
+            {
+                return ParseReferencedText(std::get<std::string_view>(value));
+            }
+            throw FormulaError(std::get<FormulaError>(value));
+        }
+
+        CellInterface::ValueView GetValue(Position pos_) const override
+        {
+            if (!pos_.IsValid())
+            {
+                throw FormulaError(FormulaError::Category::Ref);
+            }
+
+            return sheet.GetValueView(pos_);
+        }
+
+        const SheetInterface& GetSheet() const override
+        {
+            return sheet;
+        }
+
+        double EvaluateShared(uint64_t key_, const std::function<double()>& evaluate_) const override
+        {
+            return sheet.EvaluateShared(key_, evaluate_);
+        }
+
+    private:
+
+        const SheetInterface& sheet;
+    };
+
     class Formula : public FormulaInterface
     {
     public:
 
-        explicit Formula(const std::string expression_) : ast(ParseFormulaAST(expression_)) {}
+        explicit Formula(const std::string expression_, ExpressionPool* pool_) : ast(ParseFormulaAST(expression_, pool_)), memory_usage(sizeof(Formula) + ast.GetMemoryUsage()) {}
 
         Value Evaluate(const SheetInterface& sheet_) const override 
         {
-            const std::function<double(Position)> args = [&sheet_](const Position p)->double 
-                {
-                    if (!p.IsValid())
-                    {
-                        throw FormulaError(FormulaError::Category::Ref);
-                    }
-
-                const CellInterface* cell = sheet_.GetCell(p);
-                if (!cell)
-                {
-                    return 0;
-                }
-                if (std::holds_alternative<double>(cell->GetValue()))
-                {
-                    return std::get<double>(cell->GetValue());
-                }
-                if (std::holds_alternative<std::string>(cell->GetValue())) 
-                {
-                    std::string value = std::get<std::string>(cell->GetValue());
-                    double result = 0;
-                    if (!value.empty()) 
-                    {
-                        std::istringstream in(value);
-                        if (!(in >> result) || !in.eof())
-                        {
-                            throw FormulaError(FormulaError::Category::Value);
-                        }
-                    }
-                    return result;
-                }
-                throw FormulaError(std::get<FormulaError>(cell->GetValue()));
-                };
+            if (!(ast.GetArraySize() == Size{ 1, 1 }))
+            {
+                ArrayValue array;
+                EvaluateArray(sheet_, array);
+                return array.Get(0);
+            }
 
             try 
             {
-                return ast.Execute(args);
+                return ast.Execute(SheetReader(sheet_));
             }
             catch (FormulaError& e) 
             {
@@ -95,6 +174,16 @@ namespace
             }
         }
 
+        Size GetArraySize() const override
+        {
+            return ast.GetArraySize();
+        }
+
+        void EvaluateArray(const SheetInterface& sheet_, ArrayValue& array_) const override
+        {
+            ast.ExecuteArray(SheetReader(sheet_), array_);
+        }
+
         std::vector<Position> GetReferencedCells() const override 
         {
             std::vector<Position> cells;
@@ -109,6 +198,29 @@ namespace
             return cells;
         }
 
+        std::vector<Range> GetReferencedRanges() const override 
+        {
+            std::vector<Range> ranges;
+            for (const Range& range : ast.GetRanges()) 
+            {
+                if (std::find(ranges.begin(), ranges.end(), range) == ranges.end())
+                {
+                    ranges.push_back(range);
+                }
+            }
+            return ranges;
+        }
+
+        const std::vector<uint64_t>& GetSubexpressions() const override 
+        {
+            return ast.GetSubexpressions();
+        }
+
+        bool CompileKernel(Position origin_, ColumnKernel& kernel_) const override
+        {
+            return ast.Compile(origin_, kernel_);
+        }
+
         std::string GetExpression() const override 
         {
             std::ostringstream out;
@@ -116,18 +228,24 @@ namespace
             return out.str();
         }
 
+        size_t GetMemoryUsage() const override
+        {
+            return memory_usage;
+        }
+
     private:
 
         const FormulaAST ast;
+        const size_t memory_usage;
     };
 
 }  // namespace
 
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression_) 
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression_, ExpressionPool* pool_) 
 {
     try
     {
-        return std::make_unique<Formula>(std::move(expression_));
+        return std::make_unique<Formula>(std::move(expression_), pool_);
     }
     catch (...)
     {
@@ -1,6 +1,8 @@
 #pragma once
 
 #include "common.h"
+#include "exprpool.h"
+#include "kernel.h"
 
 #include <memory>
 #include <vector>
@@ -13,10 +15,31 @@ public:
 
     virtual ~FormulaInterface() = default;
 
+    // An array formula evaluates to its top left element.
     virtual Value Evaluate(const SheetInterface& sheet_) const = 0;
 
+    // Shape of the formula's value. Arithmetic over ranges is done element by element
+    // over ranges of one shape and single values, and makes an array formula of that
+    // shape; every other formula is 1x1.
+    virtual Size GetArraySize() const = 0;
+    // Evaluates every element into array_, each failing on its own.
+    virtual void EvaluateArray(const SheetInterface& sheet_, ArrayValue& array_) const = 0;
+
     virtual std::string GetExpression() const = 0;
     virtual std::vector<Position> GetReferencedCells() const = 0;
+    // Ranges read by lookups and arrays, each once; their cells are not among the referenced cells.
+    virtual std::vector<Range> GetReferencedRanges() const = 0;
+    // Keys of the inner subexpressions, as passed to SheetInterface::EvaluateShared.
+    virtual const std::vector<uint64_t>& GetSubexpressions() const = 0;
+    // Compiles the formula, as written in cell origin_, into kernel_ for runs of it filled
+    // down a column. False when it is more than arithmetic over numbers and cells, or
+    // reads a cell in origin_'s column.
+    virtual bool CompileKernel(Position origin_, ColumnKernel& kernel_) const = 0;
+
+    // Bytes held by the parsed formula, including its list of referenced cells.
+    virtual size_t GetMemoryUsage() const = 0;
 };
 
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression_);
\ No newline at end of file
+// Subexpressions are interned in pool_ when one is given, so formulas parsed through
+// the same pool share their equal parts.
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression_, ExpressionPool* pool_ = nullptr);
\ No newline at end of file
@@ -0,0 +1,574 @@
+#include "graph.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <unordered_set>
+
+namespace
+{
+    // A hash node holds the key and value next to a link.
+    template <typename Map>
+    size_t GetNodeBytes(const Map& /* map */)
+    {
+        return sizeof(typename Map::value_type) + sizeof(void*);
+    }
+
+    template <typename T>
+    size_t GetListBytes(const std::pmr::vector<T>& list_)
+    {
+        return list_.capacity() * sizeof(T);
+    }
+}  // namespace
+
+DependencyGraph::DependencyGraph(std::pmr::memory_resource* resource_) : ids(resource_), nodes(resource_), slab(resource_), free_nodes(resource_), range_nodes(resource_), free_ranges(resource_), column_ranges(resource_), cell_ranges(resource_), spills(resource_), column_spills(resource_), visit_marks(resource_) {}
+
+DependencyGraph::DependencyGraph(const DependencyGraph* base_, std::pmr::memory_resource* resource_) : DependencyGraph(resource_)
+{
+    base = base_;
+    // Areas are few, so every layer keeps all of them.
+    spills = base_->spills;
+    column_spills = base_->column_spills;
+    spill_bytes = spills.size() * GetNodeBytes(spills) + column_spills.size() * GetNodeBytes(column_spills);
+    for (const auto& [col, list] : column_spills)
+    {
+        spill_bytes += GetListBytes(list);
+    }
+}
+
+void DependencyGraph::SetReferences(Position cell_, const std::vector<Position>& references_, const std::vector<Range>& ranges_)
+{
+    const NodeId* found = FindNode(cell_);
+    if (!found && references_.empty() && ranges_.empty() && !base)
+    {
+        return;
+    }
+
+    const NodeId id = found ? *found : GetOrAddNode(cell_);
+
+    const Span old = nodes[id].references;
+    for (uint32_t i = 0; i < old.size; ++i)
+    {
+        Node& target = nodes[slab[old.offset + i]];
+        Remove(target.dependents, id);
+        if (target.dependents.size == 0 && target.references.size == 0)
+        {
+            ++dead_nodes;
+        }
+    }
+    nodes[id].references.size = 0;
+
+    // A layer over a base marks the cell even without references: that hides its base edges.
+    nodes[id].overridden = base != nullptr;
+
+    for (const Position& target : references_)
+    {
+        const NodeId target_id = GetOrAddNode(target);
+        Append(nodes[id].references, target_id);
+        Append(nodes[target_id].dependents, id);
+    }
+    SetRanges(cell_, id, ranges_);
+    if (!base && references_.empty() && ranges_.empty() && nodes[id].dependents.size == 0)
+    {
+        ++dead_nodes;
+    }
+
+    if ((slab.size() >= MIN_COMPACTION_SLAB && garbage * 2 > slab.size())
+        || (nodes.size() >= MIN_COMPACTION_NODES && dead_nodes * 2 > nodes.size()))
+    {
+        Compact();
+    }
+}
+
+bool DependencyGraph::HasDependents(Position cell_) const
+{
+    bool result = false;
+    ForEachDependent(cell_, [&result](Position /* dependent */)
+        {
+            result = true;
+        }, /* through_ranges = */ false);
+    return result;
+}
+
+bool DependencyGraph::WouldIntroduceCycle(Position cell_, const std::vector<Position>& references_, const std::vector<Range>& ranges_, Size spill_) const
+{
+    if (references_.empty() && ranges_.empty())
+    {
+        return false;
+    }
+
+    // A formula reading the area it spills into reads itself.
+    Range area{ cell_, spill_ };
+    if (!area.IsValid())
+    {
+        area.size = Size{ 1, 1 };
+    }
+    for (const Position& reference : references_)
+    {
+        if (area.Contains(reference))
+        {
+            return true;
+        }
+    }
+    for (const Range& range : ranges_)
+    {
+        if (range.Intersects(area))
+        {
+            return true;
+        }
+    }
+
+    // Reaching a cell the new formula reads closes a cycle, and so does reaching one spilling
+    // into what it reads.
+    const auto in_ranges = [&ranges_](Position pos_)
+        {
+            return std::any_of(ranges_.begin(), ranges_.end(), [pos_](const Range& range_)
+                {
+                    return range_.Contains(pos_);
+                });
+        };
+    const auto reads = [&](const Range& area_)
+        {
+            return std::any_of(references_.begin(), references_.end(), [&area_](Position reference_)
+                {
+                    return area_.Contains(reference_);
+                }) || std::any_of(ranges_.begin(), ranges_.end(), [&area_](const Range& range_)
+                {
+                    return range_.Intersects(area_);
+                });
+        };
+    std::vector<Position> targets = references_;
+    for (const auto& [anchor, spill] : spills)
+    {
+        if (!(anchor == cell_) && reads(spill))
+        {
+            targets.push_back(anchor);
+        }
+    }
+
+    const size_t mark_count = nodes.size() + range_nodes.size();
+    if (visit_marks.size() < mark_count)
+    {
+        visit_marks.resize(mark_count, 0);
+    }
+    if (visit_epoch >= UINT32_MAX - 2)
+    {
+        std::fill(visit_marks.begin(), visit_marks.end(), 0);
+        visit_epoch = 0;
+    }
+
+    // Two fresh epochs per search let a single array answer both "visited" and "referenced".
+    const uint32_t visited_mark = ++visit_epoch;
+    const uint32_t target_mark = ++visit_epoch;
+    for (const Position& target : targets)
+    {
+        if (const NodeId* id = FindNode(target))
+        {
+            visit_marks[*id] = target_mark;
+        }
+    }
+    const NodeId* start = FindNode(cell_);
+    if (start)
+    {
+        visit_marks[*start] = visited_mark;
+    }
+
+    // Cells the base layer alone knows have no node here and are tracked by position.
+    bool found = false;
+    std::vector<uint32_t> to_visit;
+    std::vector<Position> outside;
+    std::unordered_set<Position, PositionHasher> outside_visited;
+
+    const auto reach_node = [&](NodeId id_)
+        {
+            if (visit_marks[id_] == target_mark)
+            {
+                found = true;
+            }
+            else if (visit_marks[id_] != visited_mark)
+            {
+                visit_marks[id_] = visited_mark;
+                found = found || (!ranges_.empty() && in_ranges(nodes[id_].pos));
+                to_visit.push_back(id_);
+            }
+        };
+    const auto reach = [&](Position pos_)
+        {
+            if (const NodeId* id = FindNode(pos_))
+            {
+                reach_node(*id);
+            }
+            else if (pos_ == cell_)
+            {
+                return;
+            }
+            else if (std::find(targets.begin(), targets.end(), pos_) != targets.end() || in_ranges(pos_))
+            {
+                found = true;
+            }
+            else if (outside_visited.insert(pos_).second)
+            {
+                outside.push_back(pos_);
+            }
+        };
+    const auto reach_dependents = [&](NodeId id_)
+        {
+            const Span& span = nodes[id_].dependents;
+            for (uint32_t i = 0; i < span.size; ++i)
+            {
+                reach_node(slab[span.offset + i]);
+            }
+        };
+    // Readers of pos_ other than its slab edges: through ranges, the base layer and its area.
+    const bool indirect = live_ranges > 0 || base || !spills.empty();
+    const size_t node_count = nodes.size();
+    const auto reach_indirect = [&](Position pos_, bool through_spill_)
+        {
+            if (live_ranges > 0)
+            {
+                if (const auto column = column_ranges.find(pos_.col); column != column_ranges.end())
+                {
+                    for (const RangeId range : column->second)
+                    {
+                        const size_t mark = node_count + range;
+                        if (visit_marks[mark] != visited_mark && range_nodes[range].range.Contains(pos_))
+                        {
+                            visit_marks[mark] = visited_mark;
+                            to_visit.push_back(static_cast<uint32_t>(mark));
+                        }
+                    }
+                }
+            }
+            if (base)
+            {
+                base->VisitReaders(pos_, /* through_ranges_ = */ true, [this, &reach](Position dependent_)
+                    {
+                        if (!IsOverridden(dependent_))
+                        {
+                            reach(dependent_);
+                        }
+                    });
+            }
+            if (through_spill_ && !spills.empty())
+            {
+                if (const auto spill = spills.find(pos_); spill != spills.end())
+                {
+                    ForEachDependentIn(spill->second, reach);
+                }
+            }
+        };
+
+    // cell_ depends on nothing yet, and its readers through a spill are those of its new area.
+    if (start)
+    {
+        reach_dependents(*start);
+    }
+    if (indirect)
+    {
+        reach_indirect(cell_, /* through_spill_ = */ false);
+    }
+    if (!(area.size == Size{ 1, 1 }))
+    {
+        ForEachDependentIn(area, reach);
+    }
+
+    while (!found && (!to_visit.empty() || !outside.empty()))
+    {
+        if (!outside.empty())
+        {
+            const Position current = outside.back();
+            outside.pop_back();
+            reach_indirect(current, /* through_spill_ = */ true);
+            continue;
+        }
+
+        const uint32_t current = to_visit.back();
+        to_visit.pop_back();
+        if (current >= node_count)
+        {
+            for (const NodeId dependent : range_nodes[current - node_count].dependents)
+            {
+                reach_node(dependent);
+            }
+            continue;
+        }
+
+        reach_dependents(current);
+        if (indirect)
+        {
+            reach_indirect(nodes[current].pos, /* through_spill_ = */ true);
+        }
+    }
+
+    return found;
+}
+
+void DependencyGraph::SetSpill(Position anchor_, Size size_)
+{
+    if (const auto it = spills.find(anchor_); it != spills.end())
+    {
+        const Range& area = it->second;
+        for (int col = area.top_left.col; col < area.top_left.col + area.size.cols; ++col)
+        {
+            const auto column = column_spills.find(col);
+            std::pmr::vector<Position>& list = column->second;
+            list.erase(std::find(list.begin(), list.end(), anchor_));
+            if (list.empty())
+            {
+                spill_bytes -= GetNodeBytes(column_spills) + GetListBytes(list);
+                column_spills.erase(column);
+            }
+        }
+        spill_bytes -= GetNodeBytes(spills);
+        spills.erase(it);
+    }
+
+    const Range area{ anchor_, size_ };
+    if (size_ == Size{ 1, 1 } || !area.IsValid())
+    {
+        return;
+    }
+    spills.emplace(anchor_, area);
+    spill_bytes += GetNodeBytes(spills);
+    for (int col = area.top_left.col; col < area.top_left.col + area.size.cols; ++col)
+    {
+        const auto [column, inserted] = column_spills.try_emplace(col);
+        std::pmr::vector<Position>& list = column->second;
+        spill_bytes -= GetListBytes(list);
+        list.push_back(anchor_);
+        spill_bytes += GetListBytes(list) + (inserted ? GetNodeBytes(column_spills) : 0);
+    }
+}
+
+Range DependencyGraph::GetSpill(Position anchor_) const
+{
+    const auto it = spills.find(anchor_);
+    return it == spills.end() ? Range{ anchor_, Size{ 1, 1 } } : it->second;
+}
+
+bool DependencyGraph::HasSpills() const
+{
+    return !spills.empty();
+}
+
+void DependencyGraph::Compact()
+{
+    // A node left without edges is dropped unless it reads ranges or hides its base edges.
+    for (NodeId id = 0; id < nodes.size(); ++id)
+    {
+        const Node& node = nodes[id];
+        if (node.overridden || node.references.size > 0 || node.dependents.size > 0 || cell_ranges.count(node.pos))
+        {
+            continue;
+        }
+        if (const auto it = ids.find(node.pos); it != ids.end() && it->second == id)
+        {
+            ids.erase(it);
+            free_nodes.push_back(id);
+        }
+    }
+    dead_nodes = 0;
+
+    std::pmr::vector<NodeId> packed(slab.get_allocator());
+    packed.reserve(slab.size() - garbage);
+
+    for (Node& node : nodes)
+    {
+        for (Span* span : { &node.references, &node.dependents })
+        {
+            const auto begin = slab.begin() + span->offset;
+            span->offset = static_cast<uint32_t>(packed.size());
+            span->capacity = span->size;
+            packed.insert(packed.end(), begin, begin + span->size);
+        }
+    }
+
+    slab = std::move(packed);
+    garbage = 0;
+}
+
+size_t DependencyGraph::GetMemoryUsage() const
+{
+    return ids.bucket_count() * sizeof(void*) + ids.size() * GetNodeBytes(ids)
+        + nodes.capacity() * sizeof(Node)
+        + slab.capacity() * sizeof(NodeId) + free_nodes.capacity() * sizeof(NodeId)
+        + range_nodes.capacity() * sizeof(RangeNode) + free_ranges.capacity() * sizeof(RangeId)
+        + column_ranges.bucket_count() * sizeof(void*) + cell_ranges.bucket_count() * sizeof(void*) + range_bytes
+        + spills.bucket_count() * sizeof(void*) + column_spills.bucket_count() * sizeof(void*) + spill_bytes
+        + visit_marks.capacity() * sizeof(uint32_t);
+}
+
+const DependencyGraph::NodeId* DependencyGraph::FindNode(Position cell_) const
+{
+    const auto it = ids.find(cell_);
+    return it == ids.end() ? nullptr : &it->second;
+}
+
+DependencyGraph::NodeId DependencyGraph::GetOrAddNode(Position cell_)
+{
+    const auto [it, inserted] = ids.try_emplace(cell_, free_nodes.empty() ? static_cast<NodeId>(nodes.size()) : free_nodes.back());
+    if (!inserted)
+    {
+        return it->second;
+    }
+
+    if (free_nodes.empty())
+    {
+        nodes.push_back(Node{ cell_, {}, {}, false });
+    }
+    else
+    {
+        nodes[it->second] = Node{ cell_, {}, {}, false };
+        free_nodes.pop_back();
+    }
+    return it->second;
+}
+
+bool DependencyGraph::IsOverridden(Position cell_) const
+{
+    const NodeId* id = FindNode(cell_);
+    return id && nodes[*id].overridden;
+}
+
+void DependencyGraph::VisitReaders(Position cell_, bool through_ranges_, const std::function<void(Position)>& action_) const
+{
+    ForEachReader(cell_, action_, through_ranges_);
+}
+
+void DependencyGraph::VisitReadersIn(const Range& range_, const std::function<void(Position)>& action_) const
+{
+    ForEachDependentIn(range_, action_);
+}
+
+void DependencyGraph::Append(Span& span_, NodeId id_)
+{
+    if (span_.size == span_.capacity)
+    {
+        const uint32_t capacity = std::max<uint32_t>(2, span_.capacity * 2);
+
+        if (span_.capacity > 0 && span_.offset + span_.capacity == slab.size())
+        {
+            slab.resize(span_.offset + capacity);
+        }
+        else
+        {
+            const auto offset = static_cast<uint32_t>(slab.size());
+            slab.resize(slab.size() + capacity);
+            std::copy_n(slab.begin() + span_.offset, span_.size, slab.begin() + offset);
+            garbage += span_.capacity;
+            span_.offset = offset;
+        }
+        span_.capacity = capacity;
+    }
+
+    slab[span_.offset + span_.size++] = id_;
+}
+
+void DependencyGraph::Remove(Span& span_, NodeId id_)
+{
+    const auto begin = slab.begin() + span_.offset;
+    const auto it = std::find(begin, begin + span_.size, id_);
+    if (it != begin + span_.size)
+    {
+        *it = slab[span_.offset + span_.size - 1];
+        --span_.size;
+    }
+}
+
+void DependencyGraph::SetRanges(Position cell_, NodeId id_, const std::vector<Range>& ranges_)
+{
+    const auto it = cell_ranges.find(cell_);
+    if (it != cell_ranges.end())
+    {
+        for (const RangeId id : it->second)
+        {
+            ReleaseRange(id, id_);
+        }
+        range_bytes -= GetNodeBytes(cell_ranges) + GetListBytes(it->second);
+        cell_ranges.erase(it);
+    }
+
+    if (!ranges_.empty())
+    {
+        std::pmr::vector<RangeId>& ids_read = cell_ranges[cell_];
+        for (const Range& range : ranges_)
+        {
+            ids_read.push_back(AcquireRange(range, id_));
+        }
+        range_bytes += GetNodeBytes(cell_ranges) + GetListBytes(ids_read);
+    }
+}
+
+DependencyGraph::RangeId DependencyGraph::AcquireRange(const Range& range_, NodeId dependent_)
+{
+    if (const auto column = column_ranges.find(range_.top_left.col); column != column_ranges.end())
+    {
+        for (const RangeId id : column->second)
+        {
+            if (range_nodes[id].range == range_)
+            {
+                std::pmr::vector<NodeId>& dependents = range_nodes[id].dependents;
+                range_bytes -= GetListBytes(dependents);
+                dependents.push_back(dependent_);
+                range_bytes += GetListBytes(dependents);
+                return id;
+            }
+        }
+    }
+
+    RangeId id = static_cast<RangeId>(range_nodes.size());
+    if (free_ranges.empty())
+    {
+        range_nodes.push_back(RangeNode{ range_, std::pmr::vector<NodeId>({ dependent_ }, range_nodes.get_allocator()) });
+    }
+    else
+    {
+        id = free_ranges.back();
+        free_ranges.pop_back();
+        range_bytes -= GetListBytes(range_nodes[id].dependents);
+        range_nodes[id] = RangeNode{ range_, std::pmr::vector<NodeId>({ dependent_ }, range_nodes.get_allocator()) };
+    }
+    range_bytes += GetListBytes(range_nodes[id].dependents);
+
+    for (int col = range_.top_left.col; col < range_.top_left.col + range_.size.cols; ++col)
+    {
+        const auto [column, inserted] = column_ranges.try_emplace(col);
+        std::pmr::vector<RangeId>& list = column->second;
+        range_bytes -= GetListBytes(list);
+        list.push_back(id);
+        range_bytes += GetListBytes(list) + (inserted ? GetNodeBytes(column_ranges) : 0);
+    }
+    ++live_ranges;
+    return id;
+}
+
+void DependencyGraph::ReleaseRange(RangeId id_, NodeId dependent_)
+{
+    RangeNode& node = range_nodes[id_];
+    const auto it = std::find(node.dependents.begin(), node.dependents.end(), dependent_);
+    if (it != node.dependents.end())
+    {
+        *it = node.dependents.back();
+        node.dependents.pop_back();
+    }
+    if (!node.dependents.empty())
+    {
+        return;
+    }
+
+    for (int col = node.range.top_left.col; col < node.range.top_left.col + node.range.size.cols; ++col)
+    {
+        const auto column = column_ranges.find(col);
+        std::pmr::vector<RangeId>& list = column->second;
+        list.erase(std::find(list.begin(), list.end(), id_));
+        if (list.empty())
+        {
+            range_bytes -= GetNodeBytes(column_ranges) + GetListBytes(list);
+            column_ranges.erase(column);
+        }
+    }
+    range_bytes -= GetListBytes(node.dependents);
+    node.dependents.shrink_to_fit();
+    range_bytes += GetListBytes(node.dependents);
+    free_ranges.push_back(id_);
+    --live_ranges;
+}
\ No newline at end of file
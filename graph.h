@@ -0,0 +1,300 @@
+#pragma once
+
+#include "common.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <memory_resource>
+#include <unordered_map>
+#include <vector>
+
+// Edges between cells, keyed by position. Every position that takes part in
+// an edge gets a dense node id, and the edge lists of all nodes are packed
+// into one slab of ids, so walking a node's neighbours is a scan over a
+// contiguous range. A list that outgrows its range moves to the end of the
+// slab; the slab is compacted once the abandoned ranges outweigh the live ones,
+// or once enough nodes have lost all their edges, whose ids are then reused.
+//
+// A cell can also read whole ranges. Each distinct range is one shared node
+// listed under every column it covers, so a cell finds the ranges holding it by
+// checking the ranges of its column rather than through an edge per cell of every range.
+//
+// An array formula spills its values into the area below and right of it. The area is
+// kept as a whole, listed under its columns like a range, and a cell reading any cell
+// of it depends on the formula through the area rather than through an edge per cell.
+//
+// A graph built on top of a base graph only stores the cells whose
+// references were set in this layer and sees the base edges of every other cell.
+class DependencyGraph
+{
+public:
+
+    explicit DependencyGraph(std::pmr::memory_resource* resource_ = std::pmr::get_default_resource());
+    DependencyGraph(const DependencyGraph* base_, std::pmr::memory_resource* resource_);
+
+    void SetReferences(Position cell_, const std::vector<Position>& references_, const std::vector<Range>& ranges_ = {});
+
+    // Visits the cells that reference cell_, and with through_ranges_ also those
+    // reading a range that holds it or, when cell_ spills, any cell of its area; a cell
+    // may come up more than once.
+    template <typename Action>
+    void ForEachDependent(Position cell_, Action&& action_, bool through_ranges_ = true) const;
+    // Visits the cells that reference a cell of range_ or read a range intersecting it,
+    // but not those reading the areas of formulas spilling from range_.
+    template <typename Action>
+    void ForEachDependentIn(const Range& range_, Action&& action_) const;
+
+    // Whether a cell references cell_ by itself, which keeps an empty cell_ in the sheet.
+    bool HasDependents(Position cell_) const;
+    // spill_ is the size of the area cell_ is to spill into.
+    bool WouldIntroduceCycle(Position cell_, const std::vector<Position>& references_, const std::vector<Range>& ranges_ = {}, Size spill_ = Size{ 1, 1 }) const;
+
+    // Sets the area the formula at anchor_ spills into to the size_ one from it; an area
+    // of one cell, or one running off the sheet, is none.
+    void SetSpill(Position anchor_, Size size_);
+    // Area anchor_ spills into, or just anchor_ when it has none.
+    Range GetSpill(Position anchor_) const;
+    bool HasSpills() const;
+    // Calls action_(anchor, area) once for every area intersecting range_.
+    template <typename Action>
+    void ForEachSpill(const Range& range_, Action&& action_) const;
+    // Calls action_(anchor, area) for every area of the graph.
+    template <typename Action>
+    void ForEachSpill(Action&& action_) const;
+
+    void Compact();
+
+    // Bytes reserved by the node index, the nodes and the edge slab of this layer.
+    size_t GetMemoryUsage() const;
+
+private:
+
+    using NodeId = uint32_t;
+    using RangeId = uint32_t;
+
+    struct Span
+    {
+        uint32_t offset = 0;
+        uint32_t size = 0;
+        uint32_t capacity = 0;
+    };
+
+    struct Node
+    {
+        Position pos;
+        Span references;
+        Span dependents;
+        bool overridden = false;
+    };
+
+    struct RangeNode
+    {
+        Range range;
+        std::pmr::vector<NodeId> dependents;
+    };
+
+    static const size_t MIN_COMPACTION_SLAB = 1024;
+    static const size_t MIN_COMPACTION_NODES = 1024;
+
+    const NodeId* FindNode(Position cell_) const;
+    NodeId GetOrAddNode(Position cell_);
+    bool IsOverridden(Position cell_) const;
+
+    // ForEachDependent without going through spill areas, which the top layer alone
+    // answers for, as it holds every area of the layers below.
+    template <typename Action>
+    void ForEachReader(Position cell_, Action&& action_, bool through_ranges_) const;
+    void VisitReaders(Position cell_, bool through_ranges_, const std::function<void(Position)>& action_) const;
+    void VisitReadersIn(const Range& range_, const std::function<void(Position)>& action_) const;
+
+    void Append(Span& span_, NodeId id_);
+    void Remove(Span& span_, NodeId id_);
+
+    void SetRanges(Position cell_, NodeId id_, const std::vector<Range>& ranges_);
+    RangeId AcquireRange(const Range& range_, NodeId dependent_);
+    void ReleaseRange(RangeId id_, NodeId dependent_);
+
+    const DependencyGraph* base = nullptr;
+    std::pmr::unordered_map<Position, NodeId, PositionHasher> ids;
+    std::pmr::vector<Node> nodes;
+    std::pmr::vector<NodeId> slab;
+    size_t garbage = 0;
+    // Ids of nodes dropped by Compact, and how many nodes lost their last edge since it ran.
+    std::pmr::vector<NodeId> free_nodes;
+    size_t dead_nodes = 0;
+
+    std::pmr::vector<RangeNode> range_nodes;
+    std::pmr::vector<RangeId> free_ranges;
+    size_t live_ranges = 0;
+    // Live ranges covering each column, and the ranges each cell reads.
+    std::pmr::unordered_map<int, std::pmr::vector<RangeId>> column_ranges;
+    std::pmr::unordered_map<Position, std::pmr::vector<RangeId>, PositionHasher> cell_ranges;
+    // Bytes of the lists of dependents and of the two maps above, kept as they grow and shrink.
+    size_t range_bytes = 0;
+
+    // Spill areas by anchor, and the anchors of the areas covering each column.
+    std::pmr::unordered_map<Position, Range, PositionHasher> spills;
+    std::pmr::unordered_map<int, std::pmr::vector<Position>> column_spills;
+    // Bytes of the entries of the two maps above and of the lists of anchors.
+    size_t spill_bytes = 0;
+
+    // Cycle search marks: cell nodes by id, then range nodes from nodes.size() on.
+    mutable std::pmr::vector<uint32_t> visit_marks;
+    mutable uint32_t visit_epoch = 0;
+};
+
+template <typename Action>
+void DependencyGraph::ForEachDependent(Position cell_, Action&& action_, bool through_ranges_) const
+{
+    ForEachReader(cell_, action_, through_ranges_);
+
+    if (through_ranges_ && !spills.empty())
+    {
+        if (const auto spill = spills.find(cell_); spill != spills.end())
+        {
+            ForEachDependentIn(spill->second, action_);
+        }
+    }
+}
+
+template <typename Action>
+void DependencyGraph::ForEachReader(Position cell_, Action&& action_, bool through_ranges_) const
+{
+    if (const NodeId* id = FindNode(cell_))
+    {
+        const Span& span = nodes[*id].dependents;
+        for (uint32_t i = 0; i < span.size; ++i)
+        {
+            action_(nodes[slab[span.offset + i]].pos);
+        }
+    }
+
+    if (through_ranges_)
+    {
+        if (const auto column = column_ranges.find(cell_.col); column != column_ranges.end())
+        {
+            for (const RangeId id : column->second)
+            {
+                if (range_nodes[id].range.Contains(cell_))
+                {
+                    for (const NodeId dependent : range_nodes[id].dependents)
+                    {
+                        action_(nodes[dependent].pos);
+                    }
+                }
+            }
+        }
+    }
+
+    if (base)
+    {
+        base->VisitReaders(cell_, through_ranges_, [this, &action_](Position dependent_)
+            {
+                if (!IsOverridden(dependent_))
+                {
+                    action_(dependent_);
+                }
+            });
+    }
+}
+
+template <typename Action>
+void DependencyGraph::ForEachDependentIn(const Range& range_, Action&& action_) const
+{
+    const auto visit_node = [this, &action_](NodeId id_)
+        {
+            const Span& span = nodes[id_].dependents;
+            for (uint32_t i = 0; i < span.size; ++i)
+            {
+                action_(nodes[slab[span.offset + i]].pos);
+            }
+        };
+
+    // Whichever is fewer is looked through: the cells of the range or the cells with a node.
+    if (range_.GetCellCount() <= ids.size())
+    {
+        for (int row = range_.top_left.row; row < range_.top_left.row + range_.size.rows; ++row)
+        {
+            for (int col = range_.top_left.col; col < range_.top_left.col + range_.size.cols; ++col)
+            {
+                if (const NodeId* id = FindNode(Position{ row, col }))
+                {
+                    visit_node(*id);
+                }
+            }
+        }
+    }
+    else
+    {
+        for (const auto& [pos, id] : ids)
+        {
+            if (range_.Contains(pos))
+            {
+                visit_node(id);
+            }
+        }
+    }
+
+    // A range over several columns is listed under each; it is taken in the first one both share.
+    for (int col = range_.top_left.col; col < range_.top_left.col + range_.size.cols; ++col)
+    {
+        const auto column = column_ranges.find(col);
+        if (column == column_ranges.end())
+        {
+            continue;
+        }
+        for (const RangeId id : column->second)
+        {
+            const Range& read = range_nodes[id].range;
+            if (read.Intersects(range_) && col == std::max(read.top_left.col, range_.top_left.col))
+            {
+                for (const NodeId dependent : range_nodes[id].dependents)
+                {
+                    action_(nodes[dependent].pos);
+                }
+            }
+        }
+    }
+
+    if (base)
+    {
+        base->VisitReadersIn(range_, [this, &action_](Position dependent_)
+            {
+                if (!IsOverridden(dependent_))
+                {
+                    action_(dependent_);
+                }
+            });
+    }
+}
+
+template <typename Action>
+void DependencyGraph::ForEachSpill(const Range& range_, Action&& action_) const
+{
+    for (int col = range_.top_left.col; col < range_.top_left.col + range_.size.cols && !spills.empty(); ++col)
+    {
+        const auto column = column_spills.find(col);
+        if (column == column_spills.end())
+        {
+            continue;
+        }
+        for (const Position& anchor : column->second)
+        {
+            const Range& area = spills.find(anchor)->second;
+            if (area.Intersects(range_) && col == std::max(area.top_left.col, range_.top_left.col))
+            {
+                action_(anchor, area);
+            }
+        }
+    }
+}
+
+template <typename Action>
+void DependencyGraph::ForEachSpill(Action&& action_) const
+{
+    for (const auto& [anchor, area] : spills)
+    {
+        action_(anchor, area);
+    }
+}
\ No newline at end of file
@@ -0,0 +1,379 @@
+#include "journal.h"
+
+#include "sheet.h"
+#include "varint.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <utility>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace
+{
+    const char MAGIC[] = { 'S', 'S', 'J', '1' };
+
+    // Whether size_ bytes reached the disk: a short write or a failed flush or fsync is false.
+    bool WriteFile(std::FILE* file_, const char* data_, size_t size_)
+    {
+        if (std::fwrite(data_, 1, size_, file_) != size_ || std::fflush(file_) != 0)
+        {
+            return false;
+        }
+#ifdef _WIN32
+        return _commit(_fileno(file_)) == 0;
+#else
+        return fsync(fileno(file_)) == 0;
+#endif
+    }
+
+    void EncodeRecord(std::vector<char>& out_, Journal::RecordType type_, Position pos_, std::string_view text_)
+    {
+        out_.push_back(static_cast<char>(type_));
+        PutVarint(out_, static_cast<uint32_t>(pos_.row));
+        PutVarint(out_, static_cast<uint32_t>(pos_.col));
+
+        if (type_ == Journal::RecordType::Set)
+        {
+            PutVarint(out_, static_cast<uint32_t>(text_.size()));
+            out_.insert(out_.end(), text_.begin(), text_.end());
+        }
+    }
+
+    void ReplayFile(const std::filesystem::path& file_, SheetInterface& sheet_)
+    {
+        std::ifstream in(file_, std::ios::binary);
+        if (!in)
+        {
+            return;
+        }
+
+        const std::vector<char> data{ std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>() };
+        if (data.size() < sizeof(MAGIC) || !std::equal(std::begin(MAGIC), std::end(MAGIC), data.begin()))
+        {
+            return;
+        }
+
+        const char* it = data.data() + sizeof(MAGIC);
+        const char* end = data.data() + data.size();
+
+        // A torn record at the tail means the process died mid-write; everything before it is intact.
+        while (it != end)
+        {
+            const auto type = static_cast<Journal::RecordType>(*it++);
+            uint32_t row = 0;
+            uint32_t col = 0;
+            if (!GetVarint(it, end, row) || !GetVarint(it, end, col))
+            {
+                return;
+            }
+
+            const Position pos{ static_cast<int>(row), static_cast<int>(col) };
+            try
+            {
+                if (type == Journal::RecordType::Set)
+                {
+                    uint32_t size = 0;
+                    if (!GetVarint(it, end, size) || static_cast<size_t>(end - it) < size)
+                    {
+                        return;
+                    }
+                    sheet_.SetCell(pos, std::string(it, size));
+                    it += size;
+                }
+                else if (type == Journal::RecordType::Clear)
+                {
+                    sheet_.ClearCell(pos);
+                }
+                else
+                {
+                    return;
+                }
+            }
+            catch (const CircularDependencyException&)
+            {
+                // Segments folded into a checkpoint may be replayed twice after a crash;
+                // an intermediate state can then reject an edit the final state does not need.
+            }
+        }
+    }
+}  // namespace
+
+Journal::Journal(std::string path_, size_t group_bytes_, std::chrono::microseconds group_window_) : path(std::move(path_)), group_bytes(group_bytes_), group_window(group_window_)
+{
+    OpenSegment();
+    flusher = std::thread([this] { FlushLoop(); });
+}
+
+Journal::~Journal()
+{
+    if (compactor.joinable())
+    {
+        compactor.join();
+    }
+    {
+        std::lock_guard lock(mutex);
+        stopping = true;
+    }
+    flush_cv.notify_one();
+    flusher.join();
+
+    if (segment)
+    {
+        std::fclose(segment);
+    }
+}
+
+void Journal::AppendSet(Position pos_, std::string_view text_)
+{
+    Append(RecordType::Set, pos_, text_);
+}
+
+void Journal::AppendClear(Position pos_)
+{
+    Append(RecordType::Clear, pos_, {});
+}
+
+void Journal::Append(RecordType type_, Position pos_, std::string_view text_)
+{
+    std::lock_guard lock(mutex);
+    EncodeRecord(pending, type_, pos_, text_);
+    ++appended_seq;
+
+    if (pending.size() >= group_bytes)
+    {
+        flush_cv.notify_one();
+    }
+}
+
+void Journal::Sync()
+{
+    std::unique_lock lock(mutex);
+    const uint64_t target = appended_seq;
+    sync_requested = true;
+    flush_cv.notify_one();
+    durable_cv.wait(lock, [&] { return durable_seq >= target || failure; });
+    if (durable_seq < target)
+    {
+        std::rethrow_exception(failure);
+    }
+}
+
+void Journal::FlushLoop()
+{
+    std::unique_lock lock(mutex);
+    while (true)
+    {
+        flush_cv.wait(lock, [this] { return stopping || (!pending.empty() && !rotating && !failure); });
+        flush_cv.wait_for(lock, group_window, [this] { return stopping || sync_requested || pending.size() >= group_bytes; });
+
+        if (stopping && (pending.empty() || failure))
+        {
+            return;
+        }
+
+        // Lock order is file_mutex, then mutex, so a batch taken here cannot be overtaken by a compaction.
+        lock.unlock();
+        std::lock_guard file_lock(file_mutex);
+        lock.lock();
+        // Records appended since a compaction cut the segment belong to the next one.
+        if (rotating || failure)
+        {
+            continue;
+        }
+
+        std::vector<char> batch;
+        batch.swap(pending);
+        const uint64_t batch_seq = appended_seq;
+        sync_requested = false;
+
+        lock.unlock();
+        const bool written = WriteBatch(batch);
+        lock.lock();
+
+        if (written)
+        {
+            durable_seq = std::max(durable_seq, batch_seq);
+        }
+        else
+        {
+            failure = std::make_exception_ptr(std::runtime_error("Cannot write journal " + path));
+        }
+        durable_cv.notify_all();
+    }
+}
+
+bool Journal::WriteBatch(const std::vector<char>& batch_)
+{
+    return batch_.empty() || WriteFile(segment, batch_.data(), batch_.size());
+}
+
+void Journal::OpenSegment()
+{
+    segment = std::fopen((path + ".wal").c_str(), "ab");
+    if (!segment)
+    {
+        throw std::runtime_error("Cannot open journal " + path);
+    }
+
+    std::fseek(segment, 0, SEEK_END);
+    if (std::ftell(segment) == 0 && !WriteFile(segment, MAGIC, sizeof(MAGIC)))
+    {
+        std::fclose(segment);
+        segment = nullptr;
+        throw std::runtime_error("Cannot write journal " + path);
+    }
+}
+
+void Journal::RetireSegment()
+{
+    const std::string current = path + ".wal";
+    const std::string retired = path + ".wal.old";
+
+    if (!std::filesystem::exists(retired))
+    {
+        std::filesystem::rename(current, retired);
+        return;
+    }
+
+    // A previous compaction did not finish, so the retired segment is still needed: extend it instead.
+    std::ifstream in(current, std::ios::binary);
+    in.seekg(sizeof(MAGIC));
+    const std::vector<char> tail{ std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>() };
+    in.close();
+
+    std::FILE* file = std::fopen(retired.c_str(), "ab");
+    if (!file)
+    {
+        throw std::runtime_error("Cannot open journal " + retired);
+    }
+    const bool written = WriteFile(file, tail.data(), tail.size());
+    std::fclose(file);
+    if (!written)
+    {
+        throw std::runtime_error("Cannot write journal " + retired);
+    }
+
+    std::filesystem::remove(current);
+}
+
+void Journal::CompactAsync(const Sheet& sheet_)
+{
+    WaitForCompaction();
+
+    // The cells are copied as they are now, sharing parsed formulas, and written out by the
+    // compactor; the segment is cut at the same point, so the checkpoint replaces it exactly.
+    std::vector<std::pair<Position, Cell>> cells;
+    sheet_.ForEachCell([&cells, &sheet_](Position pos_, const Cell& cell_)
+        {
+            cells.emplace_back(pos_, Cell(cell_, sheet_));
+        });
+
+    std::vector<char> batch;
+    uint64_t batch_seq = 0;
+    {
+        std::lock_guard lock(mutex);
+        batch.swap(pending);
+        batch_seq = appended_seq;
+        rotating = true;
+    }
+
+    compactor = std::thread([this, cells = std::move(cells), batch = std::move(batch), batch_seq]() mutable
+        {
+            try
+            {
+                Rotate(batch, batch_seq);
+            }
+            catch (const std::exception&)
+            {
+                std::lock_guard lock(mutex);
+                failure = std::current_exception();
+                rotating = false;
+                durable_cv.notify_all();
+                return;
+            }
+
+            std::vector<char> image(std::begin(MAGIC), std::end(MAGIC));
+            for (const auto& [pos, cell] : cells)
+            {
+                EncodeRecord(image, RecordType::Set, pos, cell.GetText());
+            }
+            cells.clear();
+            WriteCheckpoint(image);
+        });
+}
+
+// Writes the records taken before the cut to the current segment, retires it and starts a
+// new one, which the flusher holds off writing to until then.
+void Journal::Rotate(const std::vector<char>& batch_, uint64_t batch_seq_)
+{
+    {
+        std::lock_guard file_lock(file_mutex);
+        if (!WriteBatch(batch_))
+        {
+            throw std::runtime_error("Cannot write journal " + path);
+        }
+        std::fclose(segment);
+        segment = nullptr;
+        RetireSegment();
+        OpenSegment();
+    }
+
+    std::lock_guard lock(mutex);
+    durable_seq = std::max(durable_seq, batch_seq_);
+    rotating = false;
+    durable_cv.notify_all();
+    flush_cv.notify_one();
+}
+
+// The retired segment is only dropped once the checkpoint replacing it is on disk.
+void Journal::WriteCheckpoint(const std::vector<char>& image_)
+{
+    const std::string tmp = path + ".ckpt.tmp";
+    std::FILE* file = std::fopen(tmp.c_str(), "wb");
+    bool written = file && WriteFile(file, image_.data(), image_.size());
+    if (file)
+    {
+        written = std::fclose(file) == 0 && written;
+    }
+
+    std::error_code ec;
+    if (!written)
+    {
+        std::filesystem::remove(tmp, ec);
+        compaction_failure = std::make_exception_ptr(std::runtime_error("Cannot write checkpoint " + tmp));
+        return;
+    }
+    std::filesystem::rename(tmp, path + ".ckpt", ec);
+    if (ec)
+    {
+        compaction_failure = std::make_exception_ptr(std::runtime_error("Cannot write checkpoint " + path + ".ckpt"));
+        return;
+    }
+    std::filesystem::remove(path + ".wal.old", ec);
+}
+
+void Journal::WaitForCompaction()
+{
+    if (compactor.joinable())
+    {
+        compactor.join();
+    }
+    if (compaction_failure)
+    {
+        std::rethrow_exception(std::exchange(compaction_failure, nullptr));
+    }
+}
+
+void Journal::Replay(const std::string& path_, SheetInterface& sheet_)
+{
+    ReplayFile(path_ + ".ckpt", sheet_);
+    ReplayFile(path_ + ".wal.old", sheet_);
+    ReplayFile(path_ + ".wal", sheet_);
+}
\ No newline at end of file
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "common.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+class Sheet;
+
+// Append-only log of sheet mutations. Records are buffered in memory and
+// written by a background thread in groups, one fsync per group. Sync()
+// blocks until everything appended so far is durable. Once a write or fsync
+// fails nothing more is written, and Sync() throws the failure.
+//
+// On-disk layout for a journal at <path>:
+//   <path>.ckpt     - last checkpoint, all cell texts as Set records
+//   <path>.wal.old  - segment being folded into a new checkpoint
+//   <path>.wal      - current segment
+class Journal
+{
+public:
+
+    enum class RecordType : uint8_t
+    {
+        Set = 1,
+        Clear = 2,
+    };
+
+    explicit Journal(std::string path_, size_t group_bytes_ = 64 * 1024, std::chrono::microseconds group_window_ = std::chrono::microseconds(1000));
+    ~Journal();
+
+    Journal(const Journal&) = delete;
+    Journal& operator=(const Journal&) = delete;
+
+    void AppendSet(Position pos_, std::string_view text_);
+    void AppendClear(Position pos_);
+
+    void Sync();
+
+    // Folds the journal into a checkpoint of sheet_ on a background thread. The cells are
+    // copied here, sharing parsed formulas; rendering them, cutting the segment and writing
+    // the checkpoint are left to the compactor. WaitForCompaction rethrows a checkpoint that
+    // could not be written, in which case the retired segment is kept.
+    void CompactAsync(const Sheet& sheet_);
+    void WaitForCompaction();
+
+    static void Replay(const std::string& path_, SheetInterface& sheet_);
+
+private:
+
+    void Append(RecordType type_, Position pos_, std::string_view text_);
+    void FlushLoop();
+    bool WriteBatch(const std::vector<char>& batch_);
+    void OpenSegment();
+    void RetireSegment();
+    void Rotate(const std::vector<char>& batch_, uint64_t batch_seq_);
+    void WriteCheckpoint(const std::vector<char>& image_);
+
+    std::string path;
+    size_t group_bytes;
+    std::chrono::microseconds group_window;
+
+    std::mutex mutex;
+    std::condition_variable flush_cv;
+    std::condition_variable durable_cv;
+    std::vector<char> pending;
+    uint64_t appended_seq = 0;
+    uint64_t durable_seq = 0;
+    bool sync_requested = false;
+    bool stopping = false;
+    // Set from a compaction cutting the segment until the next one is open.
+    bool rotating = false;
+    std::exception_ptr failure;
+
+    std::mutex file_mutex;
+    std::FILE* segment = nullptr;
+
+    std::thread flusher;
+    std::thread compactor;
+    std::exception_ptr compaction_failure;
+};
\ No newline at end of file
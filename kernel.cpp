@@ -0,0 +1,160 @@
+#include "kernel.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+namespace
+{
+    // Writes operation_(lhs_[i], rhs_[i]) over lhs_ and flags the lanes it takes out of the
+    // finite range. The flag is !std::isfinite spelled as a compare, which vectorizes.
+    template <typename Operation>
+    void Combine(double* lhs_, const double* rhs_, size_t lanes_, uint8_t* failed_, Operation operation_)
+    {
+        for (size_t i = 0; i < lanes_; ++i)
+        {
+            const double result = operation_(lhs_[i], rhs_[i]);
+            lhs_[i] = result;
+            failed_[i] |= static_cast<uint8_t>(!(std::abs(result) <= std::numeric_limits<double>::max()));
+        }
+    }
+}  // namespace
+
+bool ColumnKernel::Input::operator==(const Input& other_) const
+{
+    return col == other_.col && row_offset == other_.row_offset;
+}
+
+bool ColumnKernel::Step::operator==(const Step& other_) const
+{
+    return op == other_.op && operand == other_.operand;
+}
+
+void ColumnKernel::Clear()
+{
+    steps.clear();
+    inputs.clear();
+    constants.clear();
+    depth = 0;
+    max_depth = 0;
+}
+
+void ColumnKernel::PushInput(int col_, int row_offset_)
+{
+    Push(Op::Load, static_cast<uint32_t>(inputs.size()), 1);
+    inputs.push_back(Input{ col_, row_offset_ });
+}
+
+void ColumnKernel::PushConstant(double value_)
+{
+    Push(Op::Constant, static_cast<uint32_t>(constants.size()), 1);
+    constants.push_back(value_);
+}
+
+void ColumnKernel::PushBinary(char operation_)
+{
+    switch (operation_)
+    {
+    case '+':
+        Push(Op::Add, 0, -1);
+        break;
+
+    case '-':
+        Push(Op::Subtract, 0, -1);
+        break;
+
+    case '*':
+        Push(Op::Multiply, 0, -1);
+        break;
+
+    case '/':
+        Push(Op::Divide, 0, -1);
+        break;
+    }
+}
+
+void ColumnKernel::PushNegate()
+{
+    Push(Op::Negate, 0, 0);
+}
+
+const std::vector<ColumnKernel::Input>& ColumnKernel::GetInputs() const
+{
+    return inputs;
+}
+
+// Constants compare bitwise: 0 and -0 give different sums.
+bool ColumnKernel::operator==(const ColumnKernel& other_) const
+{
+    return steps == other_.steps && inputs == other_.inputs && constants.size() == other_.constants.size()
+        && (constants.empty() || std::memcmp(constants.data(), other_.constants.data(), constants.size() * sizeof(double)) == 0);
+}
+
+void ColumnKernel::Run(const std::vector<const double*>& inputs_, size_t count_, double* results_, uint8_t* failed_) const
+{
+    std::vector<double> stack(static_cast<size_t>(max_depth) * BLOCK);
+
+    for (size_t begin = 0; begin < count_; begin += BLOCK)
+    {
+        const size_t lanes = count_ - begin < BLOCK ? count_ - begin : BLOCK;
+        uint8_t* failed = failed_ + begin;
+        double* top = stack.data();
+
+        for (const Step& step : steps)
+        {
+            switch (step.op)
+            {
+            case Op::Load:
+                std::copy_n(inputs_[step.operand] + begin, lanes, top);
+                top += BLOCK;
+                break;
+
+            case Op::Constant:
+                std::fill_n(top, lanes, constants[step.operand]);
+                top += BLOCK;
+                break;
+
+            case Op::Add:
+                top -= BLOCK;
+                Combine(top - BLOCK, top, lanes, failed, [](double lhs_, double rhs_) { return lhs_ + rhs_; });
+                break;
+
+            case Op::Subtract:
+                top -= BLOCK;
+                Combine(top - BLOCK, top, lanes, failed, [](double lhs_, double rhs_) { return lhs_ - rhs_; });
+                break;
+
+            case Op::Multiply:
+                top -= BLOCK;
+                Combine(top - BLOCK, top, lanes, failed, [](double lhs_, double rhs_) { return lhs_ * rhs_; });
+                break;
+
+            case Op::Divide:
+                top -= BLOCK;
+                Combine(top - BLOCK, top, lanes, failed, [](double lhs_, double rhs_) { return lhs_ / rhs_; });
+                break;
+
+            case Op::Negate:
+            {
+                // Multiplied like the scalar unary minus, which keeps the sign of zero the same way.
+                double* operand = top - BLOCK;
+                for (size_t i = 0; i < lanes; ++i)
+                {
+                    operand[i] = -1 * operand[i];
+                }
+                break;
+            }
+            }
+        }
+
+        std::copy_n(stack.data(), lanes, results_ + begin);
+    }
+}
+
+void ColumnKernel::Push(Op op_, uint32_t operand_, int depth_change_)
+{
+    steps.push_back(Step{ op_, operand_ });
+    depth += depth_change_;
+    max_depth = std::max(max_depth, depth);
+}
\ No newline at end of file
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// A formula of plain arithmetic over cells and numbers, compiled relative to the
+// row it sits in, so the copies of a formula filled down a column compile to
+// equal kernels. A kernel evaluates a run of such formulas at once, one lane per
+// row: step by step over dense blocks of lanes, in loops the compiler can
+// vectorize. Each lane goes through the operations of the scalar evaluation in
+// the same order, so it gets the same bits.
+class ColumnKernel
+{
+public:
+
+    // A cell the kernel reads: its column and its row relative to the formula's.
+    struct Input
+    {
+        int col = 0;
+        int row_offset = 0;
+
+        bool operator==(const Input& other_) const;
+    };
+
+    // Steps are pushed in evaluation order, operands before the operation on them.
+    void Clear();
+    void PushInput(int col_, int row_offset_);
+    void PushConstant(double value_);
+    // One of '+', '-', '*' and '/'.
+    void PushBinary(char operation_);
+    void PushNegate();
+
+    const std::vector<Input>& GetInputs() const;
+    bool operator==(const ColumnKernel& other_) const;
+
+    // Evaluates count_ lanes into results_, where inputs_[k] holds input k of every lane.
+    // A lane whose value leaves the finite range at any operation, where the formula
+    // would fail, is flagged in failed_ and its result is meaningless.
+    void Run(const std::vector<const double*>& inputs_, size_t count_, double* results_, uint8_t* failed_) const;
+
+private:
+
+    enum class Op : uint8_t
+    {
+        Load,
+        Constant,
+        Add,
+        Subtract,
+        Multiply,
+        Divide,
+        Negate,
+    };
+
+    struct Step
+    {
+        Op op;
+        uint32_t operand;
+
+        bool operator==(const Step& other_) const;
+    };
+
+    // Lanes evaluated together, sized so the operand stack stays in cache.
+    static const size_t BLOCK = 256;
+
+    void Push(Op op_, uint32_t operand_, int depth_change_);
+
+    std::vector<Step> steps;
+    std::vector<Input> inputs;
+    std::vector<double> constants;
+    int depth = 0;
+    int max_depth = 0;
+};
\ No newline at end of file
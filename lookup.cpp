@@ -0,0 +1,539 @@
+#include "lookup.h"
+
+#include <algorithm>
+#include <climits>
+#include <iterator>
+#include <string_view>
+#include <type_traits>
+
+namespace
+{
+    bool InRows(int row_, int first_row_, int last_row_)
+    {
+        return row_ >= first_row_ && row_ <= last_row_;
+    }
+
+    // Lookups over one ordered set of (key, row) pairs. Ordered searches walk from the
+    // best key outwards and stop at the first row inside the queried rows, or give up
+    // with nullopt after passing max_walk_ rows outside them.
+    template <typename Set, typename Key>
+    std::optional<int> FindIn(const Set& set_, Key key_, int first_row_, int last_row_, LookupMode mode_, int max_walk_ = INT_MAX)
+    {
+        using Entry = std::pair<Key, int>;
+
+        switch (mode_)
+        {
+        case LookupMode::Exact:
+        {
+            const auto it = set_.lower_bound(Entry{ key_, first_row_ });
+            return it != set_.end() && it->first == key_ && it->second <= last_row_ ? it->second : -1;
+        }
+
+        case LookupMode::LessOrEqual:
+            for (auto it = set_.upper_bound(Entry{ key_, INT_MAX }); it != set_.begin(); --max_walk_)
+            {
+                --it;
+                if (InRows(it->second, first_row_, last_row_))
+                {
+                    return it->second;
+                }
+                if (max_walk_ == 0)
+                {
+                    return std::nullopt;
+                }
+            }
+            return -1;
+
+        case LookupMode::GreaterOrEqual:
+            for (auto it = set_.lower_bound(Entry{ key_, INT_MIN }); it != set_.end(); ++it, --max_walk_)
+            {
+                if (InRows(it->second, first_row_, last_row_))
+                {
+                    return it->second;
+                }
+                if (max_walk_ == 0)
+                {
+                    return std::nullopt;
+                }
+            }
+            return -1;
+        }
+        return -1;
+    }
+
+    // Best (key, row) of a whole set for an ordered search: the greatest pair not above
+    // key_ for LessOrEqual, the least pair not below it for GreaterOrEqual.
+    template <typename Set, typename Key>
+    std::optional<std::pair<Key, int>> FindBest(const Set& set_, Key key_, LookupMode mode_)
+    {
+        using Entry = std::pair<Key, int>;
+
+        if (mode_ == LookupMode::LessOrEqual)
+        {
+            const auto it = set_.upper_bound(Entry{ key_, INT_MAX });
+            if (it == set_.begin())
+            {
+                return std::nullopt;
+            }
+            return Entry{ std::prev(it)->first, std::prev(it)->second };
+        }
+
+        const auto it = set_.lower_bound(Entry{ key_, INT_MIN });
+        if (it == set_.end())
+        {
+            return std::nullopt;
+        }
+        return Entry{ it->first, it->second };
+    }
+
+    // Keeps whichever of best_ and found_ FindBest would pick.
+    template <typename Key>
+    void KeepBest(std::optional<std::pair<Key, int>>& best_, const std::optional<std::pair<Key, int>>& found_, LookupMode mode_)
+    {
+        if (found_ && (!best_ || (mode_ == LookupMode::LessOrEqual ? *best_ < *found_ : *found_ < *best_)))
+        {
+            best_ = found_;
+        }
+    }
+
+    // A tree node holds its value next to three links and a colour; a hash node next to one link.
+    template <typename Set>
+    size_t GetTreeNodeBytes(const Set& /* set */)
+    {
+        return sizeof(typename Set::value_type) + 4 * sizeof(void*);
+    }
+
+    template <typename Map>
+    size_t GetHashNodeBytes(const Map& /* map */)
+    {
+        return sizeof(typename Map::value_type) + sizeof(void*);
+    }
+
+    size_t GetHeapBytes(const std::pmr::string& text_)
+    {
+        static const size_t inline_capacity = std::pmr::string().capacity();
+        return text_.capacity() > inline_capacity ? text_.capacity() + 1 : 0;
+    }
+
+    template <typename Iterator>
+    size_t CountRows(Iterator begin_, Iterator end_, int first_row_, int last_row_)
+    {
+        size_t result = 0;
+        for (; begin_ != end_; ++begin_)
+        {
+            result += InRows(begin_->second, first_row_, last_row_) ? 1 : 0;
+        }
+        return result;
+    }
+
+    template <typename Set, typename Key>
+    size_t CountIn(const Set& set_, Key key_, int first_row_, int last_row_, LookupCriterion::Comparison comparison_)
+    {
+        using Entry = std::pair<Key, int>;
+        using Comparison = LookupCriterion::Comparison;
+
+        switch (comparison_)
+        {
+        case Comparison::Equal:
+        case Comparison::NotEqual:
+        {
+            size_t equal = 0;
+            for (auto it = set_.lower_bound(Entry{ key_, first_row_ }); it != set_.end() && it->first == key_ && it->second <= last_row_; ++it)
+            {
+                ++equal;
+            }
+            return comparison_ == Comparison::Equal ? equal : static_cast<size_t>(last_row_ - first_row_ + 1) - equal;
+        }
+
+        case Comparison::Less:
+            return CountRows(set_.begin(), set_.lower_bound(Entry{ key_, INT_MIN }), first_row_, last_row_);
+
+        case Comparison::LessOrEqual:
+            return CountRows(set_.begin(), set_.upper_bound(Entry{ key_, INT_MAX }), first_row_, last_row_);
+
+        case Comparison::Greater:
+            return CountRows(set_.upper_bound(Entry{ key_, INT_MAX }), set_.end(), first_row_, last_row_);
+
+        case Comparison::GreaterOrEqual:
+            return CountRows(set_.lower_bound(Entry{ key_, INT_MIN }), set_.end(), first_row_, last_row_);
+        }
+        return 0;
+    }
+}  // namespace
+
+std::optional<LookupKey> GetLookupKey(const CellInterface::ValueView& value_)
+{
+    if (const double* number = std::get_if<double>(&value_))
+    {
+        return *number;
+    }
+    if (const std::string_view* text = std::get_if<std::string_view>(&value_); text && !text->empty())
+    {
+        if (double number = 0; ParseCanonicalNumber(*text, number))
+        {
+            return number;
+        }
+        return *text;
+    }
+    return std::nullopt;
+}
+
+bool Matches(const std::optional<LookupKey>& key_, const LookupCriterion& criterion_)
+{
+    using Comparison = LookupCriterion::Comparison;
+
+    const bool comparable = key_ && key_->index() == criterion_.key.index();
+    switch (criterion_.comparison)
+    {
+    case Comparison::Equal:
+        return comparable && *key_ == criterion_.key;
+
+    case Comparison::NotEqual:
+        return !comparable || *key_ != criterion_.key;
+
+    case Comparison::Less:
+        return comparable && *key_ < criterion_.key;
+
+    case Comparison::LessOrEqual:
+        return comparable && *key_ <= criterion_.key;
+
+    case Comparison::Greater:
+        return comparable && *key_ > criterion_.key;
+
+    case Comparison::GreaterOrEqual:
+        return comparable && *key_ >= criterion_.key;
+    }
+    return false;
+}
+
+int SheetInterface::FindInColumn(Range column_, LookupKey key_, LookupMode mode_) const
+{
+    int found = -1;
+    std::optional<LookupKey> found_key;
+
+    for (int row = column_.top_left.row; row < column_.top_left.row + column_.size.rows; ++row)
+    {
+        const std::optional<LookupKey> key = GetLookupKey(GetValueView(Position{ row, column_.top_left.col }));
+        if (!key || key->index() != key_.index())
+        {
+            continue;
+        }
+
+        switch (mode_)
+        {
+        case LookupMode::Exact:
+            if (*key == key_)
+            {
+                return row;
+            }
+            break;
+
+        case LookupMode::LessOrEqual:
+            if (*key <= key_ && (!found_key || *key >= *found_key))
+            {
+                found = row;
+                found_key = key;
+            }
+            break;
+
+        case LookupMode::GreaterOrEqual:
+            if (*key >= key_ && (!found_key || *key < *found_key))
+            {
+                found = row;
+                found_key = key;
+            }
+            break;
+        }
+    }
+    return found;
+}
+
+size_t SheetInterface::CountIf(Range range_, const LookupCriterion& criterion_) const
+{
+    size_t result = 0;
+    for (int row = range_.top_left.row; row < range_.top_left.row + range_.size.rows; ++row)
+    {
+        for (int col = range_.top_left.col; col < range_.top_left.col + range_.size.cols; ++col)
+        {
+            result += Matches(GetLookupKey(GetValueView(Position{ row, col })), criterion_) ? 1 : 0;
+        }
+    }
+    return result;
+}
+
+ColumnIndex::ColumnIndex(const SheetInterface& sheet_, int col_, size_t& usage_, std::pmr::memory_resource* resource_) : sheet(sheet_), col(col_), usage(usage_), numbers(resource_), texts(resource_), filed(resource_), stale(resource_), nodes(resource_) {}
+
+void ColumnIndex::MarkStale(int row_)
+{
+    if (stale.insert(row_).second)
+    {
+        usage += GetTreeNodeBytes(stale);
+    }
+}
+
+int ColumnIndex::Find(int first_row_, int last_row_, LookupKey key_, LookupMode mode_)
+{
+    Refresh(first_row_, last_row_);
+    if (const double* number = std::get_if<double>(&key_))
+    {
+        return Find(first_row_, last_row_, *number, mode_);
+    }
+    return Find(first_row_, last_row_, std::get<std::string_view>(key_), mode_);
+}
+
+size_t ColumnIndex::Count(int first_row_, int last_row_, const LookupCriterion& criterion_)
+{
+    Refresh(first_row_, last_row_);
+    if (const double* number = std::get_if<double>(&criterion_.key))
+    {
+        return CountIn(numbers, *number, first_row_, last_row_, criterion_.comparison);
+    }
+    return CountIn(texts, std::get<std::string_view>(criterion_.key), first_row_, last_row_, criterion_.comparison);
+}
+
+void ColumnIndex::Refresh(int first_row_, int last_row_)
+{
+    for (auto it = stale.lower_bound(first_row_); it != stale.end() && *it <= last_row_; it = stale.lower_bound(first_row_))
+    {
+        const int row = *it;
+        stale.erase(it);
+        usage -= GetTreeNodeBytes(stale);
+        Unfile(row);
+
+        if (const std::optional<LookupKey> key = GetLookupKey(sheet.GetValueView(Position{ row, col })))
+        {
+            File(row, *key);
+        }
+    }
+}
+
+void ColumnIndex::File(int row_, LookupKey key_)
+{
+    const size_t buckets = filed.bucket_count();
+    if (const double* number = std::get_if<double>(&key_))
+    {
+        numbers.emplace(*number, row_);
+        filed.emplace(row_, *number);
+        usage += GetTreeNodeBytes(numbers);
+        ForEachNode(row_, [this, number, row_](Node& node_)
+            {
+                node_.numbers.emplace(*number, row_);
+                usage += GetTreeNodeBytes(node_.numbers);
+            });
+    }
+    else
+    {
+        const std::string_view text = std::get<std::string_view>(key_);
+        const std::pmr::string& ordered_text = texts.emplace(text, row_).first->first;
+        const std::pmr::string& filed_text = std::get<std::pmr::string>(filed.emplace(row_, std::pmr::string(text, filed.get_allocator().resource())).first->second);
+        usage += GetTreeNodeBytes(texts) + GetHeapBytes(ordered_text) + GetHeapBytes(filed_text);
+        ForEachNode(row_, [this, &filed_text, row_](Node& node_)
+            {
+                node_.texts.emplace(filed_text, row_);
+                usage += GetTreeNodeBytes(node_.texts);
+            });
+    }
+    // Buckets are not given back when rows are unfiled.
+    usage += GetHashNodeBytes(filed) + (filed.bucket_count() - buckets) * sizeof(void*);
+}
+
+void ColumnIndex::Unfile(int row_)
+{
+    const auto it = filed.find(row_);
+    if (it == filed.end())
+    {
+        return;
+    }
+
+    if (const double* number = std::get_if<double>(&it->second))
+    {
+        ForEachNode(row_, [this, number, row_](Node& node_)
+            {
+                node_.numbers.erase({ *number, row_ });
+                usage -= GetTreeNodeBytes(node_.numbers);
+            });
+        numbers.erase({ *number, row_ });
+        usage -= GetTreeNodeBytes(numbers);
+    }
+    else
+    {
+        const std::pmr::string& filed_text = std::get<std::pmr::string>(it->second);
+        const std::string_view text = filed_text;
+        ForEachNode(row_, [this, text, row_](Node& node_)
+            {
+                node_.texts.erase({ text, row_ });
+                usage -= GetTreeNodeBytes(node_.texts);
+            });
+        const auto ordered = texts.find(std::pair{ text, row_ });
+        usage -= GetTreeNodeBytes(texts) + GetHeapBytes(ordered->first) + GetHeapBytes(filed_text);
+        texts.erase(ordered);
+    }
+    usage -= GetHashNodeBytes(filed);
+    filed.erase(it);
+}
+
+template <typename Key>
+int ColumnIndex::Find(int first_row_, int last_row_, Key key_, LookupMode mode_)
+{
+    std::optional<int> row;
+    if constexpr (std::is_same_v<Key, double>)
+    {
+        row = FindIn(numbers, key_, first_row_, last_row_, mode_, MAX_WALK);
+    }
+    else
+    {
+        row = FindIn(texts, key_, first_row_, last_row_, mode_, MAX_WALK);
+    }
+    if (row)
+    {
+        return *row;
+    }
+
+    std::optional<std::pair<Key, int>> best;
+    FindInTree(1, 0, Position::MAX_ROWS - 1, first_row_, last_row_, key_, mode_, best);
+    return best ? best->second : -1;
+}
+
+template <typename Key>
+void ColumnIndex::FindInTree(int node_, int lo_, int hi_, int first_row_, int last_row_, Key key_, LookupMode mode_, std::optional<std::pair<Key, int>>& best_)
+{
+    if (hi_ < first_row_ || lo_ > last_row_)
+    {
+        return;
+    }
+
+    const auto search = [key_, mode_, &best_](const auto& numbers_, const auto& texts_)
+        {
+            if constexpr (std::is_same_v<Key, double>)
+            {
+                KeepBest(best_, FindBest(numbers_, key_, mode_), mode_);
+            }
+            else
+            {
+                KeepBest(best_, FindBest(texts_, key_, mode_), mode_);
+            }
+        };
+    const auto read = [key_, mode_, &best_](int row_, const FiledKey& filed_)
+        {
+            std::optional<Key> key;
+            if constexpr (std::is_same_v<Key, double>)
+            {
+                if (const double* number = std::get_if<double>(&filed_))
+                {
+                    key = *number;
+                }
+            }
+            else if (const std::pmr::string* text = std::get_if<std::pmr::string>(&filed_))
+            {
+                key = *text;
+            }
+            if (key && (mode_ == LookupMode::LessOrEqual ? *key <= key_ : *key >= key_))
+            {
+                KeepBest(best_, std::optional<std::pair<Key, int>>{ { *key, row_ } }, mode_);
+            }
+        };
+
+    if (hi_ - lo_ < SCAN_ROWS)
+    {
+        ForEachFiled(std::max(lo_, first_row_), std::min(hi_, last_row_), read);
+        return;
+    }
+
+    if (first_row_ <= lo_ && hi_ <= last_row_)
+    {
+        if (node_ == 1)
+        {
+            search(numbers, texts);
+            return;
+        }
+
+        const size_t buckets = nodes.bucket_count();
+        const auto [it, inserted] = nodes.try_emplace(node_, nodes.get_allocator().resource());
+        Node& node = it->second;
+        if (inserted)
+        {
+            usage += GetHashNodeBytes(nodes) + (nodes.bucket_count() - buckets) * sizeof(void*);
+            ForEachFiled(lo_, hi_, read);
+            return;
+        }
+        if (!node.built)
+        {
+            ForEachFiled(lo_, hi_, [&node](int row_, const FiledKey& filed_)
+                {
+                    if (const double* number = std::get_if<double>(&filed_))
+                    {
+                        node.numbers.emplace(*number, row_);
+                    }
+                    else
+                    {
+                        node.texts.emplace(std::get<std::pmr::string>(filed_), row_);
+                    }
+                });
+            usage += node.numbers.size() * GetTreeNodeBytes(node.numbers) + node.texts.size() * GetTreeNodeBytes(node.texts);
+            node.built = true;
+        }
+        search(node.numbers, node.texts);
+        return;
+    }
+
+    const int mid = lo_ + (hi_ - lo_) / 2;
+    FindInTree(2 * node_, lo_, mid, first_row_, last_row_, key_, mode_, best_);
+    FindInTree(2 * node_ + 1, mid + 1, hi_, first_row_, last_row_, key_, mode_, best_);
+}
+
+template <typename Action>
+void ColumnIndex::ForEachFiled(int first_row_, int last_row_, Action&& action_) const
+{
+    // Whichever is fewer is looked through: the rows of the span or the filed rows.
+    if (static_cast<size_t>(last_row_ - first_row_) < filed.size())
+    {
+        for (int row = first_row_; row <= last_row_; ++row)
+        {
+            if (const auto it = filed.find(row); it != filed.end())
+            {
+                action_(row, it->second);
+            }
+        }
+        return;
+    }
+
+    for (const auto& [row, key] : filed)
+    {
+        if (InRows(row, first_row_, last_row_))
+        {
+            action_(row, key);
+        }
+    }
+}
+
+template <typename Action>
+void ColumnIndex::ForEachNode(int row_, Action&& action_)
+{
+    if (nodes.empty())
+    {
+        return;
+    }
+
+    int node = 1;
+    int lo = 0;
+    int hi = Position::MAX_ROWS - 1;
+    while (hi - lo >= SCAN_ROWS)
+    {
+        if (const auto it = nodes.find(node); it != nodes.end() && it->second.built)
+        {
+            action_(it->second);
+        }
+
+        const int mid = lo + (hi - lo) / 2;
+        if (row_ <= mid)
+        {
+            node = 2 * node;
+            hi = mid;
+        }
+        else
+        {
+            node = 2 * node + 1;
+            lo = mid + 1;
+        }
+    }
+}
\ No newline at end of file
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "common.h"
+
+#include <memory_resource>
+#include <optional>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+
+// Key a value is filed under by lookups; empty text and errors have none.
+std::optional<LookupKey> GetLookupKey(const CellInterface::ValueView& value_);
+bool Matches(const std::optional<LookupKey>& key_, const LookupCriterion& criterion_);
+
+// Keys of one column of a sheet, ordered, with the rows holding each. A row whose
+// cell may have changed is only marked stale; the next query whose rows cover it
+// reads the cell again and refiles it, so an edit costs nothing until a lookup
+// needs it. A stale row is read while no iterator is held, because reading a
+// formula can run lookups of its own on this index, over rows it depends on.
+//
+// An ordered search over part of the column may have to pass many rows outside
+// it. Once a search passes MAX_WALK of them, it goes to a segment tree over the
+// rows instead: any span splits into O(log n) nodes, each searched in O(log n),
+// plus at most a few hundred rows near its ends read directly. A node orders its
+// keys the second time a search needs it, so a span seen once costs one pass
+// over its rows, and keeps them up to date while filing from then on.
+//
+// The bytes the index takes are added to and taken from usage_ as it changes, so
+// a sheet reports all of its indexes without visiting them.
+class ColumnIndex
+{
+public:
+
+    ColumnIndex(const SheetInterface& sheet_, int col_, size_t& usage_, std::pmr::memory_resource* resource_ = std::pmr::get_default_resource());
+
+    void MarkStale(int row_);
+
+    // Same answers as SheetInterface::FindInColumn and CountIf over rows [first_row_, last_row_].
+    int Find(int first_row_, int last_row_, LookupKey key_, LookupMode mode_);
+    size_t Count(int first_row_, int last_row_, const LookupCriterion& criterion_);
+
+private:
+
+    // Orders (text, row) pairs and lets string_view keys search them without a copy.
+    struct TextOrder
+    {
+        using is_transparent = void;
+
+        template <typename Lhs, typename Rhs>
+        bool operator()(const Lhs& lhs_, const Rhs& rhs_) const
+        {
+            const std::string_view lhs(lhs_.first);
+            const std::string_view rhs(rhs_.first);
+            return lhs < rhs || (lhs == rhs && lhs_.second < rhs_.second);
+        }
+    };
+
+    using FiledKey = std::variant<double, std::pmr::string>;
+
+    // Keys of the rows a tree node covers, ordered once the node is built.
+    struct Node
+    {
+        explicit Node(std::pmr::memory_resource* resource_) : numbers(resource_), texts(resource_) {}
+
+        bool built = false;
+        std::pmr::set<std::pair<double, int>> numbers;
+        std::pmr::set<std::pair<std::string_view, int>, TextOrder> texts;
+    };
+
+    static const int MAX_WALK = 32;
+    // Node 1 covers every row and is searched through the column's own keys; node i
+    // has children 2i and 2i + 1. Nodes of up to SCAN_ROWS rows are read directly.
+    static const int SCAN_ROWS = 64;
+
+    void Refresh(int first_row_, int last_row_);
+    void File(int row_, LookupKey key_);
+    void Unfile(int row_);
+
+    template <typename Key>
+    int Find(int first_row_, int last_row_, Key key_, LookupMode mode_);
+    template <typename Key>
+    void FindInTree(int node_, int lo_, int hi_, int first_row_, int last_row_, Key key_, LookupMode mode_, std::optional<std::pair<Key, int>>& best_);
+    // Calls action_(row, key) for the filed rows in [first_row_, last_row_], in no particular order.
+    template <typename Action>
+    void ForEachFiled(int first_row_, int last_row_, Action&& action_) const;
+    // Calls action_(node) for the built nodes over row_.
+    template <typename Action>
+    void ForEachNode(int row_, Action&& action_);
+
+    const SheetInterface& sheet;
+    int col;
+    size_t& usage;
+
+    std::pmr::set<std::pair<double, int>> numbers;
+    std::pmr::set<std::pair<std::pmr::string, int>, TextOrder> texts;
+    std::pmr::unordered_map<int, FiledKey> filed;
+    std::pmr::set<int> stale;
+    // Tree nodes searched at least once, by number; texts point into filed.
+    std::pmr::unordered_map<int, Node> nodes;
+};
\ No newline at end of file
@@ -0,0 +1,88 @@
+#include "occupancy.h"
+
+#include <algorithm>
+
+namespace
+{
+    // A tree node holds its value next to three links and a colour.
+    template <typename Map>
+    size_t GetNodeBytes(const Map& /* map */)
+    {
+        return sizeof(typename Map::value_type) + 4 * sizeof(void*);
+    }
+}  // namespace
+
+OccupancyIndex::OccupancyIndex(std::pmr::memory_resource* resource_) : rows(resource_), column_counts(resource_) {}
+
+OccupancyIndex::OccupancyIndex(const OccupancyIndex& other_, std::pmr::memory_resource* resource_) : rows(other_.rows, resource_), column_counts(other_.column_counts, resource_)
+{
+    // Copies hold no spare capacity, so the bytes are counted afresh.
+    bytes = rows.size() * GetNodeBytes(rows) + column_counts.size() * GetNodeBytes(column_counts);
+    for (const auto& [row, columns] : rows)
+    {
+        bytes += columns.capacity() * sizeof(int);
+    }
+}
+
+void OccupancyIndex::Add(Position pos_)
+{
+    const auto [row, inserted] = rows.try_emplace(pos_.row);
+    Columns& columns = row->second;
+    const auto it = std::lower_bound(columns.begin(), columns.end(), pos_.col);
+    if (it != columns.end() && *it == pos_.col)
+    {
+        return;
+    }
+
+    const size_t capacity = columns.capacity();
+    columns.insert(it, pos_.col);
+    bytes += (columns.capacity() - capacity) * sizeof(int) + (inserted ? GetNodeBytes(rows) : 0);
+
+    const auto [count, counted] = column_counts.try_emplace(pos_.col, 0);
+    ++count->second;
+    bytes += counted ? GetNodeBytes(column_counts) : 0;
+}
+
+void OccupancyIndex::Remove(Position pos_)
+{
+    const auto row = rows.find(pos_.row);
+    if (row == rows.end())
+    {
+        return;
+    }
+
+    Columns& columns = row->second;
+    const auto it = std::lower_bound(columns.begin(), columns.end(), pos_.col);
+    if (it == columns.end() || *it != pos_.col)
+    {
+        return;
+    }
+
+    columns.erase(it);
+    if (columns.empty())
+    {
+        bytes -= GetNodeBytes(rows) + columns.capacity() * sizeof(int);
+        rows.erase(row);
+    }
+
+    const auto count = column_counts.find(pos_.col);
+    if (--count->second == 0)
+    {
+        bytes -= GetNodeBytes(column_counts);
+        column_counts.erase(count);
+    }
+}
+
+Size OccupancyIndex::GetSize() const
+{
+    if (rows.empty())
+    {
+        return { 0, 0 };
+    }
+    return { rows.rbegin()->first + 1, column_counts.rbegin()->first + 1 };
+}
+
+size_t OccupancyIndex::GetMemoryUsage() const
+{
+    return bytes;
+}
\ No newline at end of file
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "common.h"
+
+#include <map>
+#include <memory_resource>
+#include <vector>
+
+// Which positions of a sheet hold a cell, kept row by row with the columns of
+// each row sorted, plus a count of cells per column. The bounding size comes
+// from the last row and the last column, so it costs the same however sparse
+// the sheet is. Adding a present cell or removing an absent one does nothing.
+class OccupancyIndex
+{
+public:
+
+    explicit OccupancyIndex(std::pmr::memory_resource* resource_ = std::pmr::get_default_resource());
+    OccupancyIndex(const OccupancyIndex& other_, std::pmr::memory_resource* resource_);
+
+    void Add(Position pos_);
+    void Remove(Position pos_);
+
+    Size GetSize() const;
+    // Bytes of the rows and counts, kept as they change.
+    size_t GetMemoryUsage() const;
+
+    // Calls action_(row, columns) for every row holding a cell, top to bottom.
+    template <typename Action>
+    void ForEachRow(Action&& action_) const;
+
+private:
+
+    using Columns = std::pmr::vector<int>;
+
+    std::pmr::map<int, Columns> rows;
+    std::pmr::map<int, int> column_counts;
+    size_t bytes = 0;
+};
+
+template <typename Action>
+void OccupancyIndex::ForEachRow(Action&& action_) const
+{
+    for (const auto& [row, columns] : rows)
+    {
+        action_(row, columns);
+    }
+}
\ No newline at end of file
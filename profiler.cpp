@@ -0,0 +1,89 @@
+#include "profiler.h"
+
+#include <algorithm>
+
+void RecalcProfiler::RecordHit(Position pos_)
+{
+    std::lock_guard lock(mutex);
+    ++stats[pos_].cache_hits;
+}
+
+void RecalcProfiler::BeginEvaluation(Position pos_)
+{
+    frames.push_back(Frame{ pos_, Clock::now(), {} });
+}
+
+void RecalcProfiler::EndEvaluation()
+{
+    const Frame frame = frames.back();
+    frames.pop_back();
+
+    const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - frame.start);
+    if (!frames.empty())
+    {
+        frames.back().children += elapsed;
+    }
+
+    std::lock_guard lock(mutex);
+    CellStats& cell = stats[frame.pos];
+    ++cell.evaluations;
+    cell.total_time += elapsed;
+    cell.self_time += elapsed - frame.children;
+}
+
+void RecalcProfiler::RecordInvalidation(Position pos_, size_t fan_out_)
+{
+    std::lock_guard lock(mutex);
+    CellStats& cell = stats[pos_];
+    ++cell.invalidations;
+    cell.invalidated_cells += fan_out_;
+}
+
+std::vector<RecalcProfiler::Entry> RecalcProfiler::GetHottestCells(size_t count_) const
+{
+    std::vector<Entry> entries;
+    {
+        std::lock_guard lock(mutex);
+        entries.reserve(stats.size());
+        for (const auto& [pos, cell] : stats)
+        {
+            entries.push_back(Entry{ pos, cell });
+        }
+    }
+
+    const auto hotter = [](const Entry& lhs_, const Entry& rhs_)
+        {
+            if (lhs_.stats.self_time != rhs_.stats.self_time)
+            {
+                return lhs_.stats.self_time > rhs_.stats.self_time;
+            }
+            return lhs_.stats.evaluations > rhs_.stats.evaluations;
+        };
+
+    count_ = std::min(count_, entries.size());
+    std::partial_sort(entries.begin(), entries.begin() + count_, entries.end(), hotter);
+    entries.resize(count_);
+    return entries;
+}
+
+RecalcProfiler::CellStats RecalcProfiler::GetTotals() const
+{
+    std::lock_guard lock(mutex);
+    CellStats totals;
+    for (const auto& [pos, cell] : stats)
+    {
+        totals.evaluations += cell.evaluations;
+        totals.cache_hits += cell.cache_hits;
+        totals.invalidations += cell.invalidations;
+        totals.invalidated_cells += cell.invalidated_cells;
+        totals.total_time += cell.self_time;
+        totals.self_time += cell.self_time;
+    }
+    return totals;
+}
+
+void RecalcProfiler::Reset()
+{
+    std::lock_guard lock(mutex);
+    stats.clear();
+}
\ No newline at end of file
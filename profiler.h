@@ -0,0 +1,61 @@
+#pragma once
+
+#include "common.h"
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// Per-cell recalculation counters. A sheet only hands the profiler to its formula
+// cells while profiling is switched on, so a disabled profiler is never reached.
+// Evaluations run on the thread that owns the sheet; cache hits may also be
+// recorded by forks reading this sheet from other threads.
+class RecalcProfiler
+{
+public:
+
+    struct CellStats
+    {
+        uint64_t evaluations = 0;
+        uint64_t cache_hits = 0;
+        uint64_t invalidations = 0;
+        uint64_t invalidated_cells = 0;
+        std::chrono::nanoseconds total_time{ 0 };
+        std::chrono::nanoseconds self_time{ 0 };
+    };
+
+    struct Entry
+    {
+        Position pos;
+        CellStats stats;
+    };
+
+    void RecordHit(Position pos_);
+    void BeginEvaluation(Position pos_);
+    void EndEvaluation();
+    void RecordInvalidation(Position pos_, size_t fan_out_);
+
+    // Cells ordered by time spent in their own formula, excluding the cells it pulled in.
+    std::vector<Entry> GetHottestCells(size_t count_) const;
+
+    // Sums over all cells; total_time here adds up self times, i.e. wall time spent evaluating.
+    CellStats GetTotals() const;
+    void Reset();
+
+private:
+
+    using Clock = std::chrono::steady_clock;
+
+    struct Frame
+    {
+        Position pos;
+        Clock::time_point start;
+        std::chrono::nanoseconds children{ 0 };
+    };
+
+    mutable std::mutex mutex;
+    std::unordered_map<Position, CellStats, PositionHasher> stats;
+    std::vector<Frame> frames;
+};
\ No newline at end of file
@@ -0,0 +1,209 @@
+#include "recorder.h"
+
+#include "varint.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+
+namespace
+{
+    const char MAGIC[] = { 'S', 'S', 'W', '1' };
+
+    bool HasPosition(WorkloadRecorder::OpType type_)
+    {
+        return type_ == WorkloadRecorder::OpType::Set || type_ == WorkloadRecorder::OpType::Clear || type_ == WorkloadRecorder::OpType::Get;
+    }
+}  // namespace
+
+WorkloadRecorder::WorkloadRecorder(SheetInterface& sheet_, const std::string& path_) : sheet(sheet_), last(std::chrono::steady_clock::now())
+{
+    file = std::fopen(path_.c_str(), "wb");
+    if (!file)
+    {
+        throw std::runtime_error("Cannot create workload trace " + path_);
+    }
+    buffer.assign(std::begin(MAGIC), std::end(MAGIC));
+}
+
+WorkloadRecorder::~WorkloadRecorder()
+{
+    Flush();
+    std::fclose(file);
+}
+
+void WorkloadRecorder::SetCell(Position pos_, std::string text_)
+{
+    Append(OpType::Set, pos_, text_);
+    sheet.SetCell(pos_, std::move(text_));
+}
+
+const CellInterface* WorkloadRecorder::GetCell(Position pos_) const
+{
+    Append(OpType::Get, pos_, {});
+    return static_cast<const SheetInterface&>(sheet).GetCell(pos_);
+}
+
+CellInterface* WorkloadRecorder::GetCell(Position pos_)
+{
+    Append(OpType::Get, pos_, {});
+    return sheet.GetCell(pos_);
+}
+
+Size WorkloadRecorder::GetPrintableSize() const
+{
+    Append(OpType::PrintableSize, Position::NONE, {});
+    return sheet.GetPrintableSize();
+}
+
+void WorkloadRecorder::ClearCell(Position pos_)
+{
+    Append(OpType::Clear, pos_, {});
+    sheet.ClearCell(pos_);
+}
+
+void WorkloadRecorder::PrintValues(std::ostream& output_) const
+{
+    Append(OpType::PrintValues, Position::NONE, {});
+    sheet.PrintValues(output_);
+}
+
+void WorkloadRecorder::PrintTexts(std::ostream& output_) const
+{
+    Append(OpType::PrintTexts, Position::NONE, {});
+    sheet.PrintTexts(output_);
+}
+
+void WorkloadRecorder::Flush()
+{
+    WriteBuffer();
+    std::fflush(file);
+}
+
+std::vector<WorkloadRecorder::Operation> WorkloadRecorder::ReadTrace(const std::string& path_)
+{
+    std::ifstream in(path_, std::ios::binary);
+    if (!in)
+    {
+        throw std::runtime_error("Cannot open workload trace " + path_);
+    }
+
+    const std::vector<char> data{ std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>() };
+    if (data.size() < sizeof(MAGIC) || !std::equal(std::begin(MAGIC), std::end(MAGIC), data.begin()))
+    {
+        throw std::runtime_error("Not a workload trace: " + path_);
+    }
+
+    std::vector<Operation> operations;
+    std::chrono::microseconds time{ 0 };
+
+    const char* it = data.data() + sizeof(MAGIC);
+    const char* end = data.data() + data.size();
+    while (it != end)
+    {
+        Operation operation{ static_cast<OpType>(*it++), {}, Position::NONE, {} };
+        if (operation.type < OpType::Set || operation.type > OpType::PrintTexts)
+        {
+            break;
+        }
+
+        uint64_t delta = 0;
+        if (!GetVarint(it, end, delta))
+        {
+            break;
+        }
+        time += std::chrono::microseconds(delta);
+        operation.time = time;
+
+        if (HasPosition(operation.type))
+        {
+            uint32_t row = 0;
+            uint32_t col = 0;
+            if (!GetVarint(it, end, row) || !GetVarint(it, end, col))
+            {
+                break;
+            }
+            operation.pos = Position{ static_cast<int>(row), static_cast<int>(col) };
+        }
+
+        if (operation.type == OpType::Set)
+        {
+            uint32_t size = 0;
+            if (!GetVarint(it, end, size) || static_cast<size_t>(end - it) < size)
+            {
+                break;
+            }
+            operation.text.assign(it, size);
+            it += size;
+        }
+
+        operations.push_back(std::move(operation));
+    }
+
+    return operations;
+}
+
+void WorkloadRecorder::Apply(const Operation& operation_, SheetInterface& sheet_, std::ostream& output_)
+{
+    switch (operation_.type)
+    {
+    case OpType::Set:
+        sheet_.SetCell(operation_.pos, operation_.text);
+        break;
+
+    case OpType::Clear:
+        sheet_.ClearCell(operation_.pos);
+        break;
+
+    case OpType::Get:
+        if (const CellInterface* cell = sheet_.GetCell(operation_.pos))
+        {
+            cell->GetValue();
+        }
+        break;
+
+    case OpType::PrintableSize:
+        sheet_.GetPrintableSize();
+        break;
+
+    case OpType::PrintValues:
+        sheet_.PrintValues(output_);
+        break;
+
+    case OpType::PrintTexts:
+        sheet_.PrintTexts(output_);
+        break;
+    }
+}
+
+void WorkloadRecorder::Append(OpType type_, Position pos_, std::string_view text_) const
+{
+    const auto now = std::chrono::steady_clock::now();
+    const auto delta = std::chrono::duration_cast<std::chrono::microseconds>(now - last);
+    last = now;
+
+    buffer.push_back(static_cast<char>(type_));
+    PutVarint(buffer, static_cast<uint64_t>(std::max<int64_t>(0, delta.count())));
+    if (HasPosition(type_))
+    {
+        PutVarint(buffer, static_cast<uint32_t>(pos_.row));
+        PutVarint(buffer, static_cast<uint32_t>(pos_.col));
+    }
+    if (type_ == OpType::Set)
+    {
+        PutVarint(buffer, static_cast<uint32_t>(text_.size()));
+        buffer.insert(buffer.end(), text_.begin(), text_.end());
+    }
+
+    if (buffer.size() >= FLUSH_BYTES)
+    {
+        WriteBuffer();
+    }
+}
+
+void WorkloadRecorder::WriteBuffer() const
+{
+    std::fwrite(buffer.data(), 1, buffer.size(), file);
+    buffer.clear();
+}
\ No newline at end of file
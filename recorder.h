@@ -0,0 +1,79 @@
+#pragma once
+
+#include "common.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Sheet wrapper that forwards every call to the wrapped sheet and logs it,
+// with its time, to a compact binary trace for spreadsheet_replay.
+//
+// Trace layout: the magic "SSW1", then one record per call:
+//   type byte, microseconds since the previous record, row, col, [text size, text]
+// with all numbers as varints. Position and text are only present for calls that take them.
+class WorkloadRecorder : public SheetInterface
+{
+public:
+
+    enum class OpType : uint8_t
+    {
+        Set = 1,
+        Clear = 2,
+        Get = 3,
+        PrintableSize = 4,
+        PrintValues = 5,
+        PrintTexts = 6,
+    };
+
+    struct Operation
+    {
+        OpType type;
+        std::chrono::microseconds time;
+        Position pos;
+        std::string text;
+    };
+
+    // Throws std::runtime_error if the trace file cannot be created.
+    WorkloadRecorder(SheetInterface& sheet_, const std::string& path_);
+    ~WorkloadRecorder();
+
+    WorkloadRecorder(const WorkloadRecorder&) = delete;
+    WorkloadRecorder& operator=(const WorkloadRecorder&) = delete;
+
+    void SetCell(Position pos_, std::string text_) override;
+
+    const CellInterface* GetCell(Position pos_) const override;
+    CellInterface* GetCell(Position pos_) override;
+    Size GetPrintableSize() const override;
+
+    void ClearCell(Position pos_) override;
+
+    void PrintValues(std::ostream& output_) const override;
+    void PrintTexts(std::ostream& output_) const override;
+
+    void Flush();
+
+    // Operations of a trace; a torn record at the tail ends it. Throws std::runtime_error
+    // if the file cannot be read or is not a trace.
+    static std::vector<Operation> ReadTrace(const std::string& path_);
+
+    // Performs one recorded call; reads also compute the cell value, prints go to output_.
+    static void Apply(const Operation& operation_, SheetInterface& sheet_, std::ostream& output_);
+
+private:
+
+    static const size_t FLUSH_BYTES = 64 * 1024;
+
+    // Reads are const on the sheet interface but still have to be logged.
+    void Append(OpType type_, Position pos_, std::string_view text_) const;
+    void WriteBuffer() const;
+
+    SheetInterface& sheet;
+    std::FILE* file = nullptr;
+    mutable std::vector<char> buffer;
+    mutable std::chrono::steady_clock::time_point last;
+};
\ No newline at end of file
@@ -2,40 +2,124 @@
 
 #include "cell.h"
 #include "common.h"
+#include "journal.h"
+#include "tracing.h"
 
 #include <algorithm>
 #include <functional>
 #include <iostream>
+#include <iterator>
 #include <optional>
+#include <tuple>
 
 using namespace std::literals;
 
-Sheet::~Sheet() {}
+Sheet::Sheet(std::pmr::memory_resource* upstream_) : arena(upstream_) {}
+
+Sheet::Sheet(Sheet& base_) : base(&base_), arena(base_.arena.upstream_resource()), occupancy(base_.occupancy, &arena), graph(&base_.graph, &arena) {}
+
+Sheet::~Sheet() 
+{
+    if (base)
+    {
+        --base->forks;
+    }
+}
 
 void Sheet::SetCell(Position pos_, std::string text_) 
 {
-   if (!pos_.IsValid())
+    if (!pos_.IsValid())
     {
         throw InvalidPositionException("Invalid position");
     }
+    CheckMutable();
+    ++version;
+
+    TraceScope trace("SetCell", "edit", pos_);
+
+    Cell cell;
+    {
+        TraceScope phase("parse", "edit", pos_);
+        cell = Cell(std::move(text_), *this, &arena, &strings, &expressions);
+    }
+
+    const std::vector<Position> referenced = cell.GetReferencedCells();
+    const std::vector<Range> ranges = cell.GetReferencedRanges();
+    const Size spill = cell.GetArraySize();
+    {
+        TraceScope phase("cycle_check", "edit", pos_);
+        if (graph.WouldIntroduceCycle(pos_, referenced, ranges, spill))
+        {
+            throw CircularDependencyException("");
+        }
+    }
 
-    const auto& cell = cells.find(pos_);
+    Cell* target = nullptr;
+    std::vector<Position> affected;
+    {
+        TraceScope phase("rewire", "edit", pos_);
+
+        const bool spills = graph.HasSpills() || !(spill == Size{ 1, 1 });
+        RememberValue(pos_);
+        if (spills)
+        {
+            RememberValues(graph.GetSpill(pos_));
+            RememberValues(Range{ pos_, spill });
+        }
+        const auto [it, inserted] = cells.try_emplace(pos_);
+        if (!inserted)
+        {
+            TrackUsage(it->second, false);
+            ForgetSharedValues(it->second);
+        }
+        target = &(it->second = std::move(cell));
+        TrackUsage(*target, true);
+        target->AttachProfiler(profiling ? &profiler : nullptr, pos_);
+        ForgetMatches(pos_);
+
+        removed.erase(pos_);
+        occupancy.Add(pos_);
+        graph.SetReferences(pos_, referenced, ranges);
+        if (spills)
+        {
+            const Range old_spill = graph.GetSpill(pos_);
+            graph.SetSpill(pos_, spill);
+            TrackSpill(pos_, old_spill, affected);
+        }
+
+        for (const Position& pos : referenced)
+        {
+            if (!GetCellPtr(pos))
+            {
+                SetCell(pos, "");
+            }
+        }
+    }
 
-    if (cell == cells.end())
     {
-        cells.emplace(pos_, std::make_unique<Cell>(*this));
+        TraceScope phase("invalidate", "edit", pos_);
+        InvalidateCells({ pos_ }, affected);
+    }
+
+    if (journal)
+    {
+        journal->AppendSet(pos_, target->GetText());
     }
-    cells.at(pos_)->Set(std::move(text_));
 }
 
 const CellInterface* Sheet::GetCell(Position pos_) const 
 {
-    return GetCellPtr(pos_);
+    const Cell* cell = GetCellPtr(pos_);
+    if ((cell && cell->GetKind() != Cell::Kind::Empty) || !GetSpilledValue(pos_))
+    {
+        return cell;
+    }
+    return &spilled_cells.try_emplace(pos_, *this, pos_).first->second;
 }
 
 CellInterface* Sheet::GetCell(Position pos_) 
 {
-    return GetCellPtr(pos_);
+    return const_cast<CellInterface*>(static_cast<const Sheet&>(*this).GetCell(pos_));
 }
 
 void Sheet::ClearCell(Position pos_) 
@@ -44,101 +128,1214 @@ void Sheet::ClearCell(Position pos_)
     {
         throw InvalidPositionException("Invalid position");
     }
+    CheckMutable();
+    ++version;
 
-    const auto& cell = cells.find(pos_);
-    if (cell != cells.end() && cell->second != nullptr) 
+    TraceScope trace("ClearCell", "edit", pos_);
+
+    Cell* cell = GetLocalCell(pos_);
+    if (cell != nullptr) 
     {
-        cell->second->Clear();
-        if (!cell->second->IsReferenced()) 
+        RememberValue(pos_);
+        const Range old_spill = graph.GetSpill(pos_);
+        RememberValues(old_spill);
+        TrackUsage(*cell, false);
+        ForgetSharedValues(*cell);
+        cell->Clear();
+        graph.SetReferences(pos_, {});
+        graph.SetSpill(pos_, Size{ 1, 1 });
+        std::vector<Position> affected;
+        TrackSpill(pos_, old_spill, affected);
+        InvalidateCells({ pos_ }, affected);
+
+        if (graph.HasDependents(pos_))
+        {
+            TrackUsage(*cell, true);
+        }
+        else
         {
-            cell->second.reset();
+            cells.erase(pos_);
+            if (!IsSpilledOver(pos_))
+            {
+                occupancy.Remove(pos_);
+            }
+            if (base)
+            {
+                removed.insert(pos_);
+            }
         }
     }
+
+    if (journal)
+    {
+        journal->AppendClear(pos_);
+    }
 }
 
-Size Sheet::GetPrintableSize() const 
+int Sheet::FindInColumn(Range column_, LookupKey key_, LookupMode mode_) const
 {
-    Size result{ 0, 0 };
+    return GetColumnIndex(column_.top_left.col).Find(column_.top_left.row, column_.top_left.row + column_.size.rows - 1, key_, mode_);
+}
+
+size_t Sheet::CountIf(Range range_, const LookupCriterion& criterion_) const
+{
+    size_t result = 0;
+    for (int col = range_.top_left.col; col < range_.top_left.col + range_.size.cols; ++col)
+    {
+        result += GetColumnIndex(col).Count(range_.top_left.row, range_.top_left.row + range_.size.rows - 1, criterion_);
+    }
+    return result;
+}
 
-    for (auto it = cells.begin(); it != cells.end(); ++it) 
+ColumnIndex& Sheet::GetColumnIndex(int col_) const
+{
+    const auto [it, inserted] = column_indexes.try_emplace(col_, *this, col_, lookup_bytes, column_indexes.get_allocator().resource());
+    if (inserted)
     {
-        if (it->second != nullptr) 
+        lookup_bytes += sizeof(decltype(column_indexes)::value_type) + 4 * sizeof(void*);
+        // Every cell of the column starts out stale and is read by the first lookup over its row.
+        occupancy.ForEachRow([&index = it->second, col_](int row_, const auto& columns_)
+            {
+                if (std::binary_search(columns_.begin(), columns_.end(), col_))
+                {
+                    index.MarkStale(row_);
+                }
+            });
+    }
+    return it->second;
+}
+
+double Sheet::EvaluateShared(uint64_t key_, const std::function<double()>& evaluate_) const
+{
+    if (const auto it = shared_values.find(key_); it != shared_values.end())
+    {
+        ++sharing.hits;
+        if (const double* value = std::get_if<double>(&it->second))
         {
-            const int col = it->first.col;
-            const int row = it->first.row;
-            result.rows = std::max(result.rows, row + 1);
-            result.cols = std::max(result.cols, col + 1);
+            return *value;
         }
+        throw std::get<FormulaError>(it->second);
     }
 
-    return { result.rows, result.cols };
+    // No iterator is held across evaluate_, which can read other shared values.
+    ++sharing.evaluations;
+    try
+    {
+        const double value = evaluate_();
+        shared_values.emplace(key_, value);
+        return value;
+    }
+    catch (const FormulaError& error_)
+    {
+        shared_values.emplace(key_, error_);
+        throw;
+    }
 }
 
-void Sheet::PrintValues(std::ostream& output_) const 
+Sheet::SharingStats Sheet::GetSharingStats() const
+{
+    SharingStats result = sharing;
+    result.values = shared_values.size();
+    result.nodes = expressions.GetSize();
+    return result;
+}
+
+void Sheet::ForgetSharedValues(const Cell& cell_)
+{
+    if (shared_values.empty())
+    {
+        return;
+    }
+    for (const uint64_t key : cell_.GetSubexpressions())
+    {
+        shared_values.erase(key);
+    }
+}
+
+void Sheet::EvaluateColumnRun(Position pos_) const
 {
-    Size size = GetPrintableSize();
-    for (int row = 0; row < size.rows; ++row) 
+    if (profiling || !pos_.IsValid())
+    {
+        return;
+    }
+    for (const ColumnRun& run : active_runs)
+    {
+        if (run.col == pos_.col && run.first_row <= pos_.row && pos_.row <= run.last_row)
+        {
+            return;
+        }
+    }
+
+    // Stale formulas of this sheet's own; others are not part of any run here.
+    const auto find_stale = [this](Position cell_pos_) -> const Cell*
+        {
+            const auto it = cell_pos_.row >= 0 ? cells.find(cell_pos_) : cells.end();
+            return it != cells.end() && !it->second.IsCacheValid() ? &it->second : nullptr;
+        };
+    const Cell* start = find_stale(pos_);
+    if (!start)
+    {
+        return;
+    }
+
+    // A neighbour known to differ rules its side out before anything is compiled.
+    const bool may_go_down = start->GetMatchBelow() != Cell::Match::Different && find_stale({ pos_.row + 1, pos_.col });
+    const bool may_go_up = start->GetMatchAbove() != Cell::Match::Different && find_stale({ pos_.row - 1, pos_.col });
+    if ((!may_go_down && !may_go_up) || !start->CompileKernel(run_kernel))
+    {
+        return;
+    }
+
+    // Down first, since runs are usually read from the top.
+    std::vector<const Cell*> below;
+    std::vector<const Cell*> above;
+    const auto extend = [&](std::vector<const Cell*>& run_, int step_)
+        {
+            while (1 + below.size() + above.size() < static_cast<size_t>(MAX_RUN))
+            {
+                const Cell* cell = find_stale({ pos_.row + step_ * static_cast<int>(run_.size() + 1), pos_.col });
+                const Cell* last = run_.empty() ? start : run_.back();
+                if (!cell || !(step_ > 0 ? ContinuesRun(*last, *cell, true) : ContinuesRun(*cell, *last, false)))
+                {
+                    break;
+                }
+                run_.push_back(cell);
+            }
+        };
+    extend(below, 1);
+    extend(above, -1);
+
+    const size_t count = 1 + below.size() + above.size();
+    if (count < static_cast<size_t>(MIN_RUN))
     {
-        for (int col = 0; col < size.cols; ++col) 
+        return;
+    }
+
+    TraceScope trace("evaluate_run", "recalc", pos_);
+    const ColumnKernel kernel = run_kernel;
+    const int first_row = pos_.row - static_cast<int>(above.size());
+
+    std::vector<const Cell*> run(above.rbegin(), above.rend());
+    run.push_back(start);
+    run.insert(run.end(), below.begin(), below.end());
+
+    // Inputs are read column by column into dense arrays. Empty cells read as zero, like
+    // in a formula; a lane reading anything but a number is left out of the kernel.
+    const std::vector<ColumnKernel::Input>& inputs = kernel.GetInputs();
+    std::vector<double> values(inputs.size() * count);
+    std::vector<const double*> columns(inputs.size());
+    std::vector<uint8_t> failed(count, 0);
+    std::vector<double> results(count);
+
+    active_runs.push_back(ColumnRun{ pos_.col, first_row, first_row + static_cast<int>(count) - 1 });
+    try
+    {
+        for (size_t k = 0; k < inputs.size(); ++k)
         {
-            if (col > 0)
+            double* column = values.data() + k * count;
+            columns[k] = column;
+            for (size_t i = 0; i < count; ++i)
             {
-                output_ << "\t";
+                const CellInterface::ValueView value = GetValueView({ first_row + static_cast<int>(i) + inputs[k].row_offset, inputs[k].col });
+                if (const double* number = std::get_if<double>(&value))
+                {
+                    column[i] = *number;
+                }
+                else if (!std::holds_alternative<std::string_view>(value) || !std::get<std::string_view>(value).empty())
+                {
+                    failed[i] = 1;
+                }
             }
+        }
 
-            const auto& it = cells.find({ row, col });
+        kernel.Run(columns, count, results.data(), failed.data());
 
-            if (it != cells.end() && it->second != nullptr && !it->second->GetText().empty())
+        ++kernel_stats.runs;
+        kernel_stats.lanes += count;
+        for (size_t i = 0; i < count; ++i)
+        {
+            // A formula read back while the inputs were gathered has its value already. Failed
+            // lanes are evaluated one by one, for their errors, while the run still stands so
+            // they do not start another.
+            if (failed[i])
             {
-                std::visit([&](const auto value) { output_ << value; }, it->second->GetValue());
+                ++kernel_stats.failed_lanes;
+                run[i]->GetFormulaValue();
+            }
+            else if (!run[i]->IsCacheValid())
+            {
+                run[i]->SetCachedValue(results[i]);
             }
         }
-        output_ << "\n";
     }
+    catch (...)
+    {
+        active_runs.pop_back();
+        throw;
+    }
+    active_runs.pop_back();
 }
+
+Sheet::KernelStats Sheet::GetKernelStats() const
+{
+    return kernel_stats;
+}
+
+// Whether two formulas one above the other compile alike. One of them is in the run being
+// built, compiled to run_kernel; the new one is compiled once, and both keep the answer.
+bool Sheet::ContinuesRun(const Cell& upper_, const Cell& lower_, bool lower_is_new_) const
+{
+    switch (lower_.GetMatchAbove())
+    {
+    case Cell::Match::Same:
+        return true;
+
+    case Cell::Match::Different:
+        return false;
+
+    case Cell::Match::Unknown:
+        break;
+    }
+
+    const bool same = (lower_is_new_ ? lower_ : upper_).CompileKernel(probe_kernel) && probe_kernel == run_kernel;
+    Cell::SetMatch(&upper_, &lower_, same ? Cell::Match::Same : Cell::Match::Different);
+    return same;
+}
+
+// Cells rows_ rows from pos_ down were replaced: the cells right above and below forget how they matched.
+void Sheet::ForgetMatches(Position pos_, int rows_)
+{
+    const auto upper = cells.find({ pos_.row - 1, pos_.col });
+    if (upper != cells.end())
+    {
+        Cell::SetMatch(&upper->second, nullptr, Cell::Match::Unknown);
+    }
+    const auto lower = cells.find({ pos_.row + rows_, pos_.col });
+    if (lower != cells.end())
+    {
+        Cell::SetMatch(nullptr, &lower->second, Cell::Match::Unknown);
+    }
+}
+
+Size Sheet::GetPrintableSize() const 
+{
+    return occupancy.GetSize();
+}
+
+void Sheet::PrintValues(std::ostream& output_) const 
+{
+    TraceScope trace("PrintValues", "export");
+
+    PrintCells(output_, [this, &output_](Position pos_, const Cell* cell_)
+        {
+            // Numbers keep the spelling they were entered with, everything else prints from the view.
+            if (cell_ && cell_->GetKind() == Cell::Kind::Number)
+            {
+                output_ << std::get<std::string>(cell_->GetValue());
+            }
+            else
+            {
+                std::visit([&](const auto& value) { output_ << value; }, GetValueView(pos_));
+            }
+        });
+}
+
 void Sheet::PrintTexts(std::ostream& output_) const 
 {
-    Size size = GetPrintableSize();
+    TraceScope trace("PrintTexts", "export");
+
+    PrintCells(output_, [&output_](Position /* pos */, const Cell* cell_)
+        {
+            if (cell_)
+            {
+                output_ << cell_->GetText();
+            }
+        });
+}
+
+template <typename Print>
+void Sheet::PrintCells(std::ostream& output_, Print&& print_) const
+{
+    const Size size = GetPrintableSize();
+    const auto print_tabs = [&output_](int count_)
+        {
+            for (; count_ > 0; --count_)
+            {
+                output_ << '\t';
+            }
+        };
+
+    // Only occupied cells are looked up; the gaps between them are just separators.
+    int next_row = 0;
+    occupancy.ForEachRow([&](int row_, const auto& columns_)
+        {
+            for (; next_row < row_; ++next_row)
+            {
+                print_tabs(size.cols - 1);
+                output_ << '\n';
+            }
+
+            int col = 0;
+            for (const int column : columns_)
+            {
+                print_tabs(column - col);
+                col = column;
+
+                // A spill area is occupied without holding cells.
+                const Cell* cell = GetCellPtr({ row_, column });
+                if (!cell || cell->GetKind() != Cell::Kind::Empty || graph.HasSpills())
+                {
+                    print_(Position{ row_, column }, cell);
+                }
+            }
+            print_tabs(size.cols - 1 - col);
+            output_ << '\n';
+            ++next_row;
+        });
+}
+
+const Cell* Sheet::GetCellPtr(Position pos_) const
+{
+    if (!pos_.IsValid())
+    {
+        throw InvalidPositionException("Invalid position");
+    }
+
+    const auto cell = cells.find(pos_);
+    if (cell != cells.end()) 
+    {
+        return &cell->second;
+    }
+
+    if (!base || removed.count(pos_))
+    {
+        return nullptr;
+    }
+
+    return base->GetCellPtr(pos_);
+}
+
+CellInterface::ValueView Sheet::GetValueView(Position pos_) const
+{
+    const Cell* cell = GetCellPtr(pos_);
+    if (cell && cell->GetKind() == Cell::Kind::Number)
+    {
+        return cell->GetNumber();
+    }
+    if (cell && cell->GetKind() != Cell::Kind::Empty)
+    {
+        return cell->GetValueView();
+    }
+    if (const std::optional<FormulaInterface::Value> spilled = GetSpilledValue(pos_))
+    {
+        return std::visit([](const auto& value_) -> CellInterface::ValueView { return value_; }, *spilled);
+    }
+    return std::string_view();
+}
+
+bool Sheet::CanSpill(Position anchor_, Size size_) const
+{
+    // An area running off the sheet is never recorded.
+    const Range area{ anchor_, size_ };
+    if (!(graph.GetSpill(anchor_) == area))
+    {
+        return false;
+    }
+
+    bool room = true;
+    graph.ForEachSpill(area, [anchor_, &room](Position other_, const Range& /* area */)
+        {
+            room = room && other_ == anchor_;
+        });
+    for (int row = area.top_left.row; room && row < area.top_left.row + area.size.rows; ++row)
+    {
+        for (int col = area.top_left.col; room && col < area.top_left.col + area.size.cols; ++col)
+        {
+            const Cell* cell = row == anchor_.row && col == anchor_.col ? nullptr : GetCellPtr({ row, col });
+            room = !cell || cell->GetKind() == Cell::Kind::Empty;
+        }
+    }
+    return room;
+}
 
-    for (int row = 0; row < size.rows; ++row) 
+std::optional<FormulaInterface::Value> Sheet::GetSpilledValue(Position pos_) const
+{
+    std::optional<FormulaInterface::Value> result;
+    if (!graph.HasSpills())
+    {
+        return result;
+    }
+    if (const Cell* own = GetCellPtr(pos_); own && own->GetKind() != Cell::Kind::Empty)
     {
-        for (int col = 0; col < size.cols; ++col) 
+        return result;
+    }
+
+    // Overlapping areas have no room, so at most one of them has an array.
+    graph.ForEachSpill(Range{ pos_, Size{ 1, 1 } }, [this, pos_, &result](Position anchor_, const Range& area_)
         {
-            if (col > 0)
+            const Cell* cell = anchor_ == pos_ ? nullptr : GetCellPtr(anchor_);
+            if (const ArrayValue* array = cell ? cell->GetArrayValue() : nullptr)
             {
-                output_ << "\t";
+                const size_t row = static_cast<size_t>(pos_.row - area_.top_left.row);
+                result = array->Get(row * static_cast<size_t>(area_.size.cols) + static_cast<size_t>(pos_.col - area_.top_left.col));
             }
+        });
+    return result;
+}
+
+void Sheet::ForEachSpilledValue(const std::function<void(Position, const FormulaInterface::Value&)>& action_) const
+{
+    graph.ForEachSpill([this, &action_](Position anchor_, const Range& area_)
+        {
+            for (int row = area_.top_left.row; row < area_.top_left.row + area_.size.rows; ++row)
+            {
+                for (int col = area_.top_left.col; col < area_.top_left.col + area_.size.cols; ++col)
+                {
+                    const Position pos{ row, col };
+                    if (pos == anchor_)
+                    {
+                        continue;
+                    }
+                    if (const std::optional<FormulaInterface::Value> value = GetSpilledValue(pos))
+                    {
+                        action_(pos, *value);
+                    }
+                }
+            }
+        });
+}
+
+// The cell at pos_ was replaced, and old_area_ is where it spilled before. Formulas spilling
+// over pos_ or over either area may have gained or lost room, and the readers of the old area
+// read other values now: they go into affected_. The cells of both areas show other values.
+void Sheet::TrackSpill(Position pos_, const Range& old_area_, std::vector<Position>& affected_)
+{
+    if (!graph.HasSpills() && old_area_.size == Size{ 1, 1 })
+    {
+        return;
+    }
+
+    const auto add_anchors = [this, pos_, &affected_](const Range& range_)
+        {
+            graph.ForEachSpill(range_, [pos_, &affected_](Position anchor_, const Range& /* area */)
+                {
+                    if (!(anchor_ == pos_))
+                    {
+                        affected_.push_back(anchor_);
+                    }
+                });
+        };
+    add_anchors(Range{ pos_, Size{ 1, 1 } });
+
+    const Range new_area = graph.GetSpill(pos_);
+    if (new_area == old_area_)
+    {
+        return;
+    }
+
+    if (!(old_area_.size == Size{ 1, 1 }))
+    {
+        add_anchors(old_area_);
+        graph.ForEachDependentIn(old_area_, [&affected_](Position reader_)
+            {
+                affected_.push_back(reader_);
+            });
+        MarkAreaChanged(old_area_);
 
-            const auto& it = cells.find({ row, col });
+        for (int row = old_area_.top_left.row; row < old_area_.top_left.row + old_area_.size.rows; ++row)
+        {
+            for (int col = old_area_.top_left.col; col < old_area_.top_left.col + old_area_.size.cols; ++col)
+            {
+                if (!GetCellPtr({ row, col }) && !IsSpilledOver({ row, col }))
+                {
+                    occupancy.Remove({ row, col });
+                }
+            }
+        }
+        for (auto it = spilled_cells.begin(); it != spilled_cells.end();)
+        {
+            it = old_area_.Contains(it->first) ? spilled_cells.erase(it) : std::next(it);
+        }
+    }
 
-            if (it != cells.end() && it->second != nullptr && !it->second->GetText().empty()) 
+    if (!(new_area.size == Size{ 1, 1 }))
+    {
+        add_anchors(new_area);
+        MarkAreaChanged(new_area);
+        for (int row = new_area.top_left.row; row < new_area.top_left.row + new_area.size.rows; ++row)
+        {
+            for (int col = new_area.top_left.col; col < new_area.top_left.col + new_area.size.cols; ++col)
             {
-                output_ << it->second->GetText();
+                occupancy.Add({ row, col });
             }
         }
-        output_ << "\n";
     }
 }
 
-Cell* Sheet::GetCellPtr(Position pos_)
+// Whether pos_ is in an area spilled by a formula other than one at pos_.
+bool Sheet::IsSpilledOver(Position pos_) const
 {
-    if (!pos_.IsValid())
+    bool result = false;
+    graph.ForEachSpill(Range{ pos_, Size{ 1, 1 } }, [pos_, &result](Position anchor_, const Range& /* area */)
+        {
+            result = result || !(anchor_ == pos_);
+        });
+    return result;
+}
+
+// Lookups and snapshots read the cells of area_ again.
+void Sheet::MarkAreaChanged(const Range& area_)
+{
+    for (int col = area_.top_left.col; col < area_.top_left.col + area_.size.cols; ++col)
     {
-        throw InvalidPositionException("Invalid position");
+        if (const auto index = column_indexes.find(col); index != column_indexes.end())
+        {
+            for (int row = area_.top_left.row; row < area_.top_left.row + area_.size.rows; ++row)
+            {
+                index->second.MarkStale(row);
+            }
+        }
+    }
+
+    if (snapshots_enabled)
+    {
+        for (int row = area_.top_left.row; row < area_.top_left.row + area_.size.rows; ++row)
+        {
+            for (int col = area_.top_left.col; col < area_.top_left.col + area_.size.cols; ++col)
+            {
+                MarkDirty({ row, col });
+            }
+        }
+    }
+}
+
+CellInterface::Value Sheet::GetShownValue(Position pos_) const
+{
+    if (const std::optional<FormulaInterface::Value> spilled = GetSpilledValue(pos_))
+    {
+        return std::visit([](const auto& value_) -> CellInterface::Value { return value_; }, *spilled);
+    }
+    const Cell* cell = GetCellPtr(pos_);
+    return cell ? cell->GetValue() : CellInterface::Value("");
+}
+
+Sheet::SpilledCell::SpilledCell(const Sheet& sheet_, Position pos_) : sheet(sheet_), pos(pos_) {}
+
+CellInterface::Value Sheet::SpilledCell::GetValue() const
+{
+    return sheet.GetShownValue(pos);
+}
+
+CellInterface::ValueView Sheet::SpilledCell::GetValueView() const
+{
+    return sheet.GetValueView(pos);
+}
+
+std::string Sheet::SpilledCell::GetText() const
+{
+    return "";
+}
+
+std::vector<Position> Sheet::SpilledCell::GetReferencedCells() const
+{
+    return {};
+}
+
+void Sheet::SetRange(Position top_left_, int rows_, int cols_, const std::vector<std::string>& texts_, Layout layout_)
+{
+    SetRangeCells(top_left_, rows_, cols_, texts_.size(), layout_, [&](size_t index_)
+        {
+            return Cell(texts_[index_], *this, &arena, &strings, &expressions);
+        });
+}
+
+void Sheet::SetNumberRange(Position top_left_, int rows_, int cols_, const std::vector<double>& numbers_, Layout layout_)
+{
+    SetRangeCells(top_left_, rows_, cols_, numbers_.size(), layout_, [&](size_t index_)
+        {
+            return Cell(numbers_[index_], &arena);
+        });
+}
+
+template <typename MakeCell>
+void Sheet::SetRangeCells(Position top_left_, int rows_, int cols_, size_t count_, Layout layout_, MakeCell&& make_cell_)
+{
+    const Range range{ top_left_, Size{ rows_, cols_ } };
+    if (!range.IsValid())
+    {
+        throw InvalidPositionException("Invalid range");
+    }
+    if (range.GetCellCount() != count_)
+    {
+        throw std::invalid_argument("SetRange: value count does not match the range");
     }
+    CheckMutable();
+    ++version;
+
+    TraceScope trace("SetRange", "edit", top_left_);
+
+    // Positions follow the order of the input so cells are created as they are read.
+    std::vector<Position> positions(count_);
+    for (size_t index = 0; index < count_; ++index)
+    {
+        const int major = static_cast<int>(index / static_cast<size_t>(layout_ == Layout::RowMajor ? cols_ : rows_));
+        const int minor = static_cast<int>(index % static_cast<size_t>(layout_ == Layout::RowMajor ? cols_ : rows_));
+        positions[index] = layout_ == Layout::RowMajor
+            ? Position{ top_left_.row + major, top_left_.col + minor }
+            : Position{ top_left_.row + minor, top_left_.col + major };
+    }
+
+    std::vector<Cell> batch;
+    std::vector<Position> affected;
+    batch.reserve(count_);
+    {
+        TraceScope phase("parse", "edit", top_left_);
+        for (size_t index = 0; index < count_; ++index)
+        {
+            batch.push_back(make_cell_(index));
+        }
+    }
+
+    // Values shown in spill areas are remembered while the graph still holds the old areas.
+    std::vector<Range> old_spills(count_);
+    for (size_t index = 0; index < count_; ++index)
+    {
+        old_spills[index] = graph.GetSpill(positions[index]);
+        if (feed_enabled && !(old_spills[index].size == Size{ 1, 1 } && batch[index].GetArraySize() == Size{ 1, 1 }))
+        {
+            RememberValues(old_spills[index]);
+            RememberValues(Range{ positions[index], batch[index].GetArraySize() });
+        }
+    }
+
+    // Edges are rewired before the cells are stored, so formulas in the batch can see each
+    // other during the cycle check; on a cycle the previous references are put back.
+    std::vector<std::tuple<Position, std::vector<Position>, std::vector<Range>, Size>> rewired;
+    {
+        TraceScope phase("cycle_check", "edit", top_left_);
+        for (size_t index = 0; index < count_; ++index)
+        {
+            const Position pos = positions[index];
+            const Cell* old = GetCellPtr(pos);
+            std::vector<Position> old_references = old ? old->GetReferencedCells() : std::vector<Position>{};
+            std::vector<Range> old_ranges = old ? old->GetReferencedRanges() : std::vector<Range>{};
+            const std::vector<Position> references = batch[index].GetReferencedCells();
+            const std::vector<Range> ranges = batch[index].GetReferencedRanges();
+            if (references.empty() && old_references.empty() && ranges.empty() && old_ranges.empty())
+            {
+                continue;
+            }
+
+            const Size spill = batch[index].GetArraySize();
+            if (graph.WouldIntroduceCycle(pos, references, ranges, spill))
+            {
+                for (auto it = rewired.rbegin(); it != rewired.rend(); ++it)
+                {
+                    graph.SetReferences(std::get<0>(*it), std::get<1>(*it), std::get<2>(*it));
+                    graph.SetSpill(std::get<0>(*it), std::get<3>(*it));
+                }
+                throw CircularDependencyException("");
+            }
+            graph.SetReferences(pos, references, ranges);
+            graph.SetSpill(pos, spill);
+            rewired.emplace_back(pos, std::move(old_references), std::move(old_ranges), old_spills[index].size);
+        }
+    }
+
+    {
+        TraceScope phase("rewire", "edit", top_left_);
+        cells.reserve(cells.size() + count_);
+        for (size_t index = 0; index < count_; ++index)
+        {
+            const Position pos = positions[index];
+            RememberValue(pos);
+            const auto [it, inserted] = cells.try_emplace(pos);
+            if (!inserted)
+            {
+                TrackUsage(it->second, false);
+                ForgetSharedValues(it->second);
+            }
+            Cell& target = it->second = std::move(batch[index]);
+            TrackUsage(target, true);
+            target.AttachProfiler(profiling ? &profiler : nullptr, pos);
+            removed.erase(pos);
+            occupancy.Add(pos);
+        }
+        for (int col = top_left_.col; col < top_left_.col + cols_; ++col)
+        {
+            ForgetMatches({ top_left_.row, col }, rows_);
+        }
+        for (size_t index = 0; index < count_; ++index)
+        {
+            TrackSpill(positions[index], old_spills[index], affected);
+        }
 
+        for (const auto& rewire : rewired)
+        {
+            for (const Position& reference : GetCellPtr(std::get<0>(rewire))->GetReferencedCells())
+            {
+                if (!GetCellPtr(reference))
+                {
+                    SetCell(reference, "");
+                }
+            }
+        }
+    }
+
+    {
+        TraceScope phase("invalidate", "edit", top_left_);
+        InvalidateCells(positions, affected);
+    }
+
+    if (journal)
+    {
+        for (const Position& pos : positions)
+        {
+            journal->AppendSet(pos, GetCellPtr(pos)->GetText());
+        }
+    }
+}
+
+void Sheet::GetValues(Range range_, const RangeValues& out_) const
+{
+    if (!range_.IsValid())
+    {
+        throw InvalidPositionException("Invalid range");
+    }
+
+    TraceScope trace("GetValues", "export", range_.top_left);
+    using Kind = RangeValues::Kind;
+
+    // Row-major order also keeps evaluation of formulas that read the rows above them shallow.
+    size_t slot = 0;
+    for (int row = range_.top_left.row; row < range_.top_left.row + range_.size.rows; ++row)
+    {
+        for (int col = range_.top_left.col; col < range_.top_left.col + range_.size.cols; ++col, ++slot)
+        {
+            const auto store = [&out_, slot](const FormulaInterface::Value& value_)
+                {
+                    if (std::holds_alternative<double>(value_))
+                    {
+                        out_.kinds[slot] = Kind::Number;
+                        out_.numbers[slot] = std::get<double>(value_);
+                    }
+                    else
+                    {
+                        out_.kinds[slot] = Kind::Error;
+                        out_.errors[slot] = std::get<FormulaError>(value_).GetCategory();
+                    }
+                };
+
+            const Cell* cell = GetCellPtr({ row, col });
+            switch (cell ? cell->GetKind() : Cell::Kind::Empty)
+            {
+            case Cell::Kind::Empty:
+                if (const std::optional<FormulaInterface::Value> spilled = GetSpilledValue({ row, col }))
+                {
+                    store(*spilled);
+                }
+                else
+                {
+                    out_.kinds[slot] = Kind::Empty;
+                }
+                break;
+
+            case Cell::Kind::Number:
+            case Cell::Kind::Text:
+                out_.kinds[slot] = Kind::Text;
+                out_.texts[slot] = cell->GetDisplayedText();
+                break;
+
+            case Cell::Kind::Formula:
+                store(cell->GetFormulaValue());
+                break;
+            }
+        }
+    }
+}
+
+const DependencyGraph& Sheet::GetGraph() const
+{
+    return graph;
+}
+
+void Sheet::ForEachCell(const std::function<void(Position, const Cell&)>& action_) const
+{
+    for (const auto& [pos, cell] : cells)
+    {
+        action_(pos, cell);
+    }
+
+    if (base)
+    {
+        base->ForEachCell([this, &action_](Position pos_, const Cell& cell_)
+            {
+                if (cells.find(pos_) == cells.end() && !removed.count(pos_))
+                {
+                    action_(pos_, cell_);
+                }
+            });
+    }
+}
+
+void Sheet::AttachJournal(Journal* journal_)
+{
+    journal = journal_;
+}
+
+void Sheet::EnableSnapshots()
+{
+    snapshots_enabled = true;
+    dirty.clear();
+    std::atomic_store(&snapshot, SheetSnapshot::Build(*this, 0));
+}
+
+void Sheet::Publish()
+{
+    if (!snapshots_enabled)
+    {
+        return;
+    }
+
+    TraceScope trace("Publish", "export");
+
+    std::sort(dirty.begin(), dirty.end());
+    dirty.erase(std::unique(dirty.begin(), dirty.end()), dirty.end());
+
+    std::atomic_store(&snapshot, snapshot->Update(*this, dirty, snapshot->GetVersion() + 1));
+    dirty.clear();
+}
+
+std::shared_ptr<const SheetSnapshot> Sheet::GetSnapshot() const
+{
+    return std::atomic_load(&snapshot);
+}
+
+void Sheet::MarkDirty(Position pos_)
+{
+    if (snapshots_enabled)
+    {
+        dirty.push_back(pos_);
+    }
+}
+
+uint64_t Sheet::GetVersion() const
+{
+    return version;
+}
+
+void Sheet::EnableChangeFeed()
+{
+    // The feed compares against values it has seen, so every formula gets one now.
+    ForEachCell([](Position /* pos */, const Cell& cell_)
+        {
+            cell_.GetValue();
+        });
+
+    feed_enabled = true;
+    feed_pending.clear();
+    feed_text_bytes = 0;
+}
+
+Sheet::ChangeSet Sheet::GetChanges(uint64_t since_)
+{
+    if (!feed_enabled)
+    {
+        throw std::logic_error("Change feed is not enabled");
+    }
+    FlushChanges();
+
+    ChangeSet result{ version, {} };
+    auto it = std::upper_bound(change_log.begin(), change_log.end(), since_, [](uint64_t since, const auto& entry_)
+        {
+            return since < entry_.first;
+        });
+    for (; it != change_log.end(); ++it)
+    {
+        if (last_change[it->second] == it->first)
+        {
+            result.cells.push_back(it->second);
+        }
+    }
+    return result;
+}
+
+std::unique_ptr<Sheet> Sheet::Fork()
+{
+    // Children read unchanged cells straight from this sheet, possibly from several threads,
+    // so every formula is evaluated and every number spelled now, and the sheet stays frozen
+    // while forks are alive.
+    ForEachCell([](Position /* pos */, const Cell& cell_)
+        {
+            cell_.GetValueView();
+        });
+
+    ++forks;
+    return std::unique_ptr<Sheet>(new Sheet(*this));
+}
+
+void Sheet::EnableProfiling(bool enabled_)
+{
+    profiling = enabled_;
+    for (auto& [pos, cell] : cells)
+    {
+        cell.AttachProfiler(enabled_ ? &profiler : nullptr, pos);
+    }
+}
+
+const RecalcProfiler& Sheet::GetProfiler() const
+{
+    return profiler;
+}
+
+RecalcProfiler& Sheet::GetProfiler()
+{
+    return profiler;
+}
+
+size_t Sheet::MemoryUsage::GetTotalBytes() const
+{
+    return cell_bytes + formula_bytes + ast_bytes + text_bytes + graph_bytes + table_bytes + index_bytes + feed_bytes;
+}
+
+Sheet::MemoryUsage Sheet::GetMemoryUsage() const
+{
+    MemoryUsage result = usage;
+    result.text_bytes += strings.GetTextBytes();
+    result.graph_bytes = graph.GetMemoryUsage();
+    result.index_bytes = lookup_bytes + occupancy.GetMemoryUsage();
+
+    // Hash nodes carry a link and the key next to the cell; buckets are one pointer each.
+    const size_t cell_node = sizeof(Table::value_type) + sizeof(void*) - sizeof(Cell);
+    const size_t removed_node = sizeof(Position) + sizeof(void*);
+    const size_t shared_node = sizeof(decltype(shared_values)::value_type) + sizeof(void*);
+    const size_t spilled_node = sizeof(decltype(spilled_cells)::value_type) + sizeof(void*);
+    result.table_bytes = cells.bucket_count() * sizeof(void*) + cells.size() * cell_node
+        + removed.bucket_count() * sizeof(void*) + removed.size() * removed_node
+        + strings.GetIndexBytes() + expressions.GetIndexBytes()
+        + shared_values.bucket_count() * sizeof(void*) + shared_values.size() * shared_node
+        + spilled_cells.bucket_count() * sizeof(void*) + spilled_cells.size() * spilled_node;
+
+    const size_t pending_node = sizeof(decltype(feed_pending)::value_type) + sizeof(void*);
+    const size_t change_node = sizeof(decltype(last_change)::value_type) + sizeof(void*);
+    result.feed_bytes = feed_pending.bucket_count() * sizeof(void*) + feed_pending.size() * pending_node + feed_text_bytes
+        + change_log.capacity() * sizeof(decltype(change_log)::value_type)
+        + last_change.bucket_count() * sizeof(void*) + last_change.size() * change_node;
+    return result;
+}
+
+size_t Sheet::GetCriticalPathLength() const
+{
+    std::unordered_map<Position, size_t, PositionHasher> depth;
+    size_t longest = 0;
+
+    ForEachCell([&](Position pos_, const Cell& /* cell */)
+        {
+            // Post-order walk with an explicit stack: the second visit of a formula sees all its references resolved.
+            std::vector<std::pair<Position, bool>> to_visit{ { pos_, false } };
+            while (!to_visit.empty())
+            {
+                const auto [current, expanded] = to_visit.back();
+                const Cell* cell = GetCellPtr(current);
+                if (depth.count(current) || !cell || cell->GetKind() != Cell::Kind::Formula)
+                {
+                    depth.try_emplace(current, 0);
+                    to_visit.pop_back();
+                    continue;
+                }
+
+                const std::vector<Position> references = cell->GetReferencedCells();
+                if (!expanded)
+                {
+                    to_visit.back().second = true;
+                    for (const Position& reference : references)
+                    {
+                        if (!depth.count(reference))
+                        {
+                            to_visit.emplace_back(reference, false);
+                        }
+                    }
+                    continue;
+                }
+
+                size_t deepest = 0;
+                for (const Position& reference : references)
+                {
+                    deepest = std::max(deepest, depth[reference]);
+                }
+                depth[current] = deepest + 1;
+                to_visit.pop_back();
+            }
+            longest = std::max(longest, depth[pos_]);
+        });
+
+    return longest;
+}
+
+Cell* Sheet::GetLocalCell(Position pos_)
+{
     const auto cell = cells.find(pos_);
-    if (cell == cells.end()) 
+    if (cell != cells.end())
+    {
+        return &cell->second;
+    }
+
+    const Cell* shared = GetCellPtr(pos_);
+    if (!shared)
     {
         return nullptr;
     }
 
-    return cells.at(pos_).get();
+    Cell& local = cells.try_emplace(pos_, *shared, *this, &arena, &strings).first->second;
+    TrackUsage(local, true);
+    local.AttachProfiler(profiling ? &profiler : nullptr, pos_);
+    return &local;
 }
 
-const Cell* Sheet::GetCellPtr(Position pos_) const
+void Sheet::InvalidateCells(const std::vector<Position>& changed_, const std::vector<Position>& affected_)
+{
+    std::vector<Position> to_visit(affected_);
+    size_t invalidated = 0;
+
+    const auto invalidate = [&](Position pos_, Cell& cell_)
+        {
+            RememberValue(pos_);
+            if (graph.HasSpills())
+            {
+                // The cells a formula spills into show its values, so they change with it.
+                const Range area = graph.GetSpill(pos_);
+                RememberValues(area);
+                MarkAreaChanged(area);
+            }
+            cell_.InvalidateCache();
+            ForgetSharedValues(cell_);
+            MarkDirty(pos_);
+            if (const auto index = column_indexes.find(pos_.col); index != column_indexes.end())
+            {
+                index->second.MarkStale(pos_.row);
+            }
+            ++invalidated;
+
+            graph.ForEachDependent(pos_, [&to_visit](Position dependent_)
+                {
+                    to_visit.push_back(dependent_);
+                });
+        };
+
+    // Changed cells are always reset. Past them, a cell whose cache is already
+    // invalid had its dependents reset when it lost the cache, so the walk stops there.
+    for (const Position& pos : changed_)
+    {
+        if (Cell* cell = GetLocalCell(pos))
+        {
+            invalidate(pos, *cell);
+        }
+    }
+
+    while (!to_visit.empty())
+    {
+        const Position current = to_visit.back();
+        to_visit.pop_back();
+
+        Cell* cell = GetLocalCell(current);
+        if (cell && cell->IsCacheValid())
+        {
+            invalidate(current, *cell);
+        }
+    }
+
+    if (profiling && !changed_.empty())
+    {
+        profiler.RecordInvalidation(changed_.front(), invalidated);
+    }
+}
+
+void Sheet::RememberValue(Position pos_)
+{
+    if (!feed_enabled || feed_pending.count(pos_))
+    {
+        return;
+    }
+
+    static const size_t inline_capacity = std::string().capacity();
+    const CellInterface::Value& seen = feed_pending.emplace(pos_, GetShownValue(pos_)).first->second;
+    if (const std::string* text = std::get_if<std::string>(&seen); text && text->capacity() > inline_capacity)
+    {
+        feed_text_bytes += text->capacity() + 1;
+    }
+}
+
+void Sheet::RememberValues(const Range& area_)
 {
-    return const_cast<Sheet*>(this)->GetCellPtr(pos_);
+    if (!feed_enabled || area_.size == Size{ 1, 1 } || !area_.IsValid())
+    {
+        return;
+    }
+
+    for (int row = area_.top_left.row; row < area_.top_left.row + area_.size.rows; ++row)
+    {
+        for (int col = area_.top_left.col; col < area_.top_left.col + area_.size.cols; ++col)
+        {
+            RememberValue({ row, col });
+        }
+    }
+}
+
+void Sheet::FlushChanges()
+{
+    std::vector<std::pair<Position, CellInterface::Value>> pending(
+        std::make_move_iterator(feed_pending.begin()), std::make_move_iterator(feed_pending.end()));
+    feed_pending.clear();
+    feed_text_bytes = 0;
+
+    // Top rows first, so chains that read the rows above them evaluate without deep recursion.
+    std::sort(pending.begin(), pending.end(), [](const auto& lhs_, const auto& rhs_)
+        {
+            return lhs_.first < rhs_.first;
+        });
+
+    for (const auto& [pos, seen] : pending)
+    {
+        if (!(GetShownValue(pos) == seen))
+        {
+            change_log.emplace_back(version, pos);
+            last_change[pos] = version;
+        }
+    }
+
+    // Drop entries superseded by a later change once they make up most of the log.
+    if (change_log.size() > 1024 && change_log.size() > 2 * last_change.size())
+    {
+        change_log.erase(std::remove_if(change_log.begin(), change_log.end(), [this](const auto& entry_)
+            {
+                return last_change[entry_.second] != entry_.first;
+            }), change_log.end());
+    }
+}
+
+void Sheet::TrackUsage(const Cell& cell_, bool added_)
+{
+    const Cell::HeapUsage heap = cell_.GetHeapUsage();
+    const auto track = [added_](size_t& counter_, size_t amount_)
+        {
+            counter_ = added_ ? counter_ + amount_ : counter_ - amount_;
+        };
+
+    track(usage.cells, 1);
+    track(usage.empty_cells, cell_.GetKind() == Cell::Kind::Empty ? 1 : 0);
+    track(usage.formula_cells, cell_.GetKind() == Cell::Kind::Formula ? 1 : 0);
+    track(usage.cell_bytes, sizeof(Cell));
+    track(usage.formula_bytes, heap.formula);
+    track(usage.ast_bytes, heap.ast);
+    track(usage.text_bytes, heap.text);
+}
+
+void Sheet::CheckMutable() const
+{
+    if (forks > 0)
+    {
+        throw std::logic_error("Sheet cannot be modified while it has live forks");
+    }
 }
 
 std::unique_ptr<SheetInterface> CreateSheet() 
@@ -2,53 +2,290 @@
 
 #include "cell.h"
 #include "common.h"
+#include "graph.h"
+#include "kernel.h"
+#include "lookup.h"
+#include "occupancy.h"
+#include "profiler.h"
+#include "snapshot.h"
 
+#include <atomic>
 #include <functional>
+#include <map>
+#include <memory_resource>
+#include <optional>
 #include <unordered_map>
+#include <unordered_set>
 
-class CellHasher 
-{
-public:
-
-    size_t operator()(const Position p_) const 
-    {
-        return std::hash<std::string>()(p_.ToString());
-    }
-};
+class Journal;
 
-class CellComparator 
+class Sheet : public SheetInterface 
 {
 public:
 
-    bool operator()(const Position& lhs_, const Position& rhs_) const 
+    using Table = std::pmr::unordered_map<Position, Cell, PositionHasher>;
+
+    // Bytes held by the sheet, split by what they are spent on. Parsed formulas
+    // are shared with forks and are counted in every sheet that holds them.
+    struct MemoryUsage
     {
-        return lhs_ == rhs_;
-    }
-};
+        size_t cells = 0;
+        size_t empty_cells = 0;
+        size_t formula_cells = 0;
 
-class Sheet : public SheetInterface 
-{
-public:
+        size_t cell_bytes = 0;
+        size_t formula_bytes = 0;
+        size_t ast_bytes = 0;
+        size_t text_bytes = 0;
+        size_t graph_bytes = 0;
+        size_t table_bytes = 0;
+        size_t index_bytes = 0;
+        size_t feed_bytes = 0;
 
-    using Table = std::unordered_map<Position, std::unique_ptr<Cell>, CellHasher, CellComparator>;
+        size_t GetTotalBytes() const;
+    };
 
+    explicit Sheet(std::pmr::memory_resource* upstream_ = std::pmr::get_default_resource());
     ~Sheet();
 
     void SetCell(Position pos, std::string text_) override;
 
+    // A cell an array formula spills into and that has no value of its own is read
+    // through a view of the formula's element there, which has no text.
     const CellInterface* GetCell(Position pos_) const override;
     CellInterface* GetCell(Position pos_) override;
 
     void ClearCell(Position pos_) override;
 
+    enum class Layout
+    {
+        RowMajor,
+        ColumnMajor,
+    };
+
+    // Sets a rows_ x cols_ block in one step, equivalent to SetCell for every cell
+    // but with one cycle check, one graph update and one invalidation pass. Either
+    // every cell is set or, if a text does not parse or a cycle would form, none is.
+    void SetRange(Position top_left_, int rows_, int cols_, const std::vector<std::string>& texts_, Layout layout_ = Layout::RowMajor);
+    void SetNumberRange(Position top_left_, int rows_, int cols_, const std::vector<double>& numbers_, Layout layout_ = Layout::RowMajor);
+
     Size GetPrintableSize() const override;
     const Cell* GetCellPtr(Position pos_) const;
-    Cell* GetCellPtr(Position pos_);
+
+    // An array formula spills its elements into the area of its shape below and right of
+    // it, and has room when no other cell of the area has a value and no other area
+    // overlaps it. Spill areas count towards the printable size.
+    CellInterface::ValueView GetValueView(Position pos_) const override;
+    bool CanSpill(Position anchor_, Size size_) const override;
+    // Element an array formula spills into pos_, evaluating the formula when stale;
+    // nothing when pos_ has a value of its own or no formula with room spills there.
+    std::optional<FormulaInterface::Value> GetSpilledValue(Position pos_) const;
+    void ForEachSpilledValue(const std::function<void(Position, const FormulaInterface::Value&)>& action_) const;
+
+    // Caller-owned columnar output of GetValues with one slot per cell of the range,
+    // row by row. For each slot only the array matching its kind is written. Text views
+    // stay valid until the cell changes; text that spells a number is text like any other.
+    struct RangeValues
+    {
+        enum class Kind : uint8_t
+        {
+            Empty,
+            Number,
+            Text,
+            Error,
+        };
+
+        Kind* kinds = nullptr;
+        double* numbers = nullptr;
+        FormulaError::Category* errors = nullptr;
+        std::string_view* texts = nullptr;
+    };
+
+    // Reads a whole range without allocating, evaluating stale formulas on the way.
+    void GetValues(Range range_, const RangeValues& out_) const;
+    const DependencyGraph& GetGraph() const;
 
     void PrintValues(std::ostream& output_) const override;
     void PrintTexts(std::ostream& output_) const override;
 
+    // Answered from an index per column, built on the first lookup into the column
+    // and refreshed row by row as edits and recalculation reach it.
+    int FindInColumn(Range column_, LookupKey key_, LookupMode mode_) const override;
+    size_t CountIf(Range range_, const LookupCriterion& criterion_) const override;
+
+    // Formulas of the sheet are parsed through one expression pool, so a subexpression
+    // written in several formulas is one node, and its value is kept here once. A kept
+    // value is dropped whenever a formula containing it is invalidated or replaced:
+    // every change to what it reads invalidates all those formulas.
+    double EvaluateShared(uint64_t key_, const std::function<double()>& evaluate_) const override;
+
+    struct SharingStats
+    {
+        uint64_t evaluations = 0;
+        uint64_t hits = 0;
+        size_t values = 0;
+        size_t nodes = 0;
+    };
+
+    SharingStats GetSharingStats() const;
+
+    // A stale formula read on its own first looks for its copies filled down the column
+    // around it that are stale as well. A run of at least MIN_RUN of them is evaluated
+    // as one ColumnKernel over the values of the cells they read; a lane that reads
+    // text or an error, or fails, is left for its formula to evaluate on its own.
+    // Nothing is batched while profiling, which times every formula by itself.
+    void EvaluateColumnRun(Position pos_) const override;
+
+    struct KernelStats
+    {
+        uint64_t runs = 0;
+        uint64_t lanes = 0;
+        uint64_t failed_lanes = 0;
+    };
+
+    KernelStats GetKernelStats() const;
+
+    void ForEachCell(const std::function<void(Position, const Cell&)>& action_) const;
+
+    void AttachJournal(Journal* journal_);
+
+    void EnableSnapshots();
+    void Publish();
+    std::shared_ptr<const SheetSnapshot> GetSnapshot() const;
+    void MarkDirty(Position pos_);
+
+    std::unique_ptr<Sheet> Fork();
+
+    // Grows by at least one with every edit.
+    uint64_t GetVersion() const;
+
+    struct ChangeSet
+    {
+        uint64_t version = 0;
+        std::vector<Position> cells;
+    };
+
+    // Change feed: cells whose value differs from what the feed last saw. Stale formulas
+    // touched by edits are evaluated when the feed is read, and their changes are
+    // stamped with the version current at that read; GetChanges(set.version) on the
+    // next read returns only what changed in between.
+    void EnableChangeFeed();
+    ChangeSet GetChanges(uint64_t since_);
+
+    void EnableProfiling(bool enabled_);
+    const RecalcProfiler& GetProfiler() const;
+    RecalcProfiler& GetProfiler();
+
+    MemoryUsage GetMemoryUsage() const;
+
+    // Number of formulas on the longest chain that has to be evaluated one after another.
+    size_t GetCriticalPathLength() const;
+
 private:
 
-    Table cells;
+    explicit Sheet(Sheet& base_);
+
+    class SpilledCell : public CellInterface
+    {
+    public:
+
+        SpilledCell(const Sheet& sheet_, Position pos_);
+
+        Value GetValue() const override;
+        ValueView GetValueView() const override;
+        std::string GetText() const override;
+        std::vector<Position> GetReferencedCells() const override;
+
+    private:
+
+        const Sheet& sheet;
+        Position pos;
+    };
+
+    Cell* GetLocalCell(Position pos_);
+    template <typename MakeCell>
+    void SetRangeCells(Position top_left_, int rows_, int cols_, size_t count_, Layout layout_, MakeCell&& make_cell_);
+    // affected_ are reset like dependents of the changed cells, when they are not stale already.
+    void InvalidateCells(const std::vector<Position>& changed_, const std::vector<Position>& affected_ = {});
+    void RememberValue(Position pos_);
+    void RememberValues(const Range& area_);
+    void FlushChanges();
+    void CheckMutable() const;
+    ColumnIndex& GetColumnIndex(int col_) const;
+    void ForgetSharedValues(const Cell& cell_);
+    bool ContinuesRun(const Cell& upper_, const Cell& lower_, bool lower_is_new_) const;
+    void ForgetMatches(Position pos_, int rows_ = 1);
+    void TrackSpill(Position pos_, const Range& old_area_, std::vector<Position>& changed_);
+    bool IsSpilledOver(Position pos_) const;
+    void MarkAreaChanged(const Range& area_);
+    CellInterface::Value GetShownValue(Position pos_) const;
+    void TrackUsage(const Cell& cell_, bool added_);
+    template <typename Print>
+    void PrintCells(std::ostream& output_, Print&& print_) const;
+
+    Sheet* base = nullptr;
+    std::atomic<int> forks = 0;
+
+    // The cells and everything kept over them, down to the indexes and caches filled
+    // while formulas are read, are carved out of this pool, so building and tearing
+    // down a sheet does not go through the global allocator once per cell and sheets
+    // used by different threads never share allocator state. Parsed formula trees,
+    // the text of values held for the feed, evaluation scratch, the profiler and the
+    // snapshots handed to other threads still come from the global allocator.
+    std::pmr::unsynchronized_pool_resource arena;
+
+    // Declared ahead of the cells, which hold its entries until they are destroyed.
+    StringPool strings{ &arena };
+    ExpressionPool expressions{ &arena };
+    Table cells{ &arena };
+    std::pmr::unordered_set<Position, PositionHasher> removed{ &arena };
+    // Positions visible through this sheet, base cells and spill areas included, for sizing and printing.
+    OccupancyIndex occupancy{ &arena };
+    DependencyGraph graph{ &arena };
+    // Column indexes are built by lookups, which run while formulas are read, and keep
+    // the bytes they take in lookup_bytes.
+    mutable size_t lookup_bytes = 0;
+    mutable std::pmr::map<int, ColumnIndex> column_indexes{ &arena };
+    // Values of shared subexpressions, keyed by node; filled while formulas are read.
+    mutable std::pmr::unordered_map<uint64_t, FormulaInterface::Value> shared_values{ &arena };
+    mutable SharingStats sharing;
+    struct ColumnRun
+    {
+        int col;
+        int first_row;
+        int last_row;
+    };
+
+    static const int MIN_RUN = 16;
+    static const int MAX_RUN = 4096;
+    // Runs whose inputs are being read. Those inputs can be formulas reading cells of the
+    // run back, which are then evaluated on their own rather than as a new run.
+    mutable std::vector<ColumnRun> active_runs;
+    // Scratch for compiling a stale formula and the formulas around it.
+    mutable ColumnKernel run_kernel;
+    mutable ColumnKernel probe_kernel;
+    mutable KernelStats kernel_stats;
+    // Views handed out by GetCell for cells of spill areas, made on the first request.
+    mutable std::pmr::unordered_map<Position, SpilledCell, PositionHasher> spilled_cells{ &arena };
+    Journal* journal = nullptr;
+
+    bool snapshots_enabled = false;
+    std::vector<Position> dirty;
+    std::shared_ptr<const SheetSnapshot> snapshot;
+
+    bool profiling = false;
+    RecalcProfiler profiler;
+
+    // Per-cell parts of the usage, kept up to date as cells come and go.
+    MemoryUsage usage;
+
+    uint64_t version = 0;
+    bool feed_enabled = false;
+    // Values the feed last saw for cells edited or invalidated since.
+    std::pmr::unordered_map<Position, CellInterface::Value, PositionHasher> feed_pending{ &arena };
+    // Heap bytes of the texts among those values.
+    size_t feed_text_bytes = 0;
+    // (version, cell) in version order; an entry is live while it is the cell's latest change.
+    std::pmr::vector<std::pair<uint64_t, Position>> change_log{ &arena };
+    std::pmr::unordered_map<Position, uint64_t, PositionHasher> last_change{ &arena };
 };
\ No newline at end of file
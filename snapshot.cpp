@@ -0,0 +1,146 @@
+#include "snapshot.h"
+
+#include "sheet.h"
+
+namespace
+{
+    // A cell an array formula spilled into has no text of its own.
+    SheetSnapshot::Entry MakeSpilledEntry(const FormulaInterface::Value& value_)
+    {
+        return SheetSnapshot::Entry(std::visit([](const auto& v_) -> CellInterface::Value { return v_; }, value_), "", {});
+    }
+}  // namespace
+
+SheetSnapshot::Entry::Entry(Value value_, std::string text_, std::vector<Position> referenced_cells_) : value(std::move(value_)), text(std::move(text_)), referenced_cells(std::move(referenced_cells_)) {}
+
+CellInterface::Value SheetSnapshot::Entry::GetValue() const
+{
+    return value;
+}
+
+CellInterface::ValueView SheetSnapshot::Entry::GetValueView() const
+{
+    return std::visit([](const auto& value_) -> ValueView { return value_; }, value);
+}
+
+std::string SheetSnapshot::Entry::GetText() const
+{
+    return text;
+}
+
+std::vector<Position> SheetSnapshot::Entry::GetReferencedCells() const
+{
+    return referenced_cells;
+}
+
+const CellInterface* SheetSnapshot::GetCell(Position pos_) const
+{
+    if (!pos_.IsValid())
+    {
+        throw InvalidPositionException("Invalid position");
+    }
+
+    const auto chunk = chunks.find(pos_.row / ROWS_PER_CHUNK);
+    if (chunk == chunks.end())
+    {
+        return nullptr;
+    }
+
+    const auto entry = chunk->second->find(pos_);
+    if (entry == chunk->second->end())
+    {
+        return nullptr;
+    }
+
+    return &entry->second;
+}
+
+Size SheetSnapshot::GetPrintableSize() const
+{
+    return printable_size;
+}
+
+uint64_t SheetSnapshot::GetVersion() const
+{
+    return version;
+}
+
+std::shared_ptr<const SheetSnapshot> SheetSnapshot::Build(const Sheet& sheet_, uint64_t version_)
+{
+    auto result = std::make_shared<SheetSnapshot>();
+    std::map<int, std::shared_ptr<Chunk>> building;
+
+    sheet_.ForEachCell([&building](Position pos_, const Cell& cell_)
+        {
+            std::shared_ptr<Chunk>& chunk = building[pos_.row / ROWS_PER_CHUNK];
+            if (!chunk)
+            {
+                chunk = std::make_shared<Chunk>();
+            }
+            chunk->emplace(pos_, Entry(cell_.GetValue(), cell_.GetText(), cell_.GetReferencedCells()));
+        });
+    sheet_.ForEachSpilledValue([&building](Position pos_, const FormulaInterface::Value& value_)
+        {
+            std::shared_ptr<Chunk>& chunk = building[pos_.row / ROWS_PER_CHUNK];
+            if (!chunk)
+            {
+                chunk = std::make_shared<Chunk>();
+            }
+            chunk->insert_or_assign(pos_, MakeSpilledEntry(value_));
+        });
+
+    result->chunks.insert(building.begin(), building.end());
+    result->printable_size = sheet_.GetPrintableSize();
+    result->version = version_;
+
+    return result;
+}
+
+std::shared_ptr<const SheetSnapshot> SheetSnapshot::Update(const Sheet& sheet_, const std::vector<Position>& dirty_, uint64_t version_) const
+{
+    auto result = std::make_shared<SheetSnapshot>(*this);
+    std::map<int, std::shared_ptr<Chunk>> cloned;
+
+    for (const Position& pos : dirty_)
+    {
+        const int key = pos.row / ROWS_PER_CHUNK;
+        std::shared_ptr<Chunk>& chunk = cloned[key];
+        if (!chunk)
+        {
+            const auto shared = chunks.find(key);
+            chunk = shared == chunks.end() ? std::make_shared<Chunk>() : std::make_shared<Chunk>(*shared->second);
+        }
+
+        chunk->erase(pos);
+        const Cell* cell = sheet_.GetCellPtr(pos);
+        if (cell && cell->GetKind() != Cell::Kind::Empty)
+        {
+            chunk->emplace(pos, Entry(cell->GetValue(), cell->GetText(), cell->GetReferencedCells()));
+        }
+        else if (const std::optional<FormulaInterface::Value> spilled = sheet_.GetSpilledValue(pos))
+        {
+            chunk->emplace(pos, MakeSpilledEntry(*spilled));
+        }
+        else if (cell)
+        {
+            chunk->emplace(pos, Entry(cell->GetValue(), cell->GetText(), cell->GetReferencedCells()));
+        }
+    }
+
+    for (auto& [key, chunk] : cloned)
+    {
+        if (chunk->empty())
+        {
+            result->chunks.erase(key);
+        }
+        else
+        {
+            result->chunks[key] = std::move(chunk);
+        }
+    }
+
+    result->printable_size = sheet_.GetPrintableSize();
+    result->version = version_;
+
+    return result;
+}
\ No newline at end of file
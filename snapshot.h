@@ -0,0 +1,57 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+class Sheet;
+
+// Immutable view of the computed sheet state at one version. Rows are split
+// into chunks so a new version copies only the chunks an edit touched and
+// shares the rest with the previous one. Safe to read from any thread.
+class SheetSnapshot
+{
+public:
+
+    class Entry : public CellInterface
+    {
+    public:
+
+        Entry(Value value_, std::string text_, std::vector<Position> referenced_cells_);
+
+        Value GetValue() const override;
+        ValueView GetValueView() const override;
+        std::string GetText() const override;
+        std::vector<Position> GetReferencedCells() const override;
+
+    private:
+
+        Value value;
+        std::string text;
+        std::vector<Position> referenced_cells;
+    };
+
+    const CellInterface* GetCell(Position pos_) const;
+    Size GetPrintableSize() const;
+    uint64_t GetVersion() const;
+
+private:
+
+    friend class Sheet;
+
+    static const int ROWS_PER_CHUNK = 64;
+
+    using Chunk = std::unordered_map<Position, Entry, PositionHasher>;
+
+    static std::shared_ptr<const SheetSnapshot> Build(const Sheet& sheet_, uint64_t version_);
+    std::shared_ptr<const SheetSnapshot> Update(const Sheet& sheet_, const std::vector<Position>& dirty_, uint64_t version_) const;
+
+    std::map<int, std::shared_ptr<const Chunk>> chunks;
+    Size printable_size;
+    uint64_t version = 0;
+};
\ No newline at end of file
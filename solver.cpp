@@ -0,0 +1,335 @@
+#include "solver.h"
+
+#include "sheet.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+Solver::Solver(const Sheet& sheet_, Position input_, Position output_) : sheet(sheet_), input(input_), output(output_), version(sheet_.GetVersion()), view(*this)
+{
+    if (!input_.IsValid() || !output_.IsValid())
+    {
+        throw InvalidPositionException("Invalid position");
+    }
+
+    ExtractCone();
+}
+
+CellInterface::Value Solver::Evaluate(double input_)
+{
+    CheckVersion();
+    values[0] = input_;
+
+    for (size_t index = 0; index < steps.size(); ++index)
+    {
+        Step& step = steps[index];
+        if (step.size == Size{ 1, 1 })
+        {
+            values[index + 1] = step.formula->Evaluate(view);
+        }
+        else if ((step.spilled = view.CanSpill(step.pos, step.size)))
+        {
+            step.formula->EvaluateArray(view, step.array);
+            values[index + 1] = step.array.Get(0);
+        }
+        else
+        {
+            values[index + 1] = FormulaError(FormulaError::Category::Spill);
+        }
+    }
+
+    if (const std::optional<FormulaInterface::Value> value = FindValue(output))
+    {
+        return std::visit([](const auto& value_) -> CellInterface::Value { return value_; }, *value);
+    }
+    const CellInterface* cell = sheet.GetCell(output);
+    return cell ? cell->GetValue() : CellInterface::Value("");
+}
+
+std::optional<double> Solver::GoalSeek(double target_, double guess_, double tolerance_)
+{
+    const auto miss = [this, target_](double input_) -> std::optional<double>
+        {
+            const CellInterface::Value value = Evaluate(input_);
+            if (const double* number = std::get_if<double>(&value))
+            {
+                return *number - target_;
+            }
+            return std::nullopt;
+        };
+
+    double previous = guess_;
+    std::optional<double> previous_miss = miss(previous);
+    if (!previous_miss)
+    {
+        return std::nullopt;
+    }
+    if (std::abs(*previous_miss) <= tolerance_)
+    {
+        return previous;
+    }
+
+    double current = guess_ + std::max(std::abs(guess_) * 0.01, 0.01);
+    for (int iteration = 0; iteration < MAX_ITERATIONS; ++iteration)
+    {
+        const std::optional<double> current_miss = miss(current);
+        if (!current_miss)
+        {
+            return std::nullopt;
+        }
+        if (std::abs(*current_miss) <= tolerance_)
+        {
+            return current;
+        }
+        if (*current_miss == *previous_miss)
+        {
+            return std::nullopt;
+        }
+
+        const double next = current - *current_miss * (current - previous) / (*current_miss - *previous_miss);
+        if (!std::isfinite(next))
+        {
+            return std::nullopt;
+        }
+        previous = current;
+        previous_miss = current_miss;
+        current = next;
+    }
+    return std::nullopt;
+}
+
+size_t Solver::GetConeSize() const
+{
+    return steps.size();
+}
+
+void Solver::ExtractCone()
+{
+    const DependencyGraph& graph = sheet.GetGraph();
+
+    // Every formula the input reaches.
+    std::unordered_set<Position, PositionHasher> reached;
+    std::vector<Position> to_visit{ input };
+    while (!to_visit.empty())
+    {
+        const Position current = to_visit.back();
+        to_visit.pop_back();
+        graph.ForEachDependent(current, [&reached, &to_visit](Position dependent_)
+            {
+                if (reached.insert(dependent_).second)
+                {
+                    to_visit.push_back(dependent_);
+                }
+            });
+    }
+
+    // Reached formulas that hold a cell of range_ or spill into it. Whichever is fewer
+    // is looked through: the cells of the range or the reached formulas.
+    const auto reached_in = [&graph, &reached](const Range& range_, std::vector<Position>& found_)
+        {
+            if (range_.GetCellCount() <= reached.size())
+            {
+                for (int row = range_.top_left.row; row < range_.top_left.row + range_.size.rows; ++row)
+                {
+                    for (int col = range_.top_left.col; col < range_.top_left.col + range_.size.cols; ++col)
+                    {
+                        if (reached.count(Position{ row, col }))
+                        {
+                            found_.push_back(Position{ row, col });
+                        }
+                    }
+                }
+            }
+            else
+            {
+                for (const Position& pos : reached)
+                {
+                    if (range_.Contains(pos))
+                    {
+                        found_.push_back(pos);
+                    }
+                }
+            }
+            graph.ForEachSpill(range_, [&reached, &found_](Position anchor_, const Range& /* area */)
+                {
+                    if (reached.count(anchor_))
+                    {
+                        found_.push_back(anchor_);
+                    }
+                });
+        };
+
+    // Of those, the ones the output reads, each placed after every formula it reads.
+    std::vector<Position> start;
+    reached_in(Range{ output, Size{ 1, 1 } }, start);
+    std::unordered_set<Position, PositionHasher> placed;
+    std::vector<std::pair<Position, bool>> stack;
+    for (const Position& pos : start)
+    {
+        stack.emplace_back(pos, false);
+    }
+    while (!stack.empty())
+    {
+        const auto [current, expanded] = stack.back();
+        if (placed.count(current))
+        {
+            stack.pop_back();
+            continue;
+        }
+        if (expanded)
+        {
+            placed.insert(current);
+            stack.pop_back();
+
+            const Cell* cell = sheet.GetCellPtr(current);
+            Step& step = steps.emplace_back();
+            step.pos = current;
+            step.formula = cell->GetFormula();
+            step.size = step.formula->GetArraySize();
+            step.area = graph.GetSpill(current);
+            slots.emplace(current, static_cast<uint32_t>(steps.size()));
+            columns.insert(current.col);
+            if (!(step.size == Size{ 1, 1 }))
+            {
+                array_steps.push_back(static_cast<uint32_t>(steps.size() - 1));
+                for (int col = step.area.top_left.col; col < step.area.top_left.col + step.area.size.cols; ++col)
+                {
+                    columns.insert(col);
+                }
+            }
+            continue;
+        }
+
+        stack.back().second = true;
+        const Cell* cell = sheet.GetCellPtr(current);
+        std::vector<Position> reads;
+        for (const Position& reference : cell->GetReferencedCells())
+        {
+            reached_in(Range{ reference, Size{ 1, 1 } }, reads);
+        }
+        for (const Range& range : cell->GetReferencedRanges())
+        {
+            reached_in(range, reads);
+        }
+        for (const Position& pos : reads)
+        {
+            if (!placed.count(pos))
+            {
+                stack.emplace_back(pos, false);
+            }
+        }
+    }
+
+    slots.emplace(input, 0);
+    columns.insert(input.col);
+    values.assign(steps.size() + 1, 0.0);
+}
+
+void Solver::CheckVersion() const
+{
+    if (sheet.GetVersion() != version)
+    {
+        throw std::logic_error("Sheet changed since the solver was built");
+    }
+}
+
+std::optional<FormulaInterface::Value> Solver::FindValue(Position pos_) const
+{
+    if (const auto slot = slots.find(pos_); slot != slots.end())
+    {
+        return values[slot->second];
+    }
+    for (const uint32_t index : array_steps)
+    {
+        const Step& step = steps[index];
+        if (step.spilled && step.area.Contains(pos_))
+        {
+            const size_t row = static_cast<size_t>(pos_.row - step.area.top_left.row);
+            return step.array.Get(row * static_cast<size_t>(step.area.size.cols) + static_cast<size_t>(pos_.col - step.area.top_left.col));
+        }
+    }
+    return std::nullopt;
+}
+
+Solver::View::View(const Solver& solver_) : solver(solver_) {}
+
+void Solver::View::SetCell(Position /* pos */, std::string /* text */)
+{
+    throw std::logic_error("Solver view cannot be modified");
+}
+
+void Solver::View::ClearCell(Position /* pos */)
+{
+    throw std::logic_error("Solver view cannot be modified");
+}
+
+void Solver::View::PrintValues(std::ostream& /* output */) const
+{
+    throw std::logic_error("Solver view cannot be printed");
+}
+
+void Solver::View::PrintTexts(std::ostream& /* output */) const
+{
+    throw std::logic_error("Solver view cannot be printed");
+}
+
+const CellInterface* Solver::View::GetCell(Position pos_) const
+{
+    const std::optional<FormulaInterface::Value> value = solver.FindValue(pos_);
+    if (!value)
+    {
+        return solver.sheet.GetCell(pos_);
+    }
+
+    const CellInterface* cell = solver.sheet.GetCell(pos_);
+    SheetSnapshot::Entry entry(std::visit([](const auto& value_) -> CellInterface::Value { return value_; }, *value),
+        cell ? cell->GetText() : "", cell ? cell->GetReferencedCells() : std::vector<Position>{});
+    return &entries.insert_or_assign(pos_, std::move(entry)).first->second;
+}
+
+CellInterface* Solver::View::GetCell(Position pos_)
+{
+    return const_cast<CellInterface*>(static_cast<const View&>(*this).GetCell(pos_));
+}
+
+Size Solver::View::GetPrintableSize() const
+{
+    return solver.sheet.GetPrintableSize();
+}
+
+CellInterface::ValueView Solver::View::GetValueView(Position pos_) const
+{
+    if (const std::optional<FormulaInterface::Value> value = solver.FindValue(pos_))
+    {
+        return std::visit([](const auto& value_) -> CellInterface::ValueView { return value_; }, *value);
+    }
+    return solver.sheet.GetValueView(pos_);
+}
+
+bool Solver::View::CanSpill(Position anchor_, Size size_) const
+{
+    // Room depends on which cells have values, which the input does not change.
+    return solver.sheet.CanSpill(anchor_, size_);
+}
+
+int Solver::View::FindInColumn(Range column_, LookupKey key_, LookupMode mode_) const
+{
+    if (solver.columns.count(column_.top_left.col))
+    {
+        return SheetInterface::FindInColumn(column_, key_, mode_);
+    }
+    return solver.sheet.FindInColumn(column_, key_, mode_);
+}
+
+size_t Solver::View::CountIf(Range range_, const LookupCriterion& criterion_) const
+{
+    for (int col = range_.top_left.col; col < range_.top_left.col + range_.size.cols; ++col)
+    {
+        if (solver.columns.count(col))
+        {
+            return SheetInterface::CountIf(range_, criterion_);
+        }
+    }
+    return solver.sheet.CountIf(range_, criterion_);
+}
\ No newline at end of file
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "common.h"
+#include "formula.h"
+#include "snapshot.h"
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+class Sheet;
+
+// What one output cell of a sheet would hold for numbers put into one input cell,
+// without editing the sheet. The formulas between them, those reading the input and
+// read by the output through cells, ranges or spill areas, are found once in the
+// dependency graph and kept in evaluation order with a value slot each. Every
+// evaluation then runs those formulas alone against a view of the sheet where the
+// slots replace their cells; every other cell is read from the sheet as it is.
+// A solver answers for the version of the sheet it was built on.
+class Solver
+{
+public:
+
+    static const int MAX_ITERATIONS = 100;
+
+    Solver(const Sheet& sheet_, Position input_, Position output_);
+
+    // Value of the output cell with input_ in the input cell.
+    CellInterface::Value Evaluate(double input_);
+    // Input that brings the output within tolerance_ of target_, searched by the secant
+    // method from guess_; nothing when the output is not a number on the way or the
+    // search does not get there in MAX_ITERATIONS steps.
+    std::optional<double> GoalSeek(double target_, double guess_, double tolerance_ = 1e-9);
+
+    // Formulas evaluated for every input.
+    size_t GetConeSize() const;
+
+private:
+
+    struct Step
+    {
+        Position pos;
+        const FormulaInterface* formula = nullptr;
+        Size size;
+        // Area of an array formula, which its elements are read from while it has room.
+        Range area;
+        ArrayValue array;
+        bool spilled = false;
+    };
+
+    // The sheet as the formulas of the cone read it.
+    class View : public SheetInterface
+    {
+    public:
+
+        explicit View(const Solver& solver_);
+
+        // Read only: edits and printing throw std::logic_error.
+        void SetCell(Position pos_, std::string text_) override;
+        void ClearCell(Position pos_) override;
+        void PrintValues(std::ostream& output_) const override;
+        void PrintTexts(std::ostream& output_) const override;
+
+        const CellInterface* GetCell(Position pos_) const override;
+        CellInterface* GetCell(Position pos_) override;
+        Size GetPrintableSize() const override;
+        CellInterface::ValueView GetValueView(Position pos_) const override;
+        bool CanSpill(Position anchor_, Size size_) const override;
+
+        // Columns the cone writes to are read cell by cell, the rest through the sheet's indexes.
+        int FindInColumn(Range column_, LookupKey key_, LookupMode mode_) const override;
+        size_t CountIf(Range range_, const LookupCriterion& criterion_) const override;
+
+    private:
+
+        const Solver& solver;
+        // Cells handed out by GetCell for positions the cone writes to.
+        mutable std::unordered_map<Position, SheetSnapshot::Entry, PositionHasher> entries;
+    };
+
+    void ExtractCone();
+    void CheckVersion() const;
+    // Value the cone gives pos_, or nothing when pos_ is read from the sheet.
+    std::optional<FormulaInterface::Value> FindValue(Position pos_) const;
+
+    const Sheet& sheet;
+    Position input;
+    Position output;
+    uint64_t version;
+
+    std::vector<Step> steps;
+    // Slot 0 holds the input, slot i + 1 the value of steps[i].
+    std::vector<FormulaInterface::Value> values;
+    std::unordered_map<Position, uint32_t, PositionHasher> slots;
+    std::vector<uint32_t> array_steps;
+    std::unordered_set<int> columns;
+    View view;
+};
\ No newline at end of file
@@ -0,0 +1,87 @@
+#include "stringpool.h"
+
+#include <cstring>
+#include <new>
+
+std::string_view StringPool::Entry::GetText() const
+{
+    return { reinterpret_cast<const char*>(this + 1), size };
+}
+
+const StringPool* StringPool::Entry::GetPool() const
+{
+    return pool;
+}
+
+StringPool::StringPool(std::pmr::memory_resource* resource_) : entries(resource_) {}
+
+StringPool::Entry* StringPool::Intern(std::string_view text_)
+{
+    const auto found = entries.find(text_);
+    if (found != entries.end())
+    {
+        return Acquire(found->second);
+    }
+
+    Entry* entry = Allocate(text_, entries.get_allocator().resource());
+    entry->pool = this;
+    entries.emplace(entry->GetText(), entry);
+    entry_bytes += GetEntryBytes(text_.size());
+    return entry;
+}
+
+StringPool::Entry* StringPool::Allocate(std::string_view text_, std::pmr::memory_resource* resource_)
+{
+    void* memory = resource_->allocate(GetEntryBytes(text_.size()), alignof(Entry));
+    Entry* entry = new (memory) Entry;
+    entry->pool = nullptr;
+    entry->resource = resource_;
+    entry->refs = 1;
+    entry->size = static_cast<uint32_t>(text_.size());
+    std::memcpy(entry + 1, text_.data(), text_.size());
+    return entry;
+}
+
+StringPool::Entry* StringPool::Acquire(Entry* entry_)
+{
+    ++entry_->refs;
+    return entry_;
+}
+
+void StringPool::Release(Entry* entry_)
+{
+    if (--entry_->refs > 0)
+    {
+        return;
+    }
+
+    const size_t bytes = GetEntryBytes(entry_->size);
+    if (StringPool* pool = entry_->pool)
+    {
+        pool->entries.erase(entry_->GetText());
+        pool->entry_bytes -= bytes;
+    }
+    entry_->resource->deallocate(entry_, bytes, alignof(Entry));
+}
+
+size_t StringPool::GetEntryBytes(size_t length_)
+{
+    return sizeof(Entry) + length_;
+}
+
+size_t StringPool::GetCount() const
+{
+    return entries.size();
+}
+
+size_t StringPool::GetTextBytes() const
+{
+    return entry_bytes;
+}
+
+size_t StringPool::GetIndexBytes() const
+{
+    // Nodes carry a link and the cached hash next to the key and the entry pointer.
+    const size_t index_node = sizeof(std::pair<const std::string_view, Entry*>) + 2 * sizeof(void*);
+    return entries.bucket_count() * sizeof(void*) + entries.size() * index_node;
+}
\ No newline at end of file
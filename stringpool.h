@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+#include <memory_resource>
+#include <string_view>
+#include <unordered_map>
+
+// Deduplicated storage for the long texts of one sheet. Every distinct text is
+// kept once, after a header counting the cells that hold it, and cells hold a
+// pointer to that header. Within one pool two cells hold equal text exactly when
+// they hold the same entry. The text of an entry stays put while it is held.
+class StringPool
+{
+public:
+
+    class Entry
+    {
+    public:
+
+        std::string_view GetText() const;
+        const StringPool* GetPool() const;
+
+    private:
+
+        friend class StringPool;
+
+        StringPool* pool;
+        std::pmr::memory_resource* resource;
+        uint32_t refs;
+        uint32_t size;
+    };
+
+    explicit StringPool(std::pmr::memory_resource* resource_ = std::pmr::get_default_resource());
+    StringPool(const StringPool&) = delete;
+    StringPool& operator=(const StringPool&) = delete;
+
+    // Returns the entry for text_, creating it on first use; the caller owns one reference.
+    Entry* Intern(std::string_view text_);
+
+    // An entry of its own that belongs to no pool, for cells built outside a sheet.
+    static Entry* Allocate(std::string_view text_, std::pmr::memory_resource* resource_);
+
+    static Entry* Acquire(Entry* entry_);
+    static void Release(Entry* entry_);
+
+    // Bytes one entry takes for a text of length_.
+    static size_t GetEntryBytes(size_t length_);
+
+    size_t GetCount() const;
+    // Bytes of the entries, and of the hash index that finds them by text.
+    size_t GetTextBytes() const;
+    size_t GetIndexBytes() const;
+
+private:
+
+    std::pmr::unordered_map<std::string_view, Entry*> entries;
+    size_t entry_bytes = 0;
+};
\ No newline at end of file
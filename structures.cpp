@@ -1,12 +1,12 @@
 #include "common.h"
 
-#include <cctype>
-#include <sstream>
 #include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <tuple>
 
 const int LETTERS = 26;
-const int MAX_POSITION_LENGTH = 17;
-const int MAX_POS_LETTER_COUNT = 3;
+const size_t MAX_POS_LETTER_COUNT = 3;
 
 const Position Position::NONE = { -1, -1 };
 
@@ -26,70 +26,123 @@ bool Position::IsValid() const
 }
 
 std::string Position::ToString() const 
+{
+    char buffer[MAX_STRING_LENGTH];
+    return std::string(buffer, ToChars(buffer));
+}
+
+size_t Position::ToChars(char* buffer_) const
 {
     if (!IsValid()) 
     {
-        return "";
+        return 0;
     }
 
-    std::string result;
-    result.reserve(MAX_POSITION_LENGTH);
-    int c = col;
-
-    while (c >= 0) 
+    // Letters come out last to first, so they are collected before being written.
+    char letters[MAX_POS_LETTER_COUNT];
+    size_t count = 0;
+    for (int c = col; c >= 0; c = c / LETTERS - 1)
     {
-        result.insert(result.begin(), 'A' + c % LETTERS);
-        c = c / LETTERS - 1;
+        letters[count++] = static_cast<char>('A' + c % LETTERS);
     }
+    std::reverse_copy(letters, letters + count, buffer_);
 
-    result += std::to_string(row + 1);
-
-    return result;
+    const auto result = std::to_chars(buffer_ + count, buffer_ + MAX_STRING_LENGTH, row + 1);
+    return static_cast<size_t>(result.ptr - buffer_);
 }
 
 Position Position::FromString(std::string_view str_) 
 {
-    std::string_view::const_iterator it = std::find_if(str_.begin(), str_.end(), [](const char c) 
-        {
-        return !(std::isalpha(c) && std::isupper(c));
-        });
-
-    std::string_view letters = str_.substr(0, it - str_.begin());
-    std::string_view digits = str_.substr(it - str_.begin());
-
-    if (letters.empty() || digits.empty())
-    {
-        return Position::NONE;
-    }
-    if (letters.size() > MAX_POS_LETTER_COUNT) 
+    int col = 0;
+    size_t letters = 0;
+    for (; letters < str_.size() && str_[letters] >= 'A' && str_[letters] <= 'Z'; ++letters)
     {
-        return Position::NONE;
+        if (letters == MAX_POS_LETTER_COUNT)
+        {
+            return Position::NONE;
+        }
+        col = col * LETTERS + (str_[letters] - 'A' + 1);
     }
 
-    if (!std::isdigit(digits[0])) 
+    if (letters == 0 || letters == str_.size() || str_[letters] < '0' || str_[letters] > '9')
     {
         return Position::NONE;
     }
 
     int row = 0;
-    std::istringstream row_in{ std::string{digits} };
-
-    if (!(row_in >> row) || !row_in.eof()) 
+    const char* end = str_.data() + str_.size();
+    const auto result = std::from_chars(str_.data() + letters, end, row);
+    if (result.ec != std::errc() || result.ptr != end) 
     {
         return Position::NONE;
     }
 
-    int col = 0;
-    for (char ch : letters) 
+    return { row - 1, col - 1 };
+}
+
+void Position::FromStrings(const std::string_view* strs_, size_t count_, Position* out_)
+{
+    std::transform(strs_, strs_ + count_, out_, &Position::FromString);
+}
+
+void Position::ToStrings(const Position* positions_, size_t count_, char* buffer_, std::string_view* out_)
+{
+    for (size_t i = 0; i < count_; ++i)
     {
-        col *= LETTERS;
-        col += ch - 'A' + 1;
+        const size_t length = positions_[i].ToChars(buffer_);
+        out_[i] = std::string_view(buffer_, length);
+        buffer_ += length;
     }
-
-    return { row - 1, col - 1 };
 }
 
 bool Size::operator==(Size rhs_) const 
 {
     return cols == rhs_.cols && rows == rhs_.rows;
+}
+
+bool Range::operator==(const Range& rhs_) const
+{
+    return top_left == rhs_.top_left && size == rhs_.size;
+}
+
+bool Range::IsValid() const
+{
+    return top_left.IsValid() && size.rows >= 0 && size.cols >= 0
+        && size.rows <= Position::MAX_ROWS - top_left.row && size.cols <= Position::MAX_COLS - top_left.col;
+}
+
+bool Range::Contains(Position pos_) const
+{
+    return pos_.row >= top_left.row && pos_.row < top_left.row + size.rows
+        && pos_.col >= top_left.col && pos_.col < top_left.col + size.cols;
+}
+
+bool Range::Intersects(const Range& other_) const
+{
+    return top_left.row < other_.top_left.row + other_.size.rows && other_.top_left.row < top_left.row + size.rows
+        && top_left.col < other_.top_left.col + other_.size.cols && other_.top_left.col < top_left.col + size.cols;
+}
+
+size_t Range::GetCellCount() const
+{
+    return static_cast<size_t>(size.rows) * static_cast<size_t>(size.cols);
+}
+
+bool ParseCanonicalNumber(std::string_view text_, double& number_)
+{
+    const size_t MAX_NUMBER_LENGTH = 32;
+    if (text_.size() >= MAX_NUMBER_LENGTH)
+    {
+        return false;
+    }
+
+    const auto result = std::from_chars(text_.data(), text_.data() + text_.size(), number_);
+    if (result.ec != std::errc() || result.ptr != text_.data() + text_.size() || !std::isfinite(number_))
+    {
+        return false;
+    }
+
+    char buffer[MAX_NUMBER_LENGTH];
+    const auto spelled = std::to_chars(buffer, buffer + MAX_NUMBER_LENGTH, number_);
+    return std::string_view(buffer, static_cast<size_t>(spelled.ptr - buffer)) == text_;
 }
\ No newline at end of file
@@ -0,0 +1,201 @@
+#include "common.h"
+#include "recorder.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Re-runs a workload trace written by WorkloadRecorder against a fresh sheet and
+// prints one JSON line per operation type with its latency distribution:
+//
+//     spreadsheet_replay TRACE [--paced] [--repeat N]
+//
+// By default operations run back to back; --paced waits for each operation's
+// recorded time. Histogram buckets are powers of two in microseconds: the
+// bucket "8" counts operations that took from 4 up to 8 microseconds.
+
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+
+    struct Options
+    {
+        std::string trace;
+        bool paced = false;
+        int repeat = 1;
+    };
+
+    // Prints are formatted as usual and then thrown away.
+    class NullBuffer : public std::streambuf
+    {
+    protected:
+
+        int overflow(int ch_) override
+        {
+            return ch_;
+        }
+
+        std::streamsize xsputn(const char* /* data */, std::streamsize size_) override
+        {
+            return size_;
+        }
+    };
+
+    struct Latencies
+    {
+        std::vector<double> micros;
+        size_t errors = 0;
+    };
+
+    const char* GetName(WorkloadRecorder::OpType type_)
+    {
+        switch (type_)
+        {
+        case WorkloadRecorder::OpType::Set:
+            return "SetCell";
+
+        case WorkloadRecorder::OpType::Clear:
+            return "ClearCell";
+
+        case WorkloadRecorder::OpType::Get:
+            return "GetCell";
+
+        case WorkloadRecorder::OpType::PrintableSize:
+            return "GetPrintableSize";
+
+        case WorkloadRecorder::OpType::PrintValues:
+            return "PrintValues";
+
+        case WorkloadRecorder::OpType::PrintTexts:
+            return "PrintTexts";
+        }
+        return "";
+    }
+
+    double Percentile(const std::vector<double>& sorted_, double fraction_)
+    {
+        return sorted_[static_cast<size_t>(fraction_ * static_cast<double>(sorted_.size() - 1))];
+    }
+
+    void Report(const char* name_, Latencies& latencies_)
+    {
+        std::vector<double>& sorted = latencies_.micros;
+        std::sort(sorted.begin(), sorted.end());
+
+        std::map<uint64_t, size_t> histogram;
+        for (double latency : sorted)
+        {
+            uint64_t bucket = 1;
+            while (static_cast<double>(bucket) < latency)
+            {
+                bucket *= 2;
+            }
+            ++histogram[bucket];
+        }
+
+        std::cout << "{\"op\":\"" << name_ << "\""
+                  << ",\"count\":" << sorted.size()
+                  << ",\"errors\":" << latencies_.errors
+                  << ",\"p50_us\":" << Percentile(sorted, 0.50)
+                  << ",\"p90_us\":" << Percentile(sorted, 0.90)
+                  << ",\"p99_us\":" << Percentile(sorted, 0.99)
+                  << ",\"max_us\":" << sorted.back()
+                  << ",\"histogram\":{";
+
+        bool first = true;
+        for (const auto& [bucket, count] : histogram)
+        {
+            std::cout << (first ? "" : ",") << "\"" << bucket << "\":" << count;
+            first = false;
+        }
+        std::cout << "}}" << std::endl;
+    }
+
+    bool ParseOptions(int argc_, char** argv_, Options& options_)
+    {
+        for (int i = 1; i < argc_; ++i)
+        {
+            if (std::strcmp(argv_[i], "--paced") == 0)
+            {
+                options_.paced = true;
+            }
+            else if (std::strcmp(argv_[i], "--repeat") == 0 && i + 1 < argc_)
+            {
+                options_.repeat = std::stoi(argv_[++i]);
+            }
+            else if (options_.trace.empty() && argv_[i][0] != '-')
+            {
+                options_.trace = argv_[i];
+            }
+            else
+            {
+                return false;
+            }
+        }
+        return !options_.trace.empty();
+    }
+}  // namespace
+
+int main(int argc_, char** argv_)
+{
+    Options options;
+    if (!ParseOptions(argc_, argv_, options))
+    {
+        std::cerr << "usage: spreadsheet_replay TRACE [--paced] [--repeat N]" << std::endl;
+        return 1;
+    }
+
+    std::vector<WorkloadRecorder::Operation> operations;
+    try
+    {
+        operations = WorkloadRecorder::ReadTrace(options.trace);
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    NullBuffer null_buffer;
+    std::ostream output(&null_buffer);
+    std::map<WorkloadRecorder::OpType, Latencies> latencies;
+
+    for (int run = 0; run < options.repeat; ++run)
+    {
+        auto sheet = CreateSheet();
+        const auto start = Clock::now();
+
+        for (const WorkloadRecorder::Operation& operation : operations)
+        {
+            if (options.paced)
+            {
+                std::this_thread::sleep_until(start + operation.time);
+            }
+
+            Latencies& bucket = latencies[operation.type];
+            const auto begin = Clock::now();
+            try
+            {
+                WorkloadRecorder::Apply(operation, *sheet, output);
+            }
+            catch (const std::exception&)
+            {
+                // Rejected edits are part of the workload; they are timed like the rest.
+                ++bucket.errors;
+            }
+            bucket.micros.push_back(std::chrono::duration<double, std::micro>(Clock::now() - begin).count());
+        }
+    }
+
+    for (auto& [type, bucket] : latencies)
+    {
+        Report(GetName(type), bucket);
+    }
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,175 @@
+#include "tracing.h"
+
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+std::atomic<bool> Tracer::enabled = false;
+
+class Tracer::ThreadBuffer
+{
+public:
+
+    explicit ThreadBuffer(uint32_t thread_id_) : events(EVENTS_PER_THREAD), thread_id(thread_id_) {}
+
+    // Only the owning thread writes; the newest events overwrite the oldest.
+    void Push(const Event& event_)
+    {
+        const uint64_t index = head.load(std::memory_order_relaxed);
+        events[index % events.size()] = event_;
+        head.store(index + 1, std::memory_order_release);
+    }
+
+    template <typename Action>
+    void ForEach(Action&& action_) const
+    {
+        const uint64_t end = head.load(std::memory_order_acquire);
+        const uint64_t begin = end > events.size() ? end - events.size() : 0;
+        for (uint64_t index = begin; index < end; ++index)
+        {
+            action_(events[index % events.size()]);
+        }
+    }
+
+    void Clear()
+    {
+        head.store(0, std::memory_order_release);
+    }
+
+    uint32_t GetThreadId() const
+    {
+        return thread_id;
+    }
+
+private:
+
+    std::vector<Event> events;
+    std::atomic<uint64_t> head = 0;
+    const uint32_t thread_id;
+};
+
+// Buffers stay registered after their thread exits so its events can still be dumped.
+struct Tracer::Registry
+{
+    std::mutex mutex;
+    std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+};
+
+namespace
+{
+    const auto ORIGIN = std::chrono::steady_clock::now();
+}  // namespace
+
+Tracer::Registry& Tracer::GetRegistry()
+{
+    static Registry registry;
+    return registry;
+}
+
+Tracer::ThreadBuffer& Tracer::GetThreadBuffer()
+{
+    thread_local std::shared_ptr<ThreadBuffer> buffer;
+
+    if (!buffer)
+    {
+        Registry& registry = GetRegistry();
+        std::lock_guard lock(registry.mutex);
+        buffer = std::make_shared<ThreadBuffer>(static_cast<uint32_t>(registry.buffers.size() + 1));
+        registry.buffers.push_back(buffer);
+    }
+    return *buffer;
+}
+
+std::vector<std::shared_ptr<Tracer::ThreadBuffer>> Tracer::GetBuffers()
+{
+    Registry& registry = GetRegistry();
+    std::lock_guard lock(registry.mutex);
+    return registry.buffers;
+}
+
+void Tracer::Start()
+{
+    enabled.store(true, std::memory_order_relaxed);
+}
+
+void Tracer::Stop()
+{
+    enabled.store(false, std::memory_order_relaxed);
+}
+
+void Tracer::Clear()
+{
+    for (const auto& buffer : GetBuffers())
+    {
+        buffer->Clear();
+    }
+}
+
+int64_t Tracer::Now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - ORIGIN).count();
+}
+
+void Tracer::Record(const Event& event_)
+{
+    GetThreadBuffer().Push(event_);
+}
+
+void Tracer::WriteChromeTrace(const std::string& path_)
+{
+    std::ofstream out(path_, std::ios::trunc);
+    if (!out)
+    {
+        throw std::runtime_error("Cannot open trace file " + path_);
+    }
+
+    out << std::fixed << std::setprecision(3) << "{\"traceEvents\":[";
+    bool first = true;
+    for (const auto& buffer : GetBuffers())
+    {
+        buffer->ForEach([&](const Event& event_)
+            {
+                out << (first ? "\n" : ",\n");
+                first = false;
+
+                // Chrome trace timestamps are in microseconds.
+                out << "{\"name\":\"" << event_.name << "\",\"cat\":\"" << event_.category << "\",\"ph\":\"X\""
+                    << ",\"ts\":" << static_cast<double>(event_.start_ns) / 1000
+                    << ",\"dur\":" << static_cast<double>(event_.duration_ns) / 1000
+                    << ",\"pid\":1,\"tid\":" << buffer->GetThreadId();
+                if (event_.cell.IsValid())
+                {
+                    char name[Position::MAX_STRING_LENGTH];
+                    out << ",\"args\":{\"cell\":\"";
+                    out.write(name, static_cast<std::streamsize>(event_.cell.ToChars(name))) << "\"}";
+                }
+                out << "}";
+            });
+    }
+    out << "\n]}\n";
+
+    if (!out)
+    {
+        throw std::runtime_error("Cannot write trace file " + path_);
+    }
+}
+
+TraceScope::TraceScope(const char* name_, const char* category_, Position cell_) : name(name_), category(category_), cell(cell_)
+{
+    if (Tracer::IsEnabled())
+    {
+        start_ns = Tracer::Now();
+    }
+}
+
+TraceScope::~TraceScope()
+{
+    if (start_ns >= 0)
+    {
+        Tracer::Record(Tracer::Event{ name, category, start_ns, Tracer::Now() - start_ns, cell });
+    }
+}
\ No newline at end of file
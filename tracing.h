@@ -0,0 +1,75 @@
+#pragma once
+
+#include "common.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Timeline events in the Chrome trace format (chrome://tracing, ui.perfetto.dev).
+// Each thread writes its events into its own ring buffer without locking; only the
+// first event of a thread registers its buffer. When tracing is off a scope costs
+// one relaxed load. Dump after Stop(), once the traced threads are done recording.
+class Tracer
+{
+public:
+
+    struct Event
+    {
+        const char* name;
+        const char* category;
+        int64_t start_ns;
+        int64_t duration_ns;
+        Position cell;
+    };
+
+    static const size_t EVENTS_PER_THREAD = 1 << 15;
+
+    static void Start();
+    static void Stop();
+    static void Clear();
+
+    static bool IsEnabled()
+    {
+        return enabled.load(std::memory_order_relaxed);
+    }
+
+    static int64_t Now();
+    static void Record(const Event& event_);
+
+    // Throws std::runtime_error if the file cannot be written.
+    static void WriteChromeTrace(const std::string& path_);
+
+private:
+
+    class ThreadBuffer;
+    struct Registry;
+
+    static Registry& GetRegistry();
+    static ThreadBuffer& GetThreadBuffer();
+    static std::vector<std::shared_ptr<ThreadBuffer>> GetBuffers();
+
+    static std::atomic<bool> enabled;
+};
+
+// Records one complete event spanning the lifetime of the scope. Names and
+// categories must be string literals: only the pointers are stored.
+class TraceScope
+{
+public:
+
+    TraceScope(const char* name_, const char* category_, Position cell_ = Position::NONE);
+    ~TraceScope();
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+
+    const char* name;
+    const char* category;
+    Position cell;
+    int64_t start_ns = -1;
+};
\ No newline at end of file
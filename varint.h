@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// Unsigned integers in little-endian base-128: seven bits per byte, high bit set on all but the last.
+
+template <typename Unsigned>
+void PutVarint(std::vector<char>& out_, Unsigned value_)
+{
+    while (value_ >= 0x80)
+    {
+        out_.push_back(static_cast<char>(value_ | 0x80));
+        value_ >>= 7;
+    }
+    out_.push_back(static_cast<char>(value_));
+}
+
+template <typename Unsigned>
+bool GetVarint(const char*& it_, const char* end_, Unsigned& value_)
+{
+    const int max_shift = static_cast<int>((sizeof(Unsigned) * 8 + 6) / 7 * 7);
+
+    value_ = 0;
+    for (int shift = 0; shift < max_shift && it_ != end_; shift += 7)
+    {
+        const auto byte = static_cast<unsigned char>(*it_++);
+        value_ |= static_cast<Unsigned>(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+        {
+            return true;
+        }
+    }
+    return false;
+}
\ No newline at end of file